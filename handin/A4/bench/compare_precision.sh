@@ -0,0 +1,30 @@
+#!/bin/sh
+# Renders scenes from data/ with both the double (rt) and float (rt_float)
+# builds and reports how far apart the images are, along with each build's
+# render time. Run from anywhere; pass scene names (e.g. "simple macho-cows")
+# to pick scenes, otherwise every scene in data/ is rendered.
+set -e
+A4=$(cd "$(dirname "$0")/.." && pwd)
+OUT=${OUT:-$A4/bench/precision}
+
+make -C "$A4/src" rt rt_float imgcompare
+# Render in a copy of data/ so its reference images aren't overwritten.
+rm -rf "$OUT/work"
+mkdir -p "$OUT/work"
+cp -R "$A4/data/." "$OUT/work"
+
+if [ $# -eq 0 ]; then
+  set -- $(cd "$A4/data" && grep -l "gr.render" *.lua | sed 's/\.lua$//')
+fi
+
+cd "$OUT/work"
+for scene in "$@"; do
+  # The image name is set by the script itself.
+  image=$(grep -o "'[^']*\.png'" "$scene.lua" | head -n 1 | tr -d "'")
+  for build in rt rt_float; do
+    "$A4/src/$build" "$scene.lua" > "$OUT/$scene-$build.log"
+    mv "$image" "$OUT/$scene-$build.png"
+    echo "$scene: $build $(grep "Done in" "$OUT/$scene-$build.log")"
+  done
+  "$A4/src/imgcompare" "$OUT/$scene-rt.png" "$OUT/$scene-rt_float.png" "$OUT/$scene-difference.png"
+done
@@ -0,0 +1,75 @@
+// Reports how far one rendered PNG is from another, pixel by pixel, in
+// 8-bit steps: e.g. a render from the single precision build against the
+// same scene from the default double build. Build it with
+// "make imgcompare" in src/.
+//
+//   imgcompare reference.png test.png [difference.png]
+//
+// The optional third image shows each pixel's largest channel error,
+// scaled up 16 times so small errors are visible. Exits with 2 if the
+// images can't be compared.
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include "image.hpp"
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " reference.png test.png [difference.png]" << std::endl;
+    return 2;
+  }
+
+  Image reference, test;
+  if (!reference.loadPng(argv[1]) || !test.loadPng(argv[2])) {
+    return 2;
+  }
+  const int width = reference.width(), height = reference.height();
+  if (test.width() != width || test.height() != height) {
+    std::cerr << "Images are different sizes: " << width << "x" << height << " and "
+      << test.width() << "x" << test.height() << std::endl;
+    return 2;
+  }
+  const int channels = std::min(3, std::min(reference.elements(), test.elements()));
+
+  Image difference(width, height, 3);
+  double maxError = 0.0, sumError = 0.0, sumSquares = 0.0;
+  long differing = 0, visible = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      double pixelError = 0.0;
+      for (int c = 0; c < channels; c++) {
+        // Both were quantized to 8 bits, so errors are whole steps.
+        const double error = std::floor(std::abs(test(x, y, c) - reference(x, y, c)) * 255.0 + 0.5);
+        pixelError = std::max(pixelError, error);
+        sumError += error;
+        sumSquares += error * error;
+      }
+      maxError = std::max(maxError, pixelError);
+      differing += pixelError > 1.0;
+      visible += pixelError > 8.0;
+      for (int c = 0; c < 3; c++) {
+        difference(x, y, c) = std::min(1.0, pixelError * 16.0 / 255.0);
+      }
+    }
+  }
+
+  const double samples = (double) width * height * channels;
+  const double rmse = std::sqrt(sumSquares / samples);
+  std::printf("%s vs %s (%dx%d)\n", argv[2], argv[1], width, height);
+  std::printf("  max error:  %.0f/255\n", maxError);
+  std::printf("  mean error: %.4f/255\n", sumError / samples);
+  std::printf("  rmse:       %.4f/255\n", rmse);
+  if (rmse > 0.0) {
+    std::printf("  psnr:       %.2f dB\n", 20.0 * std::log10(255.0 / rmse));
+  } else {
+    std::printf("  psnr:       identical\n");
+  }
+  std::printf("  pixels off by more than 1/255: %ld (%.3f%%)\n", differing, 100.0 * differing / ((double) width * height));
+  std::printf("  pixels off by more than 8/255: %ld (%.3f%%)\n", visible, 100.0 * visible / ((double) width * height));
+
+  if (argc > 3) {
+    difference.savePng(argv[3]);
+  }
+  return 0;
+}
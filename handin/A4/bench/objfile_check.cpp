@@ -0,0 +1,64 @@
+// Checks read_obj against objfile_check.obj, which has face lines with
+// trailing comments and whitespace, "v/vt/vn" indices, negative indices
+// and a CRLF ending, and objfile_bad.obj, whose face has a stray token.
+// Build it with "make objfile_check" in src/ and run it from there:
+//
+//   ./objfile_check [../bench]
+//
+// Prints each mismatch and exits with 1 if there are any.
+#include <iostream>
+#include <string>
+#include <vector>
+#include "objfile.hpp"
+
+int main(int argc, char** argv) {
+  const std::string directory = argc > 1 ? argv[1] : "../bench";
+  int failures = 0;
+
+  std::vector<Point3D> verts;
+  std::vector< std::vector<int> > faces;
+  std::string error;
+  if (!read_obj(directory + "/objfile_check.obj", verts, faces, error)) {
+    std::cerr << "objfile_check.obj: " << error << std::endl;
+    return 1;
+  }
+  const int expected[5][4] = {
+    {0, 1, 2, -1},
+    {0, 2, 3, -1},
+    {0, 1, 2, 3},
+    {0, 1, 2, -1},
+    {1, 2, 3, -1}
+  };
+  if (verts.size() != 4 || faces.size() != 5) {
+    std::cerr << "objfile_check.obj: read " << verts.size() << " vertices and " << faces.size()
+      << " faces, expected 4 and 5" << std::endl;
+    failures++;
+  }
+  for (size_t i = 0; i < faces.size() && i < 5; i++) {
+    std::vector<int> face;
+    for (int j = 0; j < 4 && expected[i][j] >= 0; j++) {
+      face.push_back(expected[i][j]);
+    }
+    if (faces[i] != face) {
+      std::cerr << "objfile_check.obj: face " << i + 1 << " is wrong" << std::endl;
+      failures++;
+    }
+  }
+  if (verts.size() == 4 && (verts[2][0] != 1.0 || verts[2][1] != 1.0 || verts[2][2] != 0.0)) {
+    std::cerr << "objfile_check.obj: vertex 3 is " << verts[2] << std::endl;
+    failures++;
+  }
+
+  if (read_obj(directory + "/objfile_bad.obj", verts, faces, error)) {
+    std::cerr << "objfile_bad.obj: read without an error" << std::endl;
+    failures++;
+  } else if (error.find("line 4: malformed face index") == std::string::npos) {
+    std::cerr << "objfile_bad.obj: unexpected error: " << error << std::endl;
+    failures++;
+  }
+
+  if (failures == 0) {
+    std::cout << "OBJ loader checks passed." << std::endl;
+  }
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,93 @@
+// Times camera ray generation on its own, with four samples a pixel as under
+// anti-aliasing, and compares it against building the view matrices for
+// every sample the way raytrace_pixel used to. Build it with
+// "make raygen_bench" in src/ and run it with an optional image size.
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include "camera.hpp"
+#include "matrices.hpp"
+
+// The old per-sample camera: builds and multiplies five matrices per ray.
+static Ray matrix_ray(int x, int y, int width, int height, const ViewParams& view) {
+  double d = 50.0;
+  double virtualH = 2.0 * d * tan(view.fov / 2.0);
+  double virtualW = ((double)width) / height * virtualH;
+
+  Point3D pixel(x, y, d);
+
+  Matrix4x4 translatePixelToOrigin = translation(Vector3D(-width/2, -height/2, 0));
+  Matrix4x4 scalePixel = scaling(Vector3D(virtualW/width, -virtualH/height, 1.0));
+
+  Vector3D w = view.view;
+  Vector3D u = w.cross(view.up);
+  u.normalize();
+  w.normalize();
+  Vector3D v = u.cross(w);
+
+  Matrix4x4 rotatePixelToWCS = Matrix4x4((double[16]) {
+    u[X], v[X], w[X], 0,
+    u[Y], v[Y], w[Y], 0,
+    u[Z], v[Z], w[Z], 0,
+       0,    0,    0, 1
+  });
+
+  Matrix4x4 pixelEyeTranslation = translation(view.eye - Point3D());
+
+  Point3D pixelWorld = pixelEyeTranslation * rotatePixelToWCS * scalePixel * translatePixelToOrigin * pixel;
+
+  Vector3D rayDir = pixelWorld - view.eye;
+  rayDir.normalize();
+
+  return Ray(view.eye, rayDir);
+}
+
+int main(int argc, char** argv) {
+  int size = 1024;
+  if (argc >= 2) {
+    size = atoi(argv[1]);
+  }
+  const int width = size, height = size;
+  const long rays = 4L * width * height;
+
+  // The camera from macho-cows.lua.
+  ViewParams view(Point3D(0, 2, 30), Vector3D(0, 0, -1), Vector3D(0, 1, 0), 50 * M_PI / 180.0);
+
+  // Sum the directions so the compiler can't skip any of the work.
+  double start = seconds_now();
+  Camera camera(view, width, height);
+  Vector3D cameraSum;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int sample = 0; sample < 4; sample++) {
+        cameraSum = cameraSum + camera.ray(x - sample / 2, y - sample % 2).dir;
+      }
+    }
+  }
+  double cameraSeconds = seconds_now() - start;
+
+  start = seconds_now();
+  Vector3D matrixSum;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int sample = 0; sample < 4; sample++) {
+        matrixSum = matrixSum + matrix_ray(x - sample / 2, y - sample % 2, width, height, view).dir;
+      }
+    }
+  }
+  double matrixSeconds = seconds_now() - start;
+
+  double maxDifference = 0.0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      Vector3D difference = camera.ray(x, y).dir - matrix_ray(x, y, width, height, view).dir;
+      maxDifference = std::max(maxDifference, difference.length());
+    }
+  }
+
+  std::cout << "Generated " << rays << " rays for a " << width << "x" << height << " image." << std::endl
+    << "Camera: " << cameraSeconds << "s (" << cameraSeconds * 1e9 / rays << "ns per ray)" << std::endl
+    << "Per-sample matrices: " << matrixSeconds << "s (" << matrixSeconds * 1e9 / rays << "ns per ray)" << std::endl
+    << "Largest difference in direction: " << maxDifference << std::endl
+    << "Checksums: " << cameraSum << " " << matrixSum << std::endl;
+}
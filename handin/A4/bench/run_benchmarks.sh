@@ -0,0 +1,146 @@
+#!/bin/sh
+# Benchmarks rt on the scenes in data/. Each scene is rendered RUNS times (3
+# by default) with each thread count in THREADS ("1 4" by default), and the
+# fastest run is kept. Scenes are rendered in a scratch copy of data/, so
+# the reference images there are never overwritten, at the size each script
+# asks for. Pass scene names (e.g. "simple macho-cows") to pick scenes,
+# otherwise every scene in data/ is rendered.
+#
+# For each scene and thread count, $OUT/results.tsv gets the wall time, the
+# rays per second and peak memory from the render's JSON report, and the
+# mean error and PSNR against the scene's checked-in PNG, if there is one.
+#
+# CACHE says which scene loads are timed, and is recorded with the results:
+# "cold" (the default) deletes the scene's .cache file before every run, so
+# each one runs the script; "warm" renders the scene once beforehand, so
+# every timed run loads it from the cache.
+#
+# If a baseline exists (bench/baseline.tsv, or $BASELINE), exits with 1 when
+# any scene got more than THRESHOLD percent (10 by default) slower in wall
+# time or rays per second. Run with --save-baseline to make this run's
+# results the new baseline.
+set -e
+A4=$(cd "$(dirname "$0")/.." && pwd)
+OUT=${OUT:-$A4/bench/results}
+BASELINE=${BASELINE:-$A4/bench/baseline.tsv}
+RUNS=${RUNS:-3}
+THREADS=${THREADS:-"1 4"}
+THRESHOLD=${THRESHOLD:-10}
+CACHE=${CACHE:-cold}
+
+if [ "$CACHE" != cold ] && [ "$CACHE" != warm ]; then
+  echo "CACHE must be cold or warm." >&2
+  exit 2
+fi
+
+save_baseline=false
+if [ "$1" = "--save-baseline" ]; then
+  save_baseline=true
+  shift
+fi
+
+make -C "$A4/src" rt imgcompare
+rm -rf "$OUT/work"
+mkdir -p "$OUT/work"
+cp -R "$A4/data/." "$OUT/work"
+
+if [ $# -eq 0 ]; then
+  set -- $(cd "$A4/data" && grep -l "gr.render" *.lua | sed 's/\.lua$//')
+fi
+
+# Pulls a number out of the render report, which has one field per line.
+report_field() {
+  grep -o "\"$2\": [0-9.e+-]*" "$1" | head -n 1 | sed 's/.*: //'
+}
+
+results="$OUT/results.tsv"
+printf "scene\tthreads\tseconds\trays_per_second\tmax_rss_kb\tmean_error\tpsnr\tcache\n" > "$results"
+cd "$OUT/work"
+for scene in "$@"; do
+  # The image name is set by the script itself.
+  image=$(grep -o "'[^']*\.png'" "$scene.lua" | head -n 1 | tr -d "'")
+  report=$(echo "$image" | sed 's/\.png$//').json
+  reference="$A4/data/$image"
+  if [ ! -f "$reference" ]; then
+    reference="$A4/data/$scene.png"
+  fi
+
+  rm -f "$scene.lua.cache"
+  if [ "$CACHE" = warm ]; then
+    "$A4/src/rt" "$scene.lua" > "$OUT/$scene-warm.log"
+  fi
+
+  for threads in $THREADS; do
+    best=""
+    run=0
+    while [ $run -lt "$RUNS" ]; do
+      if [ "$CACHE" = cold ]; then
+        rm -f "$scene.lua.cache"
+      fi
+      start=$(date +%s.%N)
+      RT_THREADS=$threads "$A4/src/rt" "$scene.lua" > "$OUT/$scene-$threads.log"
+      end=$(date +%s.%N)
+      seconds=$(echo "$start $end" | awk '{printf "%.3f", $2 - $1}')
+      if [ -z "$best" ] || [ "$(echo "$seconds $best" | awk '{print ($1 < $2)}')" = 1 ]; then
+        best=$seconds
+        cp "$image" "$OUT/$scene-$threads.png"
+        cp "$report" "$OUT/$scene-$threads.json"
+      fi
+      run=$((run + 1))
+    done
+
+    mean="-"
+    psnr="-"
+    if [ -f "$reference" ]; then
+      "$A4/src/imgcompare" "$reference" "$OUT/$scene-$threads.png" > "$OUT/$scene-$threads.compare" || true
+      mean=$(grep "mean error" "$OUT/$scene-$threads.compare" | awk '{print $3}' | sed 's|/255||')
+      psnr=$(grep "psnr" "$OUT/$scene-$threads.compare" | awk '{print $2}')
+    fi
+    raysPerSecond=$(report_field "$OUT/$scene-$threads.json" rays_per_second)
+    maxRss=$(report_field "$OUT/$scene-$threads.json" max_rss_kb)
+    printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "$scene" "$threads" "$best" \
+      "${raysPerSecond:--}" "${maxRss:--}" "${mean:--}" "${psnr:--}" "$CACHE" >> "$results"
+    echo "$scene ($threads threads, $CACHE cache): ${best}s, ${raysPerSecond:-?} rays/s, ${maxRss:-?} KB, error ${mean:--}/255 vs $(basename "$reference")"
+  done
+done
+
+if $save_baseline; then
+  cp "$results" "$BASELINE"
+  echo "Saved baseline to $BASELINE"
+  exit 0
+fi
+if [ ! -f "$BASELINE" ]; then
+  echo "No baseline at $BASELINE; run with --save-baseline to make one."
+  exit 0
+fi
+
+# Compare against the baseline row for the same scene, thread count and
+# cache mode.
+awk -F '\t' -v threshold="$THRESHOLD" '
+  FNR == 1 { next }
+  NR == FNR { seconds[$1 "\t" $2 "\t" $8] = $3; rays[$1 "\t" $2 "\t" $8] = $4; next }
+  {
+    key = $1 "\t" $2 "\t" $8
+    if (!(key in seconds)) {
+      next
+    }
+    slower = 100 * ($3 - seconds[key]) / seconds[key]
+    status = "ok"
+    if (slower > threshold) {
+      status = "REGRESSED"
+      failed = 1
+    }
+    if ($4 != "-" && rays[key] != "-" && rays[key] > 0) {
+      fewer = 100 * (rays[key] - $4) / rays[key]
+      if (fewer > threshold) {
+        status = "REGRESSED"
+        failed = 1
+      }
+    }
+    printf "%-12s %2s threads, %s: %8.3fs vs %8.3fs (%+.1f%%) %s\n", $1, $2, $8, $3, seconds[key], slower, status
+  }
+  END { exit failed }
+' "$BASELINE" "$results" || {
+  echo "Performance regressed by more than $THRESHOLD% against $BASELINE."
+  exit 1
+}
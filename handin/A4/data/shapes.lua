@@ -0,0 +1,42 @@
+-- The analytic primitives: a torus, a cone and a cylinder standing on a
+-- reflective disc.
+
+red = gr.material({0.8, 0.2, 0.2}, {0.5, 0.5, 0.5}, 25)
+green = gr.material({0.2, 0.8, 0.2}, {0.5, 0.5, 0.5}, 25)
+blue = gr.material({0.3, 0.3, 0.9}, {0.5, 0.5, 0.5}, 25)
+floor = gr.material({0.6, 0.6, 0.6}, {0.2, 0.2, 0.2}, 10, 0.3)
+
+scene = gr.node('root')
+
+torus = gr.torus('torus', 0.3)
+scene:add_child(torus)
+torus:set_material(red)
+torus:translate(-1.5, 1, 0)
+torus:rotate('X', 60)
+
+cylinder = gr.cylinder('cylinder')
+scene:add_child(cylinder)
+cylinder:set_material(green)
+cylinder:translate(1.5, 1, 0)
+cylinder:rotate('X', 20)
+cylinder:scale(0.6, 0.8, 0.6)
+
+cone = gr.cone('cone')
+scene:add_child(cone)
+cone:set_material(blue)
+cone:translate(0, 1, -1.5)
+cone:scale(0.6, 0.9, 0.6)
+
+disc = gr.disc('disc')
+scene:add_child(disc)
+disc:set_material(floor)
+disc:translate(0, -0.01, 0)
+disc:scale(4, 1, 4)
+
+white_light = gr.light({5, 8, 6}, {0.8, 0.8, 0.8}, {1, 0, 0})
+blue_light = gr.light({-6, 4, 3}, {0.3, 0.3, 0.5}, {1, 0, 0})
+
+gr.render(scene, 'shapes.png', 384, 384,
+  {0, 3, 7}, {0, -0.35, -1}, {0, 1, 0}, 50,
+  {0.3, 0.3, 0.3}, {white_light, blue_light}
+)
@@ -0,0 +1,57 @@
+-- An animation: the analytic primitives from shapes.lua, with the camera
+-- circling them once and the torus spinning, over 36 frames
+-- (turntable-0001.png to turntable-0036.png).
+
+red = gr.material({0.8, 0.2, 0.2}, {0.5, 0.5, 0.5}, 25)
+green = gr.material({0.2, 0.8, 0.2}, {0.5, 0.5, 0.5}, 25)
+blue = gr.material({0.3, 0.3, 0.9}, {0.5, 0.5, 0.5}, 25)
+floor = gr.material({0.6, 0.6, 0.6}, {0.2, 0.2, 0.2}, 10, 0.3)
+
+scene = gr.node('root')
+
+torus = gr.torus('torus', 0.3)
+scene:add_child(torus)
+torus:set_material(red)
+
+cylinder = gr.cylinder('cylinder')
+scene:add_child(cylinder)
+cylinder:set_material(green)
+cylinder:translate(1.5, 1, 0)
+cylinder:rotate('X', 20)
+cylinder:scale(0.6, 0.8, 0.6)
+
+cone = gr.cone('cone')
+scene:add_child(cone)
+cone:set_material(blue)
+cone:translate(0, 1, -1.5)
+cone:scale(0.6, 0.9, 0.6)
+
+disc = gr.disc('disc')
+scene:add_child(disc)
+disc:set_material(floor)
+disc:translate(0, -0.01, 0)
+disc:scale(4, 1, 4)
+
+white_light = gr.light({5, 8, 6}, {0.8, 0.8, 0.8}, {1, 0, 0})
+blue_light = gr.light({-6, 4, 3}, {0.3, 0.3, 0.5}, {1, 0, 0})
+
+frames = 36
+
+function update(frame)
+  local angle = 2 * math.pi * (frame - 1) / frames
+
+  -- Posed from scratch each frame, so nothing builds up.
+  torus:reset_transform()
+  torus:translate(-1.5, 1, 0)
+  torus:rotate('Y', 360 * (frame - 1) / frames)
+  torus:rotate('X', 60)
+
+  local eye = {7 * math.sin(angle), 3, 7 * math.cos(angle)}
+  return eye, {-eye[1], -2.45, -eye[3]}
+end
+
+gr.animate(scene, 'turntable.png', 384, 384,
+  {0, 3, 7}, {0, -2.45, -7}, {0, 1, 0}, 50,
+  {0.3, 0.3, 0.3}, {white_light, blue_light},
+  frames, update
+)
@@ -1,9 +1,14 @@
 #include "a4.hpp"
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <limits>
 #include <iostream>
-#include "matrices.hpp"
+#include <set>
 #include "algebra.hpp"
+#include "distributed.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
 
 #define SHADOWS true
 #define REFLECTIONS true
@@ -15,14 +20,234 @@
 #define ANTI_ALIASING true
 #endif
 
-#ifndef NUM_THREADS
-#define NUM_THREADS 8
+// Anti-aliasing is adaptive: every pixel gets one primary sample, and only
+// pixels on an edge take refine samples on top of it, on a grid of up to
+// AA_MAX_SAMPLES strata (rounded down to an even square, so at least 4).
+// A pixel takes at most AA_MAX_SAMPLES + 1 samples in all.
+#ifndef AA_MAX_SAMPLES
+#define AA_MAX_SAMPLES 16
+#endif
+#if AA_MAX_SAMPLES < 4
+#error AA_MAX_SAMPLES counts refine samples, and the smallest grid has 4
+#endif
+// A pixel is on an edge if a neighbour shows a different object or differs
+// by more than this in any channel.
+#define AA_CONTRAST 0.05
+// Supersampling stops early once the variance of a pixel's samples (in
+// its worst channel) drops below this.
+#define AA_VARIANCE 0.0005
+
+// Also save a greyscale image of how many samples each pixel took, next to
+// the render with "-samples" added to its name.
+#ifndef SAMPLE_DENSITY_IMAGE
+#define SAMPLE_DENSITY_IMAGE false
+#endif
+
+// Images with more pixels than this are rendered a band of
+// STREAM_BAND_ROWS rows at a time, each written out as soon as it is done,
+// instead of being held in memory whole. Streamed renders can't be
+// checkpointed.
+#ifndef STREAM_OUTPUT_PIXELS
+#define STREAM_OUTPUT_PIXELS 16000000
+#endif
+#ifndef STREAM_BAND_ROWS
+#define STREAM_BAND_ROWS 32
+#endif
+
+// Also save the unclamped image as 32-bit floats, in a .pfm beside the PNG.
+#ifndef PFM_OUTPUT
+#define PFM_OUTPUT false
 #endif
 
-#ifndef BATCHES_PER_THREAD
-#define BATCHES_PER_THREAD 10
+// With RENDER_PROFILE, also save an image of what each tile cost, next to
+// the render with "-tiles" added to its name.
+#ifndef TILE_HEATMAP_IMAGE
+#define TILE_HEATMAP_IMAGE false
 #endif
 
+// With more lights than this, each shading point samples this many of them
+// from a light BVH, in proportion to how brightly each is likely to light
+// it, instead of tracing a shadow ray to every light. 0 always uses every
+// light.
+#ifndef LIGHT_SAMPLES
+#define LIGHT_SAMPLES 0
+#endif
+
+// Try the instance that last blocked a light (on this thread) before
+// searching the whole scene for something between a point and the light.
+#ifndef SHADOW_CACHE
+#define SHADOW_CACHE true
+#endif
+
+// Scene loading is timed from here (roughly when rt started) to the call
+// to a4_render, and from the end of one render to the next after that.
+// Mesh BVH builds in that time are reported on their own, so they are
+// taken out.
+static double s_sceneLoadStart = seconds_now();
+static double s_sceneLoadMeshSeconds = 0.0;
+
+static void start_scene_load() {
+  s_sceneLoadStart = seconds_now();
+  s_sceneLoadMeshSeconds = Mesh::buildStats().seconds;
+}
+
+static double scene_load_seconds() {
+  return seconds_now() - s_sceneLoadStart - (Mesh::buildStats().seconds - s_sceneLoadMeshSeconds);
+}
+
+// Adds the shape of instance to key: its primitive's parameters, or a
+// mesh's vertices and triangles (each geometry only the first time it is
+// seen), and its material.
+static void add_instance_key(KeyHash& key, const SceneBVH& scene, int instance,
+                             std::set<const MeshGeometry*>& meshes) {
+  const PrimitiveKind kind = scene.kind(instance);
+  key.add((int) kind);
+  if (kind == SPHERE_PRIMITIVE) {
+    const NonhierSphere* sphere = static_cast<const NonhierSphere*>(scene.primitive(instance));
+    key.add(sphere->position());
+    key.add(sphere->radius());
+  } else if (kind == BOX_PRIMITIVE) {
+    const NonhierBox* box = static_cast<const NonhierBox*>(scene.primitive(instance));
+    key.add(box->position());
+    key.add(box->size());
+  } else if (kind == TORUS_PRIMITIVE) {
+    key.add(static_cast<const Torus*>(scene.primitive(instance))->tube());
+  } else if (kind == MESH_PRIMITIVE) {
+    const MeshGeometry* mesh = static_cast<const Mesh*>(scene.primitive(instance))->geometry();
+    key.add((size_t) mesh->verts().size());
+    key.add((size_t) mesh->triangles().size());
+    if (meshes.insert(mesh).second) {
+      if (!mesh->verts().empty()) {
+        key.addBytes(&mesh->verts()[0], mesh->verts().size() * sizeof(Point3D));
+      }
+      for (std::vector<MeshGeometry::Face>::const_iterator it = mesh->triangles().begin(); it != mesh->triangles().end(); it++) {
+        key.addBytes(&(*it)[0], it->size() * sizeof(int));
+      }
+    }
+  } else {
+    key.add(scene.primitive(instance)->getBounds());
+  }
+
+  const PhongMaterial* phong = dynamic_cast<const PhongMaterial*>(scene.material(instance));
+  if (phong != NULL) {
+    key.add(phong->diffuse());
+    key.add(phong->specular());
+    key.add(phong->shininess());
+    key.add(phong->reflectance());
+  }
+}
+
+// Sums up what a render's checkpoint depends on, so that one left by a
+// different render is never resumed: the view, the image size, the lights,
+// where every instance sits, its shape and material, and the sampling
+// settings and precision.
+static unsigned long long render_key(const Camera& camera, const Lighting& lighting, const SceneBVH& scene) {
+  KeyHash key;
+  const Ray corner = camera.ray(0.0, 0.0), centre = camera.ray(camera.width() / 2.0, camera.height() / 2.0);
+  for (int i = 0; i < 3; i++) {
+    key.add(corner.pos[i]);
+    key.add(corner.dir[i]);
+    key.add(centre.dir[i]);
+  }
+  key.add(camera.width());
+  key.add(camera.height());
+
+  key.add(lighting.ambient.R());
+  key.add(lighting.ambient.G());
+  key.add(lighting.ambient.B());
+  for (std::list<Light*>::const_iterator it = lighting.lights.begin(); it != lighting.lights.end(); it++) {
+    const Light& light = **it;
+    key.add(light.colour.R());
+    key.add(light.colour.G());
+    key.add(light.colour.B());
+    for (int i = 0; i < 3; i++) {
+      key.add(light.position[i]);
+      key.add(light.falloff[i]);
+    }
+  }
+
+  key.add((size_t) scene.numInstances());
+  std::set<const MeshGeometry*> meshes;
+  for (int instance = 0; instance < scene.numInstances(); instance++) {
+    for (int i = 0; i < 16; i++) {
+      key.add(scene.transform(instance)[i / 4][i % 4]);
+    }
+    add_instance_key(key, scene, instance, meshes);
+  }
+
+  key.add((int) sizeof(Scalar));
+  key.add((int) ANTI_ALIASING);
+  key.add((int) AA_MAX_SAMPLES);
+  key.add((int) LIGHT_SAMPLES);
+  return key.value;
+}
+
+// Renders scene (built from the scene script run so far) to filename with
+// lighting as it is, here or across workers.
+static void render_lit_frame(SceneBVH& scene, const std::string& filename, int width, int height,
+                             Camera& camera, Lighting& lighting, RenderProfile& profile) {
+  WorkBundle bundle;
+  bundle.lighting = &lighting;
+  bundle.camera = &camera;
+  bundle.scene = &scene;
+  bundle.profile = &profile;
+  bundle.thread = 0;
+
+  const unsigned long long key = render_key(camera, lighting, scene);
+  const char* workerAddress = getenv("RT_WORKER");
+  if (workerAddress != NULL) {
+    run_worker(bundle, workerAddress, key);
+    return;
+  }
+
+  RayTraceStats stats;
+  long totalSamples;
+  const char* coordinatorAddress = getenv("RT_COORDINATOR");
+  if (coordinatorAddress != NULL) {
+    totalSamples = render_distributed(bundle, filename, coordinatorAddress, key, stats);
+  } else if ((long) width * height > STREAM_OUTPUT_PIXELS) {
+    totalSamples = render_streamed(bundle, filename, stats);
+  } else {
+    totalSamples = render_whole(bundle, filename, key, stats);
+  }
+
+  std::cout << stats;
+  std::cout << "Samples per Pixel: " << ((double) totalSamples) / (width * height) << std::endl;
+  std::cout << "Mesh acceleration structures:" << std::endl << Mesh::buildStats();
+
+  if (RENDER_PROFILE) {
+    std::cout << "Scene load " << profile.scene_load_seconds << "s, primary pass " << profile.primary_pass_seconds
+      << "s, refine pass " << profile.refine_pass_seconds << "s, output " << profile.output_seconds << "s." << std::endl;
+    std::cout << "Rays per Second: " << profile.raysPerSecond() << std::endl;
+
+    const std::string reportFilename = sibling_filename(filename, ".json");
+    if (profile.saveReport(reportFilename, filename, totalSamples, Mesh::buildStats())) {
+      std::cout << "Saved render report to " << reportFilename << std::endl;
+    }
+    if (TILE_HEATMAP_IMAGE) {
+      const std::string heatmapFilename = sibling_filename(filename, "-tiles.png");
+      if (profile.saveHeatmap(heatmapFilename)) {
+        std::cout << "Saved tile heatmap to " << heatmapFilename << std::endl;
+      }
+    }
+  }
+}
+
+// The same, sampling the lights from a light BVH if there are too many to
+// trace a shadow ray to each.
+static void render_frame(SceneBVH& scene, const std::string& filename, int width, int height,
+                         Camera& camera, Lighting& lighting, RenderProfile& profile) {
+  if (LIGHT_SAMPLES > 0 && (int) lighting.lights.size() > LIGHT_SAMPLES) {
+    std::cout << "Sampling " << LIGHT_SAMPLES << " of " << lighting.lights.size() << " lights per point." << std::endl;
+    LightBVH lightSampler(lighting.lights);
+    lighting.sampler = &lightSampler;
+    render_lit_frame(scene, filename, width, height, camera, lighting, profile);
+    lighting.sampler = NULL;
+  } else {
+    render_lit_frame(scene, filename, width, height, camera, lighting, profile);
+  }
+}
+
 void a4_render(
   SceneNode* root, // What to render
   const std::string& filename, // Where to output the image
@@ -32,244 +257,729 @@ void a4_render(
   const Colour& ambient, const std::list<Light*>& lights // Lighting parameters
 ) {
 
-  ViewParams viewParams(eye, view, up, fov * M_PI / 180.0);
+  RenderProfile profile(width, height, render_threads());
+  MeshGeometry::buildPending(render_threads());
+  profile.scene_load_seconds = scene_load_seconds();
+
+  Camera camera(ViewParams(eye, view, up, fov * M_PI / 180.0), width, height);
   Lighting lighting(ambient, lights);
 
-  Image img(width, height, 3);
+  double buildStart = seconds_now();
+  SceneBVH scene(root, render_threads());
+  profile.scene_build_seconds = seconds_now() - buildStart;
+  std::cout << "Built scene BVH over " << scene.numInstances() << " instances with "
+    << scene.numNodes() << " nodes in " << profile.scene_build_seconds << "s." << std::endl;
 
-  WorkBundle bundle;
-  bundle.image = &img;
-  bundle.lighting = &lighting;
-  bundle.viewParams = &viewParams;
-  bundle.width = width;
-  bundle.height = height;
-  bundle.scene = root;
+  render_frame(scene, filename, width, height, camera, lighting, profile);
+  start_scene_load();
+}
+
+void a4_animate(
+  SceneNode* root, const std::string& filename, int frames,
+  int width, int height,
+  const Point3D& eye, const Vector3D& view,
+  const Vector3D& up, double fov,
+  const Colour& ambient, const std::list<Light*>& lights,
+  FrameUpdate& update
+) {
+  Point3D frameEye = eye;
+  Vector3D frameView = view, frameUp = up;
+  double frameFov = fov;
+  SceneBVH* scene = NULL;
+  for (int frame = 1; frame <= frames; frame++) {
+    if (!update(frame, frameEye, frameView, frameUp, frameFov)) {
+      break;
+    }
+    const std::string frameFilename = animation_frame_filename(filename, frame);
+    std::cout << "Frame " << frame << " of " << frames << ": " << frameFilename << std::endl;
+
+    RenderProfile profile(width, height, render_threads());
+    MeshGeometry::buildPending(render_threads());
+    profile.scene_load_seconds = scene_load_seconds();
+
+    // Only the first frame builds the scene BVH; the others refit it to
+    // the moved nodes, unless the update changed what is in the scene.
+    double buildStart = seconds_now();
+    if (scene != NULL && scene->refit(root)) {
+      profile.scene_build_seconds = seconds_now() - buildStart;
+      std::cout << "Refit scene BVH in " << profile.scene_build_seconds << "s." << std::endl;
+    } else {
+      delete scene;
+      scene = new SceneBVH(root, render_threads());
+      profile.scene_build_seconds = seconds_now() - buildStart;
+      std::cout << "Built scene BVH over " << scene->numInstances() << " instances with "
+        << scene->numNodes() << " nodes in " << profile.scene_build_seconds << "s." << std::endl;
+    }
+
+    Camera camera(ViewParams(frameEye, frameView, frameUp, frameFov * M_PI / 180.0), width, height);
+    Lighting lighting(ambient, lights);
+    render_frame(*scene, frameFilename, width, height, camera, lighting, profile);
+    start_scene_load();
+  }
+  delete scene;
+}
+
+std::string animation_frame_filename(const std::string& filename, int frame) {
+  char number[32];
+  snprintf(number, sizeof(number), "-%04d.png", frame);
+  return sibling_filename(filename, number);
+}
 
-  const int totalRays = width * height;
-  std::cout << "Raytracing " << totalRays << " rays." << std::endl;
+std::string sibling_filename(const std::string& filename, const std::string& ending) {
+  std::string sibling = filename;
+  std::string::size_type extension = sibling.rfind(".png");
+  return sibling.erase(extension == std::string::npos ? sibling.size() : extension) + ending;
+}
 
+// Where the PFM copy of the image goes, if PFM_OUTPUT is set.
+static std::string pfm_filename(const std::string& filename) {
+  return PFM_OUTPUT ? sibling_filename(filename, ".pfm") : "";
+}
+
+int render_threads() {
 #ifdef MULTITHREADED
-  std::cout << "Running multithreaded with " << NUM_THREADS << " pthreads and " << BATCHES_PER_THREAD << " batches/thread." << std::endl;
+  return WorkManager::defaultThreadCount();
+#else
+  return 1;
+#endif
+}
+
+static Tile rows(int width, int y0, int y1) {
+  Tile region;
+  region.x0 = 0;
+  region.y0 = y0;
+  region.x1 = width;
+  region.y1 = y1;
+  return region;
+}
 
-  WorkManager manager(totalRays, NUM_THREADS*BATCHES_PER_THREAD);
-  bundle.manager = &manager;
-  pthread_t threads[NUM_THREADS];
-  for (int i = 0; i < NUM_THREADS; i++) {
-    int success = pthread_create(&(threads[i]), NULL, &do_raytrace, (void*) &bundle);
+long render_whole(WorkBundle bundle, const std::string& filename, unsigned long long key, RayTraceStats& stats) {
+  const int width = bundle.camera->width(), height = bundle.camera->height();
+  RenderBuffers buffers(width, height);
+  Checkpointer checkpointer(filename, key, buffers);
+  checkpointer.resume();
+  bundle.buffers = &buffers;
+  bundle.checkpointer = &checkpointer;
+
+  double renderStart = seconds_now();
+  if (buffers.pass == PRIMARY_PASS) {
+    std::cout << "Raytracing " << width * height << " primary rays." << std::endl;
+    bundle.pass = PRIMARY_PASS;
+    stats.merge(render_pass(bundle, rows(width, 0, height), true));
+  }
+  double refineStart = seconds_now();
+  bundle.profile->primary_pass_seconds += refineStart - renderStart;
+
+  if (ANTI_ALIASING) {
+    if (buffers.pass == PRIMARY_PASS) {
+      buffers.pass = REFINE_PASS;
+      int edges = mark_edges(buffers);
+      std::cout << "Supersampling " << edges << " edge pixels." << std::endl;
+      // The primary pass is worth keeping by itself.
+      checkpointer.save();
+    }
+    bundle.pass = REFINE_PASS;
+    stats.merge(render_pass(bundle, rows(width, 0, height), true));
+  }
+  double outputStart = seconds_now();
+  bundle.profile->refine_pass_seconds += outputStart - refineStart;
+
+  long totalSamples = 0;
+  for (std::vector<int>::const_iterator it = buffers.samples.begin(); it != buffers.samples.end(); it++) {
+    totalSamples += *it;
+  }
+
+  std::cout << "Done in " << seconds_now() - renderStart << "s! Saving image..." << std::endl;
+  save_image(buffers.image, filename);
+  checkpointer.finish();
+  bundle.profile->output_seconds += seconds_now() - outputStart;
+  std::cout << "Saved" << std::endl;
+
+  save_sample_density(buffers.samples, width, height, filename);
+  return totalSamples;
+}
+
+long render_streamed(WorkBundle bundle, const std::string& filename, RayTraceStats& stats) {
+  const int width = bundle.camera->width(), height = bundle.camera->height();
+  ImageRowWriter writer(filename, width, height, pfm_filename(filename));
+  if (!writer.ok()) {
+    std::cerr << "Could not open " << filename << " for writing." << std::endl;
+    return 0;
+  }
+  bundle.checkpointer = NULL;
+
+  std::cout << "Raytracing " << width << "x" << height << " in bands of " << STREAM_BAND_ROWS
+    << " rows, writing each as it finishes." << std::endl;
+  double renderStart = seconds_now();
+  long totalSamples = 0;
+  for (int y0 = 0; y0 < height; y0 += STREAM_BAND_ROWS) {
+    const int y1 = std::min(height, y0 + STREAM_BAND_ROWS);
+    const Tile band = rows(width, y0, y1);
+    const Tile halo = with_halo(band, width, height);
+    const int top = halo.y0;
+    RenderBuffers buffers(width, halo.y1 - halo.y0, top);
+    render_region(bundle, band, buffers, stats);
+
+    double outputStart = seconds_now();
+    writer.writeRows(buffers.image, y0 - top, y1 - y0);
+    bundle.profile->output_seconds += seconds_now() - outputStart;
+    for (int i = (y0 - top) * width; i < (y1 - top) * width; i++) {
+      totalSamples += buffers.samples[i];
+    }
+    if (y1 * 10 / height != y0 * 10 / height) {
+      std::cout << "Done " << y1 * 10 / height * 10 << "%" << std::endl;
+    }
+  }
+  writer.close();
+
+  std::cout << "Done in " << seconds_now() - renderStart << "s! Saved" << std::endl;
+  if (SAMPLE_DENSITY_IMAGE) {
+    std::cout << "No sample density image for a streamed render." << std::endl;
+  }
+  return totalSamples;
+}
+
+Tile with_halo(const Tile& core, int width, int height) {
+  Tile halo;
+  halo.x0 = std::max(0, core.x0 - 1);
+  halo.y0 = std::max(0, core.y0 - 1);
+  halo.x1 = std::min(width, core.x1 + 1);
+  halo.y1 = std::min(height, core.y1 + 1);
+  return halo;
+}
+
+void render_region(WorkBundle bundle, const Tile& core, RenderBuffers& buffers, RayTraceStats& stats) {
+  bundle.buffers = &buffers;
+  bundle.checkpointer = NULL;
+
+  // The halo gets primary samples too, so mark_edges sees every neighbour
+  // of the region's own pixels; only the region itself is refined.
+  double primaryStart = seconds_now();
+  bundle.pass = PRIMARY_PASS;
+  stats.merge(render_pass(bundle, with_halo(core, bundle.camera->width(), bundle.camera->height()), false));
+  double refineStart = seconds_now();
+  bundle.profile->primary_pass_seconds += refineStart - primaryStart;
+  if (ANTI_ALIASING) {
+    buffers.pass = REFINE_PASS;
+    mark_edges(buffers);
+    bundle.pass = REFINE_PASS;
+    stats.merge(render_pass(bundle, core, false));
+  }
+  bundle.profile->refine_pass_seconds += seconds_now() - refineStart;
+}
+
+bool save_image(Image& image, const std::string& filename) {
+  if (PFM_OUTPUT) {
+    ImageRowWriter writer(filename, image.width(), image.height(), pfm_filename(filename));
+    writer.writeRows(image, 0, image.height());
+    return writer.ok();
+  }
+  return image.savePng(filename);
+}
+
+void save_sample_density(const std::vector<int>& samples, int width, int height, const std::string& filename) {
+  if (SAMPLE_DENSITY_IMAGE) {
+    const std::string densityFilename = sibling_filename(filename, "-samples.png");
+    sample_density_image(samples, width, height).savePng(densityFilename);
+    std::cout << "Saved sample density to " << densityFilename << std::endl;
+  }
+}
+
+RayTraceStats render_pass(const WorkBundle& bundle, const Tile& region, bool log) {
+#ifdef MULTITHREADED
+  const int numThreads = render_threads();
+  WorkManager manager(region, numThreads, log);
+  if (log) {
+    std::cout << "Running multithreaded with " << numThreads << " pthreads over " << manager.numTiles() << " tiles." << std::endl;
+  }
+
+  std::vector<WorkBundle> bundles(numThreads, bundle);
+  std::vector<pthread_t> threads(numThreads);
+  for (int i = 0; i < numThreads; i++) {
+    bundles[i].manager = &manager;
+    bundles[i].thread = i;
+    int success = pthread_create(&(threads[i]), NULL, &do_raytrace, (void*) &bundles[i]);
     if (success != 0) {
       std::cerr << "pthread_create gave return code " << success << "!" << std::endl;
       exit(1);
     }
   }
-  for (int i = 0; i < NUM_THREADS; i++) {
+  for (int i = 0; i < numThreads; i++) {
     pthread_join(threads[i], NULL);
   }
 #else
-  std::cout << "Running singlethreaded." << std::endl;
-  WorkManager manager(totalRays, 10);
-  bundle.manager = &manager;
-  do_raytrace((void*) &bundle);
+  if (log) {
+    std::cout << "Running singlethreaded." << std::endl;
+  }
+  WorkManager manager(region, 1, log);
+  WorkBundle single = bundle;
+  single.manager = &manager;
+  do_raytrace((void*) &single);
 #endif
-
-  std::cout << "Done! Saving image..." << std::endl;
-  img.savePng(filename);
-  std::cout << "Saved" << std::endl;
-
-  std::cout << manager.getStats();
+  return manager.getStats();
 }
 
 void *do_raytrace(void* param) {
   WorkBundle* bundle = (WorkBundle*) param;
-  Image& image = *(bundle->image);
   RayTraceStats stats;
+  ShadowCache shadows(bundle->lighting->lights.size());
+  bundle->shadows = &shadows;
+
+  Tile tile;
+  Checkpointer* checkpointer = bundle->checkpointer;
+  while (bundle->manager->getWork(bundle->thread, tile)) {
+    if (checkpointer != NULL) {
+      checkpointer->beginTile();
+    }
+    double tileStart = RENDER_PROFILE ? PhaseTimer::now() : 0.0;
+    if (bundle->pass == PRIMARY_PASS) {
+      raytrace_tile(*bundle, tile, stats);
+    } else {
+      supersample_tile(*bundle, tile, stats);
+    }
+    if (RENDER_PROFILE) {
+      bundle->profile->addTile(bundle->thread, tile, PhaseTimer::now() - tileStart);
+    }
+    if (checkpointer != NULL) {
+      checkpointer->endTile();
+      checkpointer->poll();
+    }
+    bundle->manager->finishedTile();
+  }
+  bundle->manager->reportStats(stats);
+  bundle->profile->thread(bundle->thread).stats.merge(stats);
+  return NULL;
+}
 
-  while (true) {
-    bool done;
-    int start, end;
-    bundle->manager->getWork(done, start, end);
-    if (done) {
-      break;
+// Fills in colours[i] (and objects[i], if given) for the sample positions
+// in mask, as one packet or one ray at a time.
+static void trace_samples(const WorkBundle& bundle, const double* xs, const double* ys, int mask,
+                          Colour* colours, int* objects, RayTraceStats& stats) {
+  if (PACKET_TRACING) {
+    raytrace_packet(bundle.scene, xs, ys, mask, *(bundle.camera), *(bundle.lighting), *(bundle.shadows),
+                    colours, objects, stats);
+    return;
+  }
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    if (mask & (1 << i)) {
+      colours[i] = raytrace_pixel(bundle.scene, xs[i], ys[i], *(bundle.camera), *(bundle.lighting),
+                                  *(bundle.shadows), stats, objects != NULL ? &objects[i] : NULL);
     }
-    for (int i = start; i < end; i++) {
-      int x = i % bundle->width;
-      int y = std::floor(i / bundle->width);
-
-      Colour colour(0.0);
-      RayResult* result = NULL;
-      if (ANTI_ALIASING) {
-        for (int dx = 0; dx < 2; dx++) {
-          for (int dy = 0; dy < 2; dy++) {
-            result = raytrace_pixel(bundle->scene, x + (((double)dx) - 0.5) , y + (((double)dy) - 0.5), bundle->width, bundle->height, *(bundle->viewParams), *(bundle->lighting));
-            colour = colour + 0.25*result->colour;
-          }
+  }
+}
+
+void raytrace_tile(const WorkBundle& bundle, const Tile& tile, RayTraceStats& stats) {
+  Image& image = bundle.buffers->image;
+  std::vector<int>& samples = bundle.buffers->samples;
+  const int width = bundle.camera->width();
+  const int top = bundle.buffers->y0;
+
+  // Trace 2x2 blocks of pixels together.
+  for (int y = tile.y0; y < tile.y1; y += 2) {
+    for (int x = tile.x0; x < tile.x1; x += 2) {
+      double xs[PACKET_SIZE], ys[PACKET_SIZE];
+      int mask = 0;
+      for (int i = 0; i < PACKET_SIZE; i++) {
+        xs[i] = x + i % 2;
+        ys[i] = y + i / 2;
+        if (xs[i] < tile.x1 && ys[i] < tile.y1 && samples[(y + i / 2 - top) * width + x + i % 2] == 0) {
+          mask |= 1 << i;
         }
-      } else {
-        result = raytrace_pixel(bundle->scene, x, y, bundle->width, bundle->height, *(bundle->viewParams), *(bundle->lighting));
-        colour = result->colour;
       }
+      if (mask == 0) {
+        continue;
+      }
+      Colour colours[PACKET_SIZE] = {Colour(0.0), Colour(0.0), Colour(0.0), Colour(0.0)};
+      int objects[PACKET_SIZE];
+      trace_samples(bundle, xs, ys, mask, colours, objects, stats);
+
+      for (int i = 0; i < PACKET_SIZE; i++) {
+        if (mask & (1 << i)) {
+          const int px = xs[i], py = ys[i] - top;
+          image(px, py, 0) = colours[i].R();
+          image(px, py, 1) = colours[i].G();
+          image(px, py, 2) = colours[i].B();
+          bundle.buffers->objects[py * width + px] = objects[i];
+          samples[py * width + px] = 1;
+        }
+      }
+    }
+  }
+}
 
-
-      image(x, y, 0) = colour.R();
-      image(x, y, 1) = colour.G();
-      image(x, y, 2) = colour.B();
-      stats.merge(result->stats);
-      delete result;
+int mark_edges(RenderBuffers& buffers) {
+  const Image& image = buffers.image;
+  const std::vector<int>& objects = buffers.objects;
+  const int width = image.width(), height = image.height();
+  int edges = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      bool edge = false;
+      const int neighbours[4][2] = {{x - 1, y}, {x + 1, y}, {x, y - 1}, {x, y + 1}};
+      for (int n = 0; n < 4 && !edge; n++) {
+        const int nx = neighbours[n][0], ny = neighbours[n][1];
+        if (nx < 0 || ny < 0 || nx >= width || ny >= height) {
+          continue;
+        }
+        edge = objects[ny * width + nx] != objects[y * width + x];
+        for (int c = 0; c < 3 && !edge; c++) {
+          edge = std::abs(image(nx, ny, c) - image(x, y, c)) > AA_CONTRAST;
+        }
+      }
+      buffers.edges[y * width + x] = edge;
+      edges += edge;
     }
   }
-  bundle->manager->reportStats(stats);
-  return NULL;
+  return edges;
 }
 
-RayResult* raytrace_pixel(SceneNode* node,
-  int x, int y,
-  int width, int height,
-  const ViewParams& view,
-  const Lighting& lighting
-) {
-  double d = 50.0; // TODO - Is this derived from something?
-  double virtualH = 2.0 * d * tan(view.fov / 2.0);
-  double virtualW = ((double)width) / height * virtualH;
+void supersample_tile(const WorkBundle& bundle, const Tile& tile, RayTraceStats& stats) {
+  Image& image = bundle.buffers->image;
+  const int width = bundle.camera->width();
+  const int top = bundle.buffers->y0;
+
+  // The pixel is split into a grid x grid of strata. Each round takes the
+  // strata at one offset within every 2x2 block of them, so even a single
+  // round covers the whole pixel.
+  int grid = 2;
+  while ((grid + 2) * (grid + 2) <= AA_MAX_SAMPLES) {
+    grid += 2;
+  }
+  const int half = grid / 2;
+  const int offsets[4][2] = {{0, 0}, {1, 1}, {1, 0}, {0, 1}};
+
+  for (int y = tile.y0; y < tile.y1; y++) {
+    const int row = y - top;
+    for (int x = tile.x0; x < tile.x1; x++) {
+      // Pixels supersampled before a checkpoint have more than one sample.
+      int& count = bundle.buffers->samples[row * width + x];
+      if (!bundle.buffers->edges[row * width + x] || count != 1) {
+        continue;
+      }
 
-  //Point3D pixel(x, y, -d);
-  Point3D pixel(x, y, d);
+      // Start from the primary sample.
+      double sum[3], sumSquares[3];
+      for (int c = 0; c < 3; c++) {
+        sum[c] = image(x, row, c);
+        sumSquares[c] = sum[c] * sum[c];
+      }
 
-  //Matrix4x4 translatePixelToOrigin = translation(Vector3D(-width/2, -height/d, d));
-  Matrix4x4 translatePixelToOrigin = translation(Vector3D(-width/2, -height/2, 0));
-  Matrix4x4 scalePixel = scaling(Vector3D(virtualW/width, -virtualH/height, 1.0));
+      for (int round = 0; round < 4; round++) {
+        for (int first = 0; first < half * half; first += PACKET_SIZE) {
+          double xs[PACKET_SIZE], ys[PACKET_SIZE];
+          int mask = 0;
+          for (int i = 0; i < PACKET_SIZE && first + i < half * half; i++) {
+            const int sx = 2 * ((first + i) % half) + offsets[round][0];
+            const int sy = 2 * ((first + i) / half) + offsets[round][1];
+            xs[i] = x - 0.5 + (sx + 0.5) / grid;
+            ys[i] = y - 0.5 + (sy + 0.5) / grid;
+            mask |= 1 << i;
+          }
+          Colour colours[PACKET_SIZE] = {Colour(0.0), Colour(0.0), Colour(0.0), Colour(0.0)};
+          trace_samples(bundle, xs, ys, mask, colours, NULL, stats);
+
+          for (int i = 0; i < PACKET_SIZE; i++) {
+            if (mask & (1 << i)) {
+              const double channels[3] = {colours[i].R(), colours[i].G(), colours[i].B()};
+              for (int c = 0; c < 3; c++) {
+                sum[c] += channels[c];
+                sumSquares[c] += channels[c] * channels[c];
+              }
+              count++;
+            }
+          }
+        }
 
-  Vector3D w = view.view;
-  //Vector3D u = view.up.cross(w);
-  Vector3D u = w.cross(view.up);
-  u.normalize();
-  w.normalize();
-  //Vector3D v = w.cross(u);
-  Vector3D v = u.cross(w);
+        double variance = 0.0;
+        for (int c = 0; c < 3; c++) {
+          double mean = sum[c] / count;
+          variance = std::max(variance, sumSquares[c] / count - mean * mean);
+        }
+        if (variance < AA_VARIANCE) {
+          break;
+        }
+      }
 
-  Matrix4x4 rotatePixelToWCS = Matrix4x4((double[16]) {
-    u[X], v[X], w[X], 0,
-    u[Y], v[Y], w[Y], 0,
-    u[Z], v[Z], w[Z], 0,
-       0,    0,    0, 1
-  });
+      for (int c = 0; c < 3; c++) {
+        image(x, row, c) = sum[c] / count;
+      }
+    }
+  }
+}
 
-  //std::cout << rotatePixelToWCS << std::endl;
+Image sample_density_image(const std::vector<int>& samples, int width, int height) {
+  int maxSamples = 1;
+  for (std::vector<int>::const_iterator it = samples.begin(); it != samples.end(); it++) {
+    maxSamples = std::max(maxSamples, *it);
+  }
+  Image density(width, height, 3);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      double value = maxSamples > 1 ? ((double) samples[y * width + x] - 1) / (maxSamples - 1) : 0.0;
+      for (int c = 0; c < 3; c++) {
+        density(x, y, c) = value;
+      }
+    }
+  }
+  return density;
+}
 
-  Matrix4x4 pixelEyeTranslation = translation(view.eye - Point3D());
+Colour raytrace_pixel(SceneBVH* scene,
+  double x, double y,
+  const Camera& camera,
+  const Lighting& lighting,
+  ShadowCache& shadows,
+  RayTraceStats& stats,
+  int* object
+) {
+  Ray ray = camera.ray(x, y);
+  Colour colour(0.0);
+  if (!raytrace_visible(scene, ray, lighting, shadows, colour, stats, 0, object)) {
+    colour = genBackground(ray, x/camera.width(), y/camera.height());
+  }
+  return colour;
+}
 
-  Point3D pixelWorld = pixelEyeTranslation * rotatePixelToWCS * scalePixel * translatePixelToOrigin * pixel;
+void raytrace_packet(SceneBVH* scene,
+  const double* xs, const double* ys, int mask,
+  const Camera& camera,
+  const Lighting& lighting,
+  ShadowCache& shadows,
+  Colour* colours,
+  int* objects,
+  RayTraceStats& stats
+) {
+  RayPacket packet;
+  packet.mask = mask;
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    if (packet.active(i)) {
+      packet.rays[i] = camera.ray(xs[i], ys[i]);
+    }
+  }
+  packet.update();
+
+  HitRecord hits[PACKET_SIZE];
+  int hitMask;
+  stats.primary_rays += lane_count(mask);
+  {
+    PhaseTimer timer(stats.primary_seconds);
+    hitMask = scene->intersectPacket(packet, hits, stats);
+  }
+
+  Shading shadings[PACKET_SIZE];
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    if (hitMask & (1 << i)) {
+      shadings[i] = Shading(packet.rays[i], hits[i], lighting);
+    }
+  }
 
-  Vector3D rayDir = pixelWorld - view.eye;
-  //Vector3D rayDir = pixel - view.eye;
-  rayDir.normalize();
+  // Sampled lights differ from lane to lane, so each is shaded on its own.
+  if (lighting.sampler != NULL) {
+    for (int i = 0; i < PACKET_SIZE; i++) {
+      if (hitMask & (1 << i)) {
+        shade_lights(scene, shadings[i], lighting, shadows, stats);
+      }
+    }
+  } else {
+    // The shadow rays toward each light start close together and all end at
+    // the light, so they make a coherent packet too.
+    int lightIndex = 0;
+    for (std::list<Light*>::const_iterator it = lighting.lights.begin(); it != lighting.lights.end(); it++, lightIndex++) {
+      Light* light = *it;
+      RayPacket shadowRays;
+      shadowRays.mask = hitMask;
+      double distances[PACKET_SIZE];
+      for (int i = 0; i < PACKET_SIZE; i++) {
+        if (hitMask & (1 << i)) {
+          shadowRays.rays[i] = shadings[i].shadowRay(light, distances[i]);
+        }
+      }
+      int blocked = 0;
+      if (SHADOWS && hitMask != 0) {
+        shadowRays.update();
+        stats.shadow_rays += lane_count(hitMask);
+        PhaseTimer timer(stats.shadow_seconds);
+        int& occluder = shadows.occluders[lightIndex];
+        if (SHADOW_CACHE && occluder >= 0) {
+          stats.shadow_cache_tests += lane_count(hitMask);
+          blocked = scene->occludedByPacket(occluder, shadowRays, 0.0, distances, stats);
+          stats.shadow_cache_hits += lane_count(blocked);
+        }
+        if (blocked != hitMask) {
+          // Only the lanes the cached instance didn't block need the scene.
+          shadowRays.mask = hitMask & ~blocked;
+          int found;
+          int sceneBlocked = scene->occludedPacket(shadowRays, 0.0, distances, stats, &found);
+          blocked |= sceneBlocked;
+          if (sceneBlocked != 0) {
+            occluder = found;
+          } else if (blocked == 0) {
+            // Lit points tend to have lit neighbours, which shouldn't pay
+            // for testing a blocker first.
+            occluder = -1;
+          }
+        }
+      }
+      for (int i = 0; i < PACKET_SIZE; i++) {
+        if (hitMask & (1 << i)) {
+          shadings[i].addLight(light, Colour((blocked & (1 << i)) ? 0.0 : 1.0));
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    if (hitMask & (1 << i)) {
+      colours[i] = shadings[i].finish(scene, lighting, shadows, stats, 0);
+    } else if (packet.active(i)) {
+      colours[i] = genBackground(packet.rays[i], xs[i]/camera.width(), ys[i]/camera.height());
+    }
+    if (objects != NULL) {
+      objects[i] = (hitMask & (1 << i)) ? hits[i].object : -1;
+    }
+  }
+}
+
+bool raytrace_visible(SceneBVH* scene, const Ray& ray, const Lighting& lighting, ShadowCache& shadows,
+                      Colour& colour, RayTraceStats& stats, int depth, int* object) {
+  HitRecord closest;
+  bool found;
+  if (depth == 0) {
+    stats.primary_rays++;
+    PhaseTimer timer(stats.primary_seconds);
+    found = scene->intersect(ray, closest, stats);
+  } else {
+    stats.reflection_rays++;
+    PhaseTimer timer(stats.reflection_seconds);
+    found = scene->intersect(ray, closest, stats);
+  }
+  if (object != NULL) {
+    *object = found ? closest.object : -1;
+  }
+  if (!found) {
+    return false;
+  }
 
-  Ray ray(view.eye, rayDir);
-  RayResult* result = raytrace_visible(node, ray, lighting);
+  Shading shading(ray, closest, lighting);
+  shade_lights(scene, shading, lighting, shadows, stats);
+  colour = shading.finish(scene, lighting, shadows, stats, depth);
+  return true;
+}
 
-  if (!result->isHit()) {
-    result->colour = genBackground(ray, ((double)x)/width, ((double)y)/height);
+// Adds light (the index-th in lighting) to shading, scaled by weight, if
+// nothing is in the way.
+static void shade_light(SceneBVH* scene, Shading& shading, const Light* light, int index, double weight,
+                        ShadowCache& shadows, RayTraceStats& stats) {
+  // Check for shadow.
+  Colour shadowMultiplier(weight);
+  if (SHADOWS) {
+    double dist;
+    Ray shadowRay = shading.shadowRay(light, dist);
+    shadowMultiplier = weight * raytrace_shadow(scene, shadowRay, dist, shadows.occluders[index], stats);
   }
-  return result;
+  shading.addLight(light, shadowMultiplier);
 }
 
-RayResult* raytrace_visible(SceneNode* node, const Ray& ray, const Lighting& lighting, int depth) {
-  RayResult* result = node->findIntersections(ray);
-  if (!result->isHit()) {
-    return result;
+void shade_lights(SceneBVH* scene, Shading& shading, const Lighting& lighting, ShadowCache& shadows, RayTraceStats& stats) {
+  if (lighting.sampler == NULL) {
+    int index = 0;
+    for (std::list<Light*>::const_iterator it = lighting.lights.begin(); it != lighting.lights.end(); it++, index++) {
+      shade_light(scene, shading, *it, index, 1.0, shadows, stats);
+    }
+    return;
+  }
+
+  // The samples are stratified, offset by a number drawn from the hit
+  // point, so the image is the same however it is split among threads or
+  // workers. Each light is weighted by one over the chance of taking it,
+  // so the sum is right on average.
+  KeyHash hash;
+  for (int axis = X; axis <= Z; axis++) {
+    hash.add(shading.hit.point[axis]);
   }
-  Intersection* closestIntersection = NULL;
-  double closestDistance = std::numeric_limits<double>::max();
-  for (std::vector<Intersection>::iterator it = result->intersections.begin(); it != result->intersections.end(); it++) {
-    double distance = (it->point - ray.pos).length();
-    if (closestIntersection == NULL
-        || distance < closestDistance) {
-      closestIntersection = &(*it);
-      closestDistance = distance;
+  const double offset = (hash.value >> 11) * (1.0 / 9007199254740992.0);
+  const int samples = std::max(1, LIGHT_SAMPLES);
+  for (int i = 0; i < samples; i++) {
+    double pdf;
+    const int index = lighting.sampler->sample(shading.hit.point, (i + offset) / samples, pdf);
+    if (index >= 0) {
+      shade_light(scene, shading, lighting.sampler->light(index), index, 1.0 / (samples * pdf), shadows, stats);
     }
   }
+}
 
+Shading::Shading(const Ray& ray, const HitRecord& hit, const Lighting& lighting)
+  : ray(ray), hit(hit), colour(0.0) {
   // Normalize intersection normal.
-  closestIntersection->normal.normalize();
+  this->hit.normal.normalize();
 
-  Vector3D reflected = ray.dir - 2 * ray.dir.dot(closestIntersection->normal) * closestIntersection->normal;
+  reflected = ray.dir - 2 * ray.dir.dot(this->hit.normal) * this->hit.normal;
   reflected.normalize();
 
   // Start with ambient light.
-  Colour finalColour = lighting.ambient * closestIntersection->material->ambientColour();
+  colour = lighting.ambient * hit.material->ambientColour();
+}
 
-  // Add intensity from each light source.
-  for (std::list<Light*>::const_iterator it = lighting.lights.begin(); it != lighting.lights.end(); it++) {
-    Light* light = *it;
-    Colour lightColour = light->colour;
-    Vector3D lightIncident = light->position - closestIntersection->point;
-    //std::cout << "lightIncident = " << lightIncident << " = " << light->position << " - " << closestIntersection->point << std::endl;
-
-    double dist = lightIncident.length();
-    lightIncident = 1.0/dist * lightIncident; // Normalize;
-    double attenuation = light->falloff[0] + light->falloff[1] * dist + light->falloff[2] * dist * dist;
-    lightColour = 1.0/attenuation * lightColour;
-
-    // Check for shadow.
-    Colour shadowMultiplier(1.0);
-    if (SHADOWS) {
-      Ray shadowRay(closestIntersection->point, lightIncident);
-      RayResult* shadowResult = raytrace_shadow(node, shadowRay, lighting);
-      result->stats.merge(shadowResult->stats);
-      shadowMultiplier = shadowResult->colour;
-      delete shadowResult;
-    }
+Ray Shading::shadowRay(const Light* light, double& distance) const {
+  Vector3D lightIncident = light->position - hit.point;
+  distance = lightIncident.length();
+  return Ray(hit.point, 1.0/distance * lightIncident);
+}
 
-    Vector3D viewerDirection = -1 * ray.dir;
-    viewerDirection.normalize();
+void Shading::addLight(const Light* light, const Colour& shadowMultiplier) {
+  Colour lightColour = light->colour;
+  Vector3D lightIncident = light->position - hit.point;
+  //std::cout << "lightIncident = " << lightIncident << " = " << light->position << " - " << hit.point << std::endl;
 
-    Colour rayLightColour = closestIntersection->material->calculateLighting(lightIncident, closestIntersection->normal, reflected, viewerDirection, lightColour);
+  double dist = lightIncident.length();
+  lightIncident = 1.0/dist * lightIncident; // Normalize;
+  double attenuation = light->falloff[0] + light->falloff[1] * dist + light->falloff[2] * dist * dist;
+  lightColour = 1.0/attenuation * lightColour;
 
-    finalColour = finalColour + shadowMultiplier * rayLightColour;
-  }
+  Vector3D viewerDirection = -1 * ray.dir;
+  viewerDirection.normalize();
+
+  Colour rayLightColour = hit.material->calculateLighting(lightIncident, hit.normal, reflected, viewerDirection, lightColour);
 
+  colour = colour + shadowMultiplier * rayLightColour;
+}
+
+Colour Shading::finish(SceneBVH* scene, const Lighting& lighting, ShadowCache& shadows, RayTraceStats& stats, int depth) {
   // Reflection.
-  double reflectance = closestIntersection->material->reflectance();
+  double reflectance = hit.material->reflectance();
   if (REFLECTIONS && depth < MAX_REFLECTION_DEPTH && reflectance >= REFLECTANCE_MIN) {
-    Ray reflectedRay(closestIntersection->point, reflected);
-    RayResult* reflectedResult = raytrace_visible(node, reflectedRay, lighting, depth+1);
-    result->stats.merge(reflectedResult->stats);
+    Ray reflectedRay(hit.point, reflected);
 
     Colour reflectedRayColour = lighting.ambient;
     if (REFLECT_BACKGROUND) {
      reflectedRayColour = genBackground(reflectedRay);
     }
-    if (reflectedResult->isHit()) {
-      reflectedRayColour = reflectedResult->colour;
+    Colour hitColour(0.0);
+    if (raytrace_visible(scene, reflectedRay, lighting, shadows, hitColour, stats, depth+1)) {
+      reflectedRayColour = hitColour;
     }
-    finalColour = finalColour * (1.0 - reflectance) + reflectedRayColour * reflectance;
-    delete reflectedResult;
+    colour = colour * (1.0 - reflectance) + reflectedRayColour * reflectance;
   }
-
-  result->colour = finalColour;
-  return result;
+  return colour;
 }
 
-RayResult* raytrace_shadow(SceneNode* node, const Ray& ray, const Lighting& lighting) {
-  RayResult* result = node->findIntersections(ray);
-
-  if (result->isHit()) {
-    result->colour = Colour(0.0);
-  } else {
-    result->colour = Colour(1.0);
-  }
-
-  return result;
-
-  /*
-  //const double EPSILON = 0.00001;
-  const double EPSILON = 0.0;
-
-  for (std::vector<Intersection>::const_iterator it = intersections.begin(); it != intersections.end(); it++) {
-    if (it->rayParam > EPSILON) {
+Colour raytrace_shadow(SceneBVH* scene, const Ray& ray, double distance, int& occluder, RayTraceStats& stats) {
+  // Primitives already reject hits too close to the ray origin, so anything
+  // between the surface and the light counts.
+  stats.shadow_rays++;
+  PhaseTimer timer(stats.shadow_seconds);
+  if (SHADOW_CACHE && occluder >= 0) {
+    stats.shadow_cache_tests++;
+    if (scene->occludedBy(occluder, ray, 0.0, distance, stats)) {
+      stats.shadow_cache_hits++;
       return Colour(0.0);
     }
   }
-  return Colour(1.0);
-  */
+  if (scene->occluded(ray, 0.0, distance, stats, &occluder)) {
+    return Colour(0.0);
+  } else {
+    return Colour(1.0);
+  }
 }
 
 Colour genBackground(const Ray& ray) {
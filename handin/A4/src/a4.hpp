@@ -12,16 +12,35 @@
 #include "material.hpp"
 #include "image.hpp"
 #include "workmanager.hpp"
+#include "bvh.hpp"
+#include "packet.hpp"
+#include "camera.hpp"
+#include "checkpoint.hpp"
+#include "profile.hpp"
 
 class SceneNode;
 
+// For each light, by its place in Lighting::lights, the instance that last
+// blocked a shadow ray toward it on one render thread, or -1. The next
+// shadow ray toward the light tries that instance before the whole scene,
+// since neighbouring points are usually shadowed by the same thing.
+struct ShadowCache {
+  std::vector<int> occluders;
+
+  explicit ShadowCache(int lights): occluders(lights, -1) {}
+};
+
 struct WorkBundle {
-  Image* image;
-  int width, height;
+  RenderPass pass;
+  RenderBuffers* buffers;
+  Checkpointer* checkpointer;
   WorkManager* manager;
-  SceneNode* scene;
-  ViewParams* viewParams;
+  SceneBVH* scene;
+  Camera* camera;
   Lighting* lighting;
+  RenderProfile* profile;
+  ShadowCache* shadows; // Set by each render thread.
+  int thread;
 };
 
 void a4_render(
@@ -33,16 +52,139 @@ void a4_render(
   const Colour& ambient, const std::list<Light*>& lights // Lighting parameters
 );
 
-void* do_raytrace(void* params);
+// Poses the scene for each frame of an animation.
+class FrameUpdate {
+public:
+  virtual ~FrameUpdate() {}
 
-RayResult* raytrace_pixel(SceneNode* node,
-  int x, int y,
+  // Called before each frame (counting from 1) is rendered, to move nodes
+  // and the camera; the camera starts as it was left by the frame before.
+  // Returns false to stop the animation before this frame.
+  virtual bool operator()(int frame, Point3D& eye, Vector3D& view, Vector3D& up, double& fov) = 0;
+};
+
+// Renders frames images of root, numbered by animation_frame_filename,
+// calling update before each. Meshes and the scene BVH are built for the
+// first frame only; later frames refit the scene BVH around the moved
+// instances.
+void a4_animate(
+  SceneNode* root, const std::string& filename, int frames,
   int width, int height,
-  const ViewParams& viewParams,
-  const Lighting& lighting);
+  const Point3D& eye, const Vector3D& view,
+  const Vector3D& up, double fov,
+  const Colour& ambient, const std::list<Light*>& lights,
+  FrameUpdate& update
+);
+
+// Where frame of an animation saved as filename goes: "turntable.png"
+// becomes "turntable-0001.png" and so on.
+std::string animation_frame_filename(const std::string& filename, int frame);
+
+// filename with its ".png" (if any) replaced by ending.
+std::string sibling_filename(const std::string& filename, const std::string& ending);
+
+// How many threads each pass runs on.
+int render_threads();
+
+// Renders with one set of buffers for the whole image, checkpointing as it
+// goes, and saves it at the end. Returns the number of samples taken.
+long render_whole(WorkBundle bundle, const std::string& filename, unsigned long long key, RayTraceStats& stats);
+
+// Renders a band of rows at a time, streaming each to the output files
+// once it is finished. Returns the number of samples taken.
+long render_streamed(WorkBundle bundle, const std::string& filename, RayTraceStats& stats);
+
+// core grown by a pixel on each side, within the image.
+Tile with_halo(const Tile& core, int width, int height);
+
+// Renders the pixels in core with both passes into buffers, which must
+// hold every row of with_halo(core). The result matches a whole-image
+// render. Used for streamed bands and distributed tiles.
+void render_region(WorkBundle bundle, const Tile& core, RenderBuffers& buffers, RayTraceStats& stats);
+
+// Saves the image as a PNG, and as a PFM too if PFM_OUTPUT is set.
+bool save_image(Image& image, const std::string& filename);
+
+// Saves sample_density_image beside the image if SAMPLE_DENSITY_IMAGE is
+// set.
+void save_sample_density(const std::vector<int>& samples, int width, int height, const std::string& filename);
+
+// Runs bundle.pass over the pixels in region on the render threads and
+// returns their combined stats. Progress is printed if log is set.
+RayTraceStats render_pass(const WorkBundle& bundle, const Tile& region, bool log);
+
+void* do_raytrace(void* params);
+
+// One sample through the middle of each pixel in the tile that doesn't
+// have one yet.
+void raytrace_tile(const WorkBundle& bundle, const Tile& tile, RayTraceStats& stats);
+
+// Marks every pixel on an edge in buffers.edges for supersampling, and
+// returns how many there are.
+int mark_edges(RenderBuffers& buffers);
+
+// Supersamples the marked pixels in the tile that haven't been already.
+void supersample_tile(const WorkBundle& bundle, const Tile& tile, RayTraceStats& stats);
+
+// Black for pixels with one sample up to white for the most sampled.
+Image sample_density_image(const std::vector<int>& samples, int width, int height);
+
+// Lighting for one visible hit, split into steps so that the shadow rays
+// for a whole packet of hits can be traced together.
+struct Shading {
+  Ray ray;
+  HitRecord hit;
+  Vector3D reflected;
+  Colour colour;
+
+  Shading(): colour(0.0) {}
+  // Starts with the ambient term.
+  Shading(const Ray& ray, const HitRecord& hit, const Lighting& lighting);
+
+  // The (normalized) ray from the hit toward the light, and how far away
+  // the light is along it.
+  Ray shadowRay(const Light* light, double& distance) const;
+  // Adds the light's contribution, scaled by shadowMultiplier.
+  void addLight(const Light* light, const Colour& shadowMultiplier);
+  // Blends in the reflection, traced one ray at a time, and returns the
+  // final colour.
+  Colour finish(SceneBVH* scene, const Lighting& lighting, ShadowCache& shadows, RayTraceStats& stats, int depth);
+};
+
+// Traces the camera ray through (x, y) in pixel coordinates. If object is
+// given, it is set to the instance hit, or -1.
+Colour raytrace_pixel(SceneBVH* scene,
+  double x, double y,
+  const Camera& camera,
+  const Lighting& lighting,
+  ShadowCache& shadows,
+  RayTraceStats& stats,
+  int* object=NULL);
+
+// Traces the camera rays through (xs[i], ys[i]) for the lanes in mask as
+// one packet, along with their first shadow rays, and sets colours[i] (and
+// objects[i], if given) for each lane.
+void raytrace_packet(SceneBVH* scene,
+  const double* xs, const double* ys, int mask,
+  const Camera& camera,
+  const Lighting& lighting,
+  ShadowCache& shadows,
+  Colour* colours,
+  int* objects,
+  RayTraceStats& stats);
 
-RayResult* raytrace_visible(SceneNode* node, const Ray& ray, const Lighting& lighting, int depth=0);
-RayResult* raytrace_shadow(SceneNode* node, const Ray& ray, const Lighting& lighting);
+// Returns true if the ray hit anything, in which case colour is set. If
+// object is given, it is set to the instance hit, or -1.
+bool raytrace_visible(SceneBVH* scene, const Ray& ray, const Lighting& lighting, ShadowCache& shadows,
+                      Colour& colour, RayTraceStats& stats, int depth=0, int* object=NULL);
+// Adds the lights that reach the hit to shading: every light, or
+// LIGHT_SAMPLES picked by lighting.sampler if it is set.
+void shade_lights(SceneBVH* scene, Shading& shading, const Lighting& lighting, ShadowCache& shadows, RayTraceStats& stats);
+// Returns white if nothing lies between the ray origin and distance along
+// the (normalized) ray, black otherwise. occluder is the light's entry in
+// a ShadowCache: tried first, then set to whatever the scene finds blocking
+// the ray, or -1 if nothing does.
+Colour raytrace_shadow(SceneBVH* scene, const Ray& ray, double distance, int& occluder, RayTraceStats& stats);
 
 // 0 <= x <= 1, 0 <= y <= 1.
 Colour genBackground(const Ray& ray, double x, double y);
@@ -14,25 +14,26 @@
 
 #include "algebra.hpp"
 
-double Vector3D::normalize()
+template<typename T>
+T BasicVector3D<T>::normalize()
 {
-  double denom = 1.0;
-  double x = (v_[0] > 0.0) ? v_[0] : -v_[0];
-  double y = (v_[1] > 0.0) ? v_[1] : -v_[1];
-  double z = (v_[2] > 0.0) ? v_[2] : -v_[2];
+  T denom = 1.0;
+  T x = (v_[0] > 0.0) ? v_[0] : -v_[0];
+  T y = (v_[1] > 0.0) ? v_[1] : -v_[1];
+  T z = (v_[2] > 0.0) ? v_[2] : -v_[2];
 
   if(x > y) {
     if(x > z) {
       if(1.0 + x > 1.0) {
         y = y / x;
         z = z / x;
-        denom = 1.0 / (x * sqrt(1.0 + y*y + z*z));
+        denom = 1.0 / (x * std::sqrt(1.0 + y*y + z*z));
       }
     } else { /* z > x > y */ 
       if(1.0 + z > 1.0) {
         y = y / z;
         x = x / z;
-        denom = 1.0 / (z * sqrt(1.0 + y*y + x*x));
+        denom = 1.0 / (z * std::sqrt(1.0 + y*y + x*x));
       }
     }
   } else {
@@ -40,13 +41,13 @@ double Vector3D::normalize()
       if(1.0 + y > 1.0) {
         z = z / y;
         x = x / y;
-        denom = 1.0 / (y * sqrt(1.0 + z*z + x*x));
+        denom = 1.0 / (y * std::sqrt(1.0 + z*z + x*x));
       }
     } else { /* x < y < z */
       if(1.0 + z > 1.0) {
         y = y / z;
         x = x / z;
-        denom = 1.0 / (z * sqrt(1.0 + y*y + x*x));
+        denom = 1.0 / (z * std::sqrt(1.0 + y*y + x*x));
       }
     }
   }
@@ -65,7 +66,8 @@ double Vector3D::normalize()
  * Define some helper functions for matrix inversion.
  */
 
-static void swaprows(Matrix4x4& a, size_t r1, size_t r2)
+template<typename T>
+static void swaprows(BasicMatrix4x4<T>& a, size_t r1, size_t r2)
 {
   std::swap(a[r1][0], a[r2][0]);
   std::swap(a[r1][1], a[r2][1]);
@@ -73,7 +75,8 @@ static void swaprows(Matrix4x4& a, size_t r1, size_t r2)
   std::swap(a[r1][3], a[r2][3]);
 }
 
-static void dividerow(Matrix4x4& a, size_t r, double fac)
+template<typename T>
+static void dividerow(BasicMatrix4x4<T>& a, size_t r, T fac)
 {
   a[r][0] /= fac;
   a[r][1] /= fac;
@@ -81,7 +84,8 @@ static void dividerow(Matrix4x4& a, size_t r, double fac)
   a[r][3] /= fac;
 }
 
-static void submultrow(Matrix4x4& a, size_t dest, size_t src, double fac)
+template<typename T>
+static void submultrow(BasicMatrix4x4<T>& a, size_t dest, size_t src, T fac)
 {
   a[dest][0] -= fac * a[src][0];
   a[dest][1] -= fac * a[src][1];
@@ -96,13 +100,14 @@ static void submultrow(Matrix4x4& a, size_t dest, size_t src, double fac)
  * from a different school.  I taught that course too, so I figured it
  * would be okay.
  */
-Matrix4x4 Matrix4x4::invert() const
+template<typename T>
+BasicMatrix4x4<T> BasicMatrix4x4<T>::invert() const
 {
   /* The algorithm is plain old Gauss-Jordan elimination 
      with partial pivoting. */
 
-  Matrix4x4 a(*this);
-  Matrix4x4 ret;
+  BasicMatrix4x4<T> a(*this);
+  BasicMatrix4x4<T> ret;
 
   /* Loop over cols of a from left to right, 
      eliminating above and below diag */
@@ -111,7 +116,7 @@ Matrix4x4 Matrix4x4::invert() const
   for(size_t j = 0; j < 4; ++j) { 
     size_t i1 = j; /* Row with largest pivot candidate */
     for(size_t i = j + 1; i < 4; ++i) {
-      if(fabs(a[i][j]) > fabs(a[i1][j])) {
+      if(std::fabs(a[i][j]) > std::fabs(a[i1][j])) {
         i1 = i;
       }
     }
@@ -141,3 +146,10 @@ Matrix4x4 Matrix4x4::invert() const
 
   return ret;
 }
+
+// Both precisions are built, so either build of the ray tracer (and tools
+// comparing the two) can link against them.
+template class BasicVector3D<float>;
+template class BasicVector3D<double>;
+template class BasicMatrix4x4<float>;
+template class BasicMatrix4x4<double>;
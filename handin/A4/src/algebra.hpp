@@ -62,29 +62,32 @@ private:
   double v_[2];
 };
 
-class Point3D
+template<typename T>
+class BasicPoint3D
 {
 public:
-  Point3D()
+  typedef T value_type;
+
+  BasicPoint3D()
   {
     v_[0] = 0.0;
     v_[1] = 0.0;
     v_[2] = 0.0;
   }
-  Point3D(double x, double y, double z)
+  BasicPoint3D(T x, T y, T z)
   { 
     v_[0] = x;
     v_[1] = y;
     v_[2] = z;
   }
-  Point3D(const Point3D& other)
+  BasicPoint3D(const BasicPoint3D<T>& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
     v_[2] = other.v_[2];
   }
 
-  Point3D& operator =(const Point3D& other)
+  BasicPoint3D<T>& operator =(const BasicPoint3D<T>& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
@@ -92,42 +95,45 @@ public:
     return *this;
   }
 
-  double& operator[](size_t idx) 
+  T& operator[](size_t idx) 
   {
     return v_[ idx ];
   }
-  double operator[](size_t idx) const 
+  T operator[](size_t idx) const 
   {
     return v_[ idx ];
   }
 
 private:
-  double v_[3];
+  T v_[3];
 };
 
-class Vector3D
+template<typename T>
+class BasicVector3D
 {
 public:
-  Vector3D()
+  typedef T value_type;
+
+  BasicVector3D()
   {
     v_[0] = 0.0;
     v_[1] = 0.0;
     v_[2] = 0.0;
   }
-  Vector3D(double x, double y, double z)
+  BasicVector3D(T x, T y, T z)
   { 
     v_[0] = x;
     v_[1] = y;
     v_[2] = z;
   }
-  Vector3D(const Vector3D& other)
+  BasicVector3D(const BasicVector3D<T>& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
     v_[2] = other.v_[2];
   }
 
-  Vector3D& operator =(const Vector3D& other)
+  BasicVector3D<T>& operator =(const BasicVector3D<T>& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
@@ -135,79 +141,87 @@ public:
     return *this;
   }
 
-  double& operator[](size_t idx) 
+  T& operator[](size_t idx) 
   {
     return v_[ idx ];
   }
-  double operator[](size_t idx) const 
+  T operator[](size_t idx) const 
   {
     return v_[ idx ];
   }
 
-  double dot(const Vector3D& other) const
+  T dot(const BasicVector3D<T>& other) const
   {
     return v_[0]*other.v_[0] + v_[1]*other.v_[1] + v_[2]*other.v_[2];
   }
 
-  double length2() const
+  T length2() const
   {
     return v_[0]*v_[0] + v_[1]*v_[1] + v_[2]*v_[2];
   }
-  double length() const
+  T length() const
   {
-    return sqrt(length2());
+    return std::sqrt(length2());
   }
 
-  double normalize();
+  T normalize();
 
-  Vector3D cross(const Vector3D& other) const
+  BasicVector3D<T> cross(const BasicVector3D<T>& other) const
   {
-    return Vector3D(
+    return BasicVector3D<T>(
                     v_[1]*other[2] - v_[2]*other[1],
                     v_[2]*other[0] - v_[0]*other[2],
                     v_[0]*other[1] - v_[1]*other[0]);
   }
 
 private:
-  double v_[3];
+  T v_[3];
 };
 
-inline Vector3D operator *(double s, const Vector3D& v)
+template<typename T>
+inline BasicVector3D<T> operator *(typename BasicVector3D<T>::value_type s, const BasicVector3D<T>& v)
 {
-  return Vector3D(s*v[0], s*v[1], s*v[2]);
+  return BasicVector3D<T>(s*v[0], s*v[1], s*v[2]);
 }
 
-inline Vector3D operator +(const Vector3D& a, const Vector3D& b)
+template<typename T>
+inline BasicVector3D<T> operator +(const BasicVector3D<T>& a, const BasicVector3D<T>& b)
 {
-  return Vector3D(a[0]+b[0], a[1]+b[1], a[2]+b[2]);
+  return BasicVector3D<T>(a[0]+b[0], a[1]+b[1], a[2]+b[2]);
 }
 
-inline Point3D operator +(const Point3D& a, const Vector3D& b)
+template<typename T>
+inline BasicPoint3D<T> operator +(const BasicPoint3D<T>& a, const BasicVector3D<T>& b)
 {
-  return Point3D(a[0]+b[0], a[1]+b[1], a[2]+b[2]);
+  return BasicPoint3D<T>(a[0]+b[0], a[1]+b[1], a[2]+b[2]);
 }
 
-inline Vector3D operator -(const Point3D& a, const Point3D& b)
+template<typename T>
+inline BasicVector3D<T> operator -(const BasicPoint3D<T>& a, const BasicPoint3D<T>& b)
 {
-  return Vector3D(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
+  return BasicVector3D<T>(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
 }
 
-inline Vector3D operator -(const Vector3D& a, const Vector3D& b)
+template<typename T>
+inline BasicVector3D<T> operator -(const BasicVector3D<T>& a, const BasicVector3D<T>& b)
 {
-  return Vector3D(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
+  return BasicVector3D<T>(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
 }
 
-inline Vector3D operator -(const Vector3D& a)
+template<typename T>
+inline BasicVector3D<T> operator -(const BasicVector3D<T>& a)
 {
-  return Vector3D(-a[0], -a[1], -a[2]);
+  return BasicVector3D<T>(-a[0], -a[1], -a[2]);
 }
 
-inline Point3D operator -(const Point3D& a, const Vector3D& b)
+template<typename T>
+inline BasicPoint3D<T> operator -(const BasicPoint3D<T>& a, const BasicVector3D<T>& b)
 {
-  return Point3D(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
+  return BasicPoint3D<T>(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
 }
 
-inline Vector3D cross(const Vector3D& a, const Vector3D& b) 
+template<typename T>
+inline BasicVector3D<T> cross(const BasicVector3D<T>& a, const BasicVector3D<T>& b) 
 {
   return a.cross(b);
 }
@@ -217,36 +231,41 @@ inline std::ostream& operator <<(std::ostream& os, const Point2D& p)
   return os << "p<" << p[0] << "," << p[1] << ">";
 }
 
-inline std::ostream& operator <<(std::ostream& os, const Point3D& p)
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicPoint3D<T>& p)
 {
   return os << "p<" << p[0] << "," << p[1] << "," << p[2] << ">";
 }
 
-inline std::ostream& operator <<(std::ostream& os, const Vector3D& v)
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicVector3D<T>& v)
 {
   return os << "v<" << v[0] << "," << v[1] << "," << v[2] << ">";
 }
 
-class Matrix4x4;
+template<typename T> class BasicMatrix4x4;
 
-class Vector4D
+template<typename T>
+class BasicVector4D
 {
 public:
-  Vector4D()
+  typedef T value_type;
+
+  BasicVector4D()
   {
     v_[0] = 0.0;
     v_[1] = 0.0;
     v_[2] = 0.0;
     v_[3] = 0.0;
   }
-  Vector4D(double x, double y, double z, double w)
+  BasicVector4D(T x, T y, T z, T w)
   { 
     v_[0] = x;
     v_[1] = y;
     v_[2] = z;
     v_[3] = w;
   }
-  Vector4D(const Vector4D& other)
+  BasicVector4D(const BasicVector4D<T>& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
@@ -254,7 +273,7 @@ public:
     v_[3] = other.v_[3];
   }
 
-  Vector4D& operator =(const Vector4D& other)
+  BasicVector4D<T>& operator =(const BasicVector4D<T>& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
@@ -263,23 +282,26 @@ public:
     return *this;
   }
 
-  double& operator[](size_t idx) 
+  T& operator[](size_t idx) 
   {
     return v_[ idx ];
   }
-  double operator[](size_t idx) const 
+  T operator[](size_t idx) const 
   {
     return v_[ idx ];
   }
 
 private:
-  double v_[4];
+  T v_[4];
 };
 
-class Matrix4x4
+template<typename T>
+class BasicMatrix4x4
 {
 public:
-  Matrix4x4()
+  typedef T value_type;
+
+  BasicMatrix4x4()
   {
     // Construct an identity matrix
     std::fill(v_, v_+16, 0.0);
@@ -288,12 +310,12 @@ public:
     v_[10] = 1.0;
     v_[15] = 1.0;
   }
-  Matrix4x4(const Matrix4x4& other)
+  BasicMatrix4x4(const BasicMatrix4x4<T>& other)
   {
     std::copy(other.v_, other.v_+16, v_);
   }
-  Matrix4x4(const Vector4D row1, const Vector4D row2, const Vector4D row3, 
-             const Vector4D row4)
+  BasicMatrix4x4(const BasicVector4D<T> row1, const BasicVector4D<T> row2, const BasicVector4D<T> row3, 
+             const BasicVector4D<T> row4)
   {
     v_[0] = row1[0]; 
     v_[1] = row1[1]; 
@@ -315,66 +337,68 @@ public:
     v_[14] = row4[2]; 
     v_[15] = row4[3]; 
   }
-  Matrix4x4(double *vals)
+  template<typename U>
+  BasicMatrix4x4(const U *vals)
   {
-    std::copy(vals, vals + 16, (double*)v_);
+    std::copy(vals, vals + 16, (T*)v_);
   }
 
-  Matrix4x4& operator=(const Matrix4x4& other)
+  BasicMatrix4x4<T>& operator=(const BasicMatrix4x4<T>& other)
   {
     std::copy(other.v_, other.v_+16, v_);
     return *this;
   }
 
-  Vector4D getRow(size_t row) const
+  BasicVector4D<T> getRow(size_t row) const
   {
-    return Vector4D(v_[4*row], v_[4*row+1], v_[4*row+2], v_[4*row+3]);
+    return BasicVector4D<T>(v_[4*row], v_[4*row+1], v_[4*row+2], v_[4*row+3]);
   }
-  double *getRow(size_t row) 
+  T *getRow(size_t row) 
   {
-    return (double*)v_ + 4*row;
+    return (T*)v_ + 4*row;
   }
 
-  Vector4D getColumn(size_t col) const
+  BasicVector4D<T> getColumn(size_t col) const
   {
-    return Vector4D(v_[col], v_[4+col], v_[8+col], v_[12+col]);
+    return BasicVector4D<T>(v_[col], v_[4+col], v_[8+col], v_[12+col]);
   }
 
-  Vector4D operator[](size_t row) const
+  BasicVector4D<T> operator[](size_t row) const
   {
     return getRow(row);
   }
-  double *operator[](size_t row) 
+  T *operator[](size_t row) 
   {
     return getRow(row);
   }
 
-  Matrix4x4 transpose() const
+  BasicMatrix4x4<T> transpose() const
   {
-    return Matrix4x4(getColumn(0), getColumn(1), 
+    return BasicMatrix4x4<T>(getColumn(0), getColumn(1), 
                       getColumn(2), getColumn(3));
   }
-  Matrix4x4 invert() const;
+  BasicMatrix4x4<T> invert() const;
 
-  const double *begin() const
+  const T *begin() const
   {
-    return (double*)v_;
+    return (T*)v_;
   }
-  const double *end() const
+  const T *end() const
   {
     return begin() + 16;
   }
 		
 private:
-  double v_[16];
+  T v_[16];
 };
 
-inline Matrix4x4 operator *(const Matrix4x4& a, const Matrix4x4& b)
+template<typename T>
+inline BasicMatrix4x4<T> operator *(const BasicMatrix4x4<T>& a, const BasicMatrix4x4<T>& b)
 {
-  Matrix4x4 ret;
+  BasicMatrix4x4<T> ret;
 
   for(size_t i = 0; i < 4; ++i) {
-    Vector4D row = a.getRow(i);
+    BasicVector4D<T> row = a.getRow(i);
 		
     for(size_t j = 0; j < 4; ++j) {
       ret[i][j] = row[0] * b[0][j] + row[1] * b[1][j] + 
@@ -385,31 +409,35 @@ inline Matrix4x4 operator *(const Matrix4x4& a, const Matrix4x4& b)
   return ret;
 }
 
-inline Vector3D operator *(const Matrix4x4& M, const Vector3D& v)
+template<typename T>
+inline BasicVector3D<T> operator *(const BasicMatrix4x4<T>& M, const BasicVector3D<T>& v)
 {
-  return Vector3D(
+  return BasicVector3D<T>(
                   v[0] * M[0][0] + v[1] * M[0][1] + v[2] * M[0][2],
                   v[0] * M[1][0] + v[1] * M[1][1] + v[2] * M[1][2],
                   v[0] * M[2][0] + v[1] * M[2][1] + v[2] * M[2][2]);
 }
 
-inline Point3D operator *(const Matrix4x4& M, const Point3D& p)
+template<typename T>
+inline BasicPoint3D<T> operator *(const BasicMatrix4x4<T>& M, const BasicPoint3D<T>& p)
 {
-  return Point3D(
+  return BasicPoint3D<T>(
                  p[0] * M[0][0] + p[1] * M[0][1] + p[2] * M[0][2] + M[0][3],
                  p[0] * M[1][0] + p[1] * M[1][1] + p[2] * M[1][2] + M[1][3],
                  p[0] * M[2][0] + p[1] * M[2][1] + p[2] * M[2][2] + M[2][3]);
 }
 
-inline Vector3D transNorm(const Matrix4x4& M, const Vector3D& n)
+template<typename T>
+inline BasicVector3D<T> transNorm(const BasicMatrix4x4<T>& M, const BasicVector3D<T>& n)
 {
-  return Vector3D(
+  return BasicVector3D<T>(
                   n[0] * M[0][0] + n[1] * M[1][0] + n[2] * M[2][0],
                   n[0] * M[0][1] + n[1] * M[1][1] + n[2] * M[2][1],
                   n[0] * M[0][2] + n[1] * M[1][2] + n[2] * M[2][2]);
 }
 
-inline std::ostream& operator <<(std::ostream& os, const Matrix4x4& M)
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicMatrix4x4<T>& M)
 {
   return os << "[" << M[0][0] << " " << M[0][1] << " " 
             << M[0][2] << " " << M[0][3] << "]" << std::endl
@@ -421,26 +449,29 @@ inline std::ostream& operator <<(std::ostream& os, const Matrix4x4& M)
             << M[3][2] << " " << M[3][3] << "]";
 }
 
-class Colour
+template<typename T>
+class BasicColour
 {
 public:
-  Colour(double r, double g, double b)
+  typedef T value_type;
+
+  BasicColour(T r, T g, T b)
     : r_(r)
     , g_(g)
     , b_(b)
   {}
-  Colour(double c)
+  BasicColour(T c)
     : r_(c)
     , g_(c)
     , b_(c)
   {}
-  Colour(const Colour& other)
+  BasicColour(const BasicColour<T>& other)
     : r_(other.r_)
     , g_(other.g_)
     , b_(other.b_)
   {}
 
-  Colour& operator =(const Colour& other)
+  BasicColour<T>& operator =(const BasicColour<T>& other)
   {
     r_ = other.r_;
     g_ = other.g_;
@@ -448,43 +479,67 @@ public:
     return *this;
   }
 
-  double R() const 
+  T R() const 
   { 
     return r_;
   }
-  double G() const 
+  T G() const 
   { 
     return g_;
   }
-  double B() const 
+  T B() const 
   { 
     return b_;
   }
 
 private:
-  double r_;
-  double g_;
-  double b_;
+  T r_;
+  T g_;
+  T b_;
 };
 
-inline Colour operator *(double s, const Colour& a)
+template<typename T>
+inline BasicColour<T> operator *(typename BasicColour<T>::value_type s, const BasicColour<T>& a)
+{
+  return BasicColour<T>(s*a.R(), s*a.G(), s*a.B());
+}
+
+template<typename T>
+inline BasicColour<T> operator *(const BasicColour<T>& a, typename BasicColour<T>::value_type s)
 {
-  return Colour(s*a.R(), s*a.G(), s*a.B());
+  return BasicColour<T>(a.R()*s, a.G()*s, a.B()*s);
 }
 
-inline Colour operator *(const Colour& a, const Colour& b)
+template<typename T>
+inline BasicColour<T> operator *(const BasicColour<T>& a, const BasicColour<T>& b)
 {
-  return Colour(a.R()*b.R(), a.G()*b.G(), a.B()*b.B());
+  return BasicColour<T>(a.R()*b.R(), a.G()*b.G(), a.B()*b.B());
 }
 
-inline Colour operator +(const Colour& a, const Colour& b)
+template<typename T>
+inline BasicColour<T> operator +(const BasicColour<T>& a, const BasicColour<T>& b)
 {
-  return Colour(a.R()+b.R(), a.G()+b.G(), a.B()+b.B());
+  return BasicColour<T>(a.R()+b.R(), a.G()+b.G(), a.B()+b.B());
 }
 
-inline std::ostream& operator <<(std::ostream& os, const Colour& c)
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicColour<T>& c)
 {
   return os << "c<" << c.R() << "," << c.G() << "," << c.B() << ">";
 }
 
+// The ray tracer's types are all in one scalar type: double by default,
+// or float when built with SINGLE_PRECISION.
+#ifdef SINGLE_PRECISION
+typedef float Scalar;
+#else
+typedef double Scalar;
+#endif
+
+typedef BasicPoint3D<Scalar> Point3D;
+typedef BasicVector3D<Scalar> Vector3D;
+typedef BasicVector4D<Scalar> Vector4D;
+typedef BasicMatrix4x4<Scalar> Matrix4x4;
+typedef BasicColour<Scalar> Colour;
+
 #endif // CS488_ALGEBRA_HPP
@@ -0,0 +1,737 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <limits>
+#include <pthread.h>
+#include "mesh.hpp"
+#include "primitive.hpp"
+
+// Relative cost of visiting an interior node versus intersecting one item.
+#define BVH_TRAVERSAL_COST 0.125
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 4)
+
+// Nodes with more items than this are split by binning centroids.
+#define BVH_SWEEP_MAX_COUNT 32
+#define BVH_NUM_BINS 16
+
+// Boxes with no thickness along an axis (e.g. a flat floor mesh) are padded
+// by this much so the slab test stays well-defined.
+#define BVH_MIN_EXTENT 0.0001
+
+namespace {
+
+// Appends a subtree built into its own array, moving the offsets of its
+// interior nodes to where it lands.
+void append_subtree(const std::vector<BVH::Node>& subtree, std::vector<BVH::Node>& nodes) {
+  const int base = nodes.size();
+  nodes.insert(nodes.end(), subtree.begin(), subtree.end());
+  for (unsigned int i = base; i < nodes.size(); i++) {
+    if (!nodes[i].isLeaf()) {
+      nodes[i].offset += base;
+    }
+  }
+}
+
+}
+
+void BVH::build(const std::vector<BoundingBox>& bounds, int maxLeafSize, int threads) {
+  m_maxLeafSize = maxLeafSize;
+  m_nodes.clear();
+  m_packetBounds.clear();
+  m_indices.clear();
+
+  std::vector<Point3D> centroids;
+  centroids.reserve(bounds.size());
+  for (unsigned int i = 0; i < bounds.size(); i++) {
+    centroids.push_back(bounds[i].centroid());
+    if (!bounds[i].isEmpty()) {
+      m_indices.push_back(i);
+    }
+  }
+
+  if (m_indices.empty()) {
+    return;
+  }
+  m_nodes.reserve(2 * m_indices.size());
+  buildNode(bounds, centroids, 0, m_indices.size(), 0, threads, m_nodes);
+
+  m_packetBounds.reserve(m_nodes.size());
+  for (std::vector<Node>::const_iterator it = m_nodes.begin(); it != m_nodes.end(); it++) {
+    m_packetBounds.push_back(PacketBox(it->bounds));
+  }
+}
+
+void BVH::refit(const std::vector<BoundingBox>& bounds) {
+  // Both children of a node come after it, so going backwards reaches
+  // them first.
+  for (int i = (int) m_nodes.size() - 1; i >= 0; i--) {
+    Node& node = m_nodes[i];
+    BoundingBox nodeBounds;
+    if (node.isLeaf()) {
+      for (int j = node.offset; j < node.offset + node.count; j++) {
+        nodeBounds.expand(bounds[m_indices[j]]);
+      }
+      for (int axis = X; axis <= Z; axis++) {
+        if (nodeBounds.max[axis] - nodeBounds.min[axis] < BVH_MIN_EXTENT) {
+          nodeBounds.min[axis] -= BVH_MIN_EXTENT;
+          nodeBounds.max[axis] += BVH_MIN_EXTENT;
+        }
+      }
+    } else {
+      nodeBounds.expand(m_nodes[i + 1].bounds);
+      nodeBounds.expand(m_nodes[node.offset].bounds);
+    }
+    node.bounds = nodeBounds;
+    m_packetBounds[i] = PacketBox(nodeBounds);
+  }
+}
+
+void BVH::restore(const std::vector<Node>& nodes, const std::vector<int>& indices, int maxLeafSize) {
+  m_maxLeafSize = maxLeafSize;
+  m_nodes = nodes;
+  m_indices = indices;
+  m_packetBounds.clear();
+  m_packetBounds.reserve(m_nodes.size());
+  for (std::vector<Node>::const_iterator it = m_nodes.begin(); it != m_nodes.end(); it++) {
+    m_packetBounds.push_back(PacketBox(it->bounds));
+  }
+}
+
+struct BVH::SubtreeBuild {
+  SubtreeBuild(BVH* bvh, const std::vector<BoundingBox>& bounds, const std::vector<Point3D>& centroids,
+               int start, int end, int depth, int threads)
+    : bvh(bvh), bounds(bounds), centroids(centroids), start(start), end(end), depth(depth), threads(threads) {}
+
+  BVH* bvh;
+  const std::vector<BoundingBox>& bounds;
+  const std::vector<Point3D>& centroids;
+  int start;
+  int end;
+  int depth;
+  int threads;
+  std::vector<BVH::Node> nodes;
+};
+
+void* BVH::build_subtree(void* arg) {
+  SubtreeBuild* build = (SubtreeBuild*) arg;
+  build->bvh->buildNode(build->bounds, build->centroids, build->start, build->end,
+                        build->depth, build->threads, build->nodes);
+  return NULL;
+}
+
+void BVH::buildNode(const std::vector<BoundingBox>& bounds, const std::vector<Point3D>& centroids,
+                    int start, int end, int depth, int threads, std::vector<Node>& nodes) {
+  const int nodeIndex = nodes.size();
+  nodes.push_back(Node());
+
+  BoundingBox nodeBounds;
+  for (int i = start; i < end; i++) {
+    nodeBounds.expand(bounds[m_indices[i]]);
+  }
+  for (int axis = X; axis <= Z; axis++) {
+    if (nodeBounds.max[axis] - nodeBounds.min[axis] < BVH_MIN_EXTENT) {
+      nodeBounds.min[axis] -= BVH_MIN_EXTENT;
+      nodeBounds.max[axis] += BVH_MIN_EXTENT;
+    }
+  }
+  nodes[nodeIndex].bounds = nodeBounds;
+
+  const int count = end - start;
+  if (count == 1 || depth >= BVH_MAX_DEPTH) {
+    nodes[nodeIndex].offset = start;
+    nodes[nodeIndex].count = count;
+    return;
+  }
+
+  int split;
+  double cost;
+  if (count <= BVH_SWEEP_MAX_COUNT) {
+    cost = sweepSplit(bounds, centroids, start, end, nodeBounds.surfaceArea(), split);
+  } else {
+    cost = binnedSplit(bounds, centroids, start, end, nodeBounds.surfaceArea(), split);
+  }
+
+  if (cost >= count && count <= m_maxLeafSize) {
+    nodes[nodeIndex].offset = start;
+    nodes[nodeIndex].count = count;
+    return;
+  }
+
+  nodes[nodeIndex].count = 0;
+  if (threads > 1 && count >= BVH_PARALLEL_MIN_ITEMS) {
+    // The two halves touch disjoint ranges of m_indices, so the left one
+    // can be built into a separate array on another thread and spliced in
+    // after the node, exactly where the serial build would have put it.
+    SubtreeBuild left(this, bounds, centroids, start, split, depth + 1, threads / 2);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, build_subtree, &left) == 0) {
+      std::vector<Node> right;
+      buildNode(bounds, centroids, split, end, depth + 1, threads - threads / 2, right);
+      pthread_join(thread, NULL);
+      append_subtree(left.nodes, nodes);
+      nodes[nodeIndex].offset = nodes.size();
+      append_subtree(right, nodes);
+      return;
+    }
+  }
+  buildNode(bounds, centroids, start, split, depth + 1, 1, nodes);
+  nodes[nodeIndex].offset = nodes.size();
+  buildNode(bounds, centroids, split, end, depth + 1, 1, nodes);
+}
+
+double BVH::sweepSplit(const std::vector<BoundingBox>& bounds, const std::vector<Point3D>& centroids,
+                       int start, int end, double nodeArea, int& split) {
+  // Sweep every axis in centroid order and keep the cheapest split.
+  const int count = end - start;
+  std::vector<double> rightAreas(count);
+  double bestCost = std::numeric_limits<double>::max();
+  int bestAxis = X;
+  int bestSplit = count / 2;
+  for (int axis = X; axis <= Z; axis++) {
+    std::sort(m_indices.begin() + start, m_indices.begin() + end, CentroidComparator((Axis) axis, centroids));
+
+    BoundingBox right;
+    for (int i = count - 1; i > 0; i--) {
+      right.expand(bounds[m_indices[start + i]]);
+      rightAreas[i] = right.surfaceArea();
+    }
+
+    BoundingBox left;
+    for (int i = 1; i < count; i++) {
+      left.expand(bounds[m_indices[start + i - 1]]);
+      double cost = BVH_TRAVERSAL_COST + (left.surfaceArea() * i + rightAreas[i] * (count - i)) / nodeArea;
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestSplit = i;
+      }
+    }
+  }
+
+  if (bestAxis != Z) {
+    std::sort(m_indices.begin() + start, m_indices.begin() + end, CentroidComparator((Axis) bestAxis, centroids));
+  }
+  split = start + bestSplit;
+  return bestCost;
+}
+
+namespace {
+
+struct Bin {
+  BoundingBox bounds;
+  int count;
+
+  Bin(): count(0) {}
+};
+
+// Maps a centroid to its bin along one axis of the centroid bounds.
+struct BinIndex {
+  BinIndex(Axis axis, double min, double max): axis(axis), min(min), scale(BVH_NUM_BINS / (max - min)) {}
+
+  int operator()(const Point3D& centroid) const {
+    int bin = (int) ((centroid[axis] - min) * scale);
+    return std::max(0, std::min(BVH_NUM_BINS - 1, bin));
+  }
+
+  Axis axis;
+  double min;
+  double scale;
+};
+
+struct InLeftBins {
+  InLeftBins(const BinIndex& binIndex, int lastBin, const std::vector<Point3D>& centroids)
+    : binIndex(binIndex), lastBin(lastBin), centroids(centroids) {}
+
+  bool operator()(int index) const {
+    return binIndex(centroids[index]) <= lastBin;
+  }
+
+  BinIndex binIndex;
+  int lastBin;
+  const std::vector<Point3D>& centroids;
+};
+
+}
+
+double BVH::binnedSplit(const std::vector<BoundingBox>& bounds, const std::vector<Point3D>& centroids,
+                        int start, int end, double nodeArea, int& split) {
+  BoundingBox centroidBounds;
+  for (int i = start; i < end; i++) {
+    centroidBounds.expand(centroids[m_indices[i]]);
+  }
+
+  double bestCost = std::numeric_limits<double>::max();
+  int bestAxis = -1;
+  int bestBin = 0;
+  for (int axis = X; axis <= Z; axis++) {
+    if (centroidBounds.max[axis] <= centroidBounds.min[axis]) {
+      continue;
+    }
+    BinIndex binIndex((Axis) axis, centroidBounds.min[axis], centroidBounds.max[axis]);
+    Bin bins[BVH_NUM_BINS];
+    for (int i = start; i < end; i++) {
+      Bin& bin = bins[binIndex(centroids[m_indices[i]])];
+      bin.bounds.expand(bounds[m_indices[i]]);
+      bin.count++;
+    }
+
+    double rightAreas[BVH_NUM_BINS];
+    int rightCounts[BVH_NUM_BINS];
+    BoundingBox right;
+    int rightCount = 0;
+    for (int b = BVH_NUM_BINS - 1; b > 0; b--) {
+      right.expand(bins[b].bounds);
+      rightCount += bins[b].count;
+      rightAreas[b] = right.surfaceArea();
+      rightCounts[b] = rightCount;
+    }
+
+    BoundingBox left;
+    int leftCount = 0;
+    for (int b = 0; b < BVH_NUM_BINS - 1; b++) {
+      left.expand(bins[b].bounds);
+      leftCount += bins[b].count;
+      if (leftCount == 0 || rightCounts[b + 1] == 0) {
+        continue;
+      }
+      double cost = BVH_TRAVERSAL_COST + (left.surfaceArea() * leftCount + rightAreas[b + 1] * rightCounts[b + 1]) / nodeArea;
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestBin = b;
+      }
+    }
+  }
+
+  if (bestAxis < 0) {
+    // Every centroid coincides; any split is as good as another.
+    split = (start + end) / 2;
+    return end - start;
+  }
+
+  BinIndex binIndex((Axis) bestAxis, centroidBounds.min[bestAxis], centroidBounds.max[bestAxis]);
+  split = std::partition(m_indices.begin() + start, m_indices.begin() + end,
+                         InLeftBins(binIndex, bestBin, centroids)) - m_indices.begin();
+  return bestCost;
+}
+
+PrimitiveKind primitive_kind(const Primitive* primitive) {
+  // Sphere and Cube are NonhierSphere and NonhierBox with fixed arguments.
+  if (dynamic_cast<const NonhierSphere*>(primitive)) {
+    return SPHERE_PRIMITIVE;
+  } else if (dynamic_cast<const NonhierBox*>(primitive)) {
+    return BOX_PRIMITIVE;
+  } else if (dynamic_cast<const Cylinder*>(primitive)) {
+    return CYLINDER_PRIMITIVE;
+  } else if (dynamic_cast<const Cone*>(primitive)) {
+    return CONE_PRIMITIVE;
+  } else if (dynamic_cast<const Disc*>(primitive)) {
+    return DISC_PRIMITIVE;
+  } else if (dynamic_cast<const Torus*>(primitive)) {
+    return TORUS_PRIMITIVE;
+  } else if (dynamic_cast<const Mesh*>(primitive)) {
+    return MESH_PRIMITIVE;
+  }
+  return GENERIC_PRIMITIVE;
+}
+
+void FlatScene::add(const Instance& instance) {
+  invtrans.push_back(instance.invtrans);
+  kinds.push_back(primitive_kind(instance.primitive));
+  primitives.push_back(instance.primitive);
+
+  std::vector<Material*>::iterator material = std::find(materialTable.begin(), materialTable.end(), instance.material);
+  materials.push_back(material - materialTable.begin());
+  if (material == materialTable.end()) {
+    materialTable.push_back(instance.material);
+  }
+
+  trans.push_back(instance.trans);
+  normaltrans.push_back(instance.normaltrans);
+}
+
+SceneBVH::SceneBVH(SceneNode* root, int threads) {
+  std::vector<Instance> instances;
+  root->collectInstances(Matrix4x4(), Matrix4x4(), instances);
+
+  std::vector<BoundingBox> bounds;
+  bounds.reserve(instances.size());
+  for (std::vector<Instance>::const_iterator it = instances.begin(); it != instances.end(); it++) {
+    m_scene.add(*it);
+    bounds.push_back(it->primitive->getBounds().transform(it->trans));
+  }
+  m_bvh.build(bounds, BVH_MAX_LEAF_SIZE, threads);
+}
+
+bool SceneBVH::refit(SceneNode* root) {
+  std::vector<Instance> instances;
+  root->collectInstances(Matrix4x4(), Matrix4x4(), instances);
+  if ((int) instances.size() != m_scene.size()) {
+    return false;
+  }
+  for (unsigned int i = 0; i < instances.size(); i++) {
+    if (instances[i].primitive != m_scene.primitives[i]
+        || instances[i].material != m_scene.materialTable[m_scene.materials[i]]) {
+      return false;
+    }
+  }
+
+  std::vector<BoundingBox> bounds;
+  bounds.reserve(instances.size());
+  for (unsigned int i = 0; i < instances.size(); i++) {
+    m_scene.trans[i] = instances[i].trans;
+    m_scene.invtrans[i] = instances[i].invtrans;
+    m_scene.normaltrans[i] = instances[i].normaltrans;
+    bounds.push_back(instances[i].primitive->getBounds().transform(instances[i].trans));
+  }
+  m_bvh.refit(bounds);
+  return true;
+}
+
+namespace {
+
+// Each of these calls the primitive's own method for the kinds we know,
+// without going through the vtable; the compiler can inline them where
+// the definitions are visible.
+inline bool intersect_primitive(unsigned char kind, const Primitive* primitive, const Ray& ray, HitRecord& hit, RayTraceStats& stats) {
+  switch (kind) {
+  case SPHERE_PRIMITIVE:
+    return static_cast<const NonhierSphere*>(primitive)->NonhierSphere::intersect(ray, hit, stats);
+  case BOX_PRIMITIVE:
+    return static_cast<const NonhierBox*>(primitive)->NonhierBox::intersect(ray, hit, stats);
+  case CYLINDER_PRIMITIVE:
+    return static_cast<const Cylinder*>(primitive)->Cylinder::intersect(ray, hit, stats);
+  case CONE_PRIMITIVE:
+    return static_cast<const Cone*>(primitive)->Cone::intersect(ray, hit, stats);
+  case DISC_PRIMITIVE:
+    return static_cast<const Disc*>(primitive)->Disc::intersect(ray, hit, stats);
+  case TORUS_PRIMITIVE:
+    return static_cast<const Torus*>(primitive)->Torus::intersect(ray, hit, stats);
+  case MESH_PRIMITIVE:
+    return static_cast<const Mesh*>(primitive)->Mesh::intersect(ray, hit, stats);
+  default:
+    return primitive->intersect(ray, hit, stats);
+  }
+}
+
+inline bool occludes_primitive(unsigned char kind, const Primitive* primitive, const Ray& ray, double tMin, double tMax, RayTraceStats& stats) {
+  if (kind == MESH_PRIMITIVE) {
+    return static_cast<const Mesh*>(primitive)->Mesh::occludes(ray, tMin, tMax, stats);
+  } else if (kind == GENERIC_PRIMITIVE) {
+    return primitive->occludes(ray, tMin, tMax, stats);
+  }
+  // The rest answer any-hit queries with their closest-hit test.
+  HitRecord hit(tMin, tMax);
+  return intersect_primitive(kind, primitive, ray, hit, stats);
+}
+
+inline int intersect_primitive(unsigned char kind, const Primitive* primitive, const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) {
+  switch (kind) {
+  case SPHERE_PRIMITIVE:
+    return static_cast<const NonhierSphere*>(primitive)->NonhierSphere::intersectPacket(packet, hits, stats);
+  case BOX_PRIMITIVE:
+    return static_cast<const NonhierBox*>(primitive)->NonhierBox::intersectPacket(packet, hits, stats);
+  case CYLINDER_PRIMITIVE:
+    return static_cast<const Cylinder*>(primitive)->Cylinder::intersectPacket(packet, hits, stats);
+  case CONE_PRIMITIVE:
+    return static_cast<const Cone*>(primitive)->Cone::intersectPacket(packet, hits, stats);
+  case DISC_PRIMITIVE:
+    return static_cast<const Disc*>(primitive)->Disc::intersectPacket(packet, hits, stats);
+  case TORUS_PRIMITIVE:
+    return static_cast<const Torus*>(primitive)->Torus::intersectPacket(packet, hits, stats);
+  case MESH_PRIMITIVE:
+    return static_cast<const Mesh*>(primitive)->Mesh::intersectPacket(packet, hits, stats);
+  default:
+    return primitive->intersectPacket(packet, hits, stats);
+  }
+}
+
+inline int occludes_primitive(unsigned char kind, const Primitive* primitive, const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) {
+  switch (kind) {
+  case SPHERE_PRIMITIVE:
+    return static_cast<const NonhierSphere*>(primitive)->NonhierSphere::occludesPacket(packet, tMin, tMax, stats);
+  case BOX_PRIMITIVE:
+    return static_cast<const NonhierBox*>(primitive)->NonhierBox::occludesPacket(packet, tMin, tMax, stats);
+  case CYLINDER_PRIMITIVE:
+    return static_cast<const Cylinder*>(primitive)->Cylinder::occludesPacket(packet, tMin, tMax, stats);
+  case CONE_PRIMITIVE:
+    return static_cast<const Cone*>(primitive)->Cone::occludesPacket(packet, tMin, tMax, stats);
+  case DISC_PRIMITIVE:
+    return static_cast<const Disc*>(primitive)->Disc::occludesPacket(packet, tMin, tMax, stats);
+  case TORUS_PRIMITIVE:
+    return static_cast<const Torus*>(primitive)->Torus::occludesPacket(packet, tMin, tMax, stats);
+  case MESH_PRIMITIVE:
+    return static_cast<const Mesh*>(primitive)->Mesh::occludesPacket(packet, tMin, tMax, stats);
+  default:
+    return primitive->occludesPacket(packet, tMin, tMax, stats);
+  }
+}
+
+// Tests each instance the traversal reaches in its own coordinate system and
+// moves any closer hit back out to world space.
+struct InstanceIntersector {
+  InstanceIntersector(const Ray& ray, const FlatScene& scene, HitRecord& hit, RayTraceStats& stats)
+    : ray(ray), scene(scene), hit(hit), stats(stats), found(false) {}
+
+  bool operator()(int index) {
+    if (intersect_primitive(scene.kinds[index], scene.primitives[index], ray.transform(scene.invtrans[index]), hit, stats)) {
+      hit.material = scene.materialTable[scene.materials[index]];
+      hit.object = index;
+      hit.transform(scene.trans[index], scene.normaltrans[index]);
+      found = true;
+    }
+    return false;
+  }
+
+  const Ray& ray;
+  const FlatScene& scene;
+  HitRecord& hit;
+  RayTraceStats& stats;
+  bool found;
+};
+
+// Stops the traversal at the first instance that blocks the ray.
+struct InstanceOccluder {
+  InstanceOccluder(const Ray& ray, const FlatScene& scene, double tMin, double tMax, RayTraceStats& stats)
+    : ray(ray), scene(scene), tMin(tMin), tMax(tMax), stats(stats), found(false), occluder(-1) {}
+
+  bool operator()(int index) {
+    found = occludes_primitive(scene.kinds[index], scene.primitives[index], ray.transform(scene.invtrans[index]), tMin, tMax, stats);
+    if (found) {
+      occluder = index;
+    }
+    return found;
+  }
+
+  const Ray& ray;
+  const FlatScene& scene;
+  double tMin;
+  double tMax;
+  RayTraceStats& stats;
+  bool found;
+  int occluder;
+};
+
+// Packet version of InstanceIntersector: the lanes that reach an instance
+// are moved into its coordinate system together.
+struct InstancePacketIntersector {
+  InstancePacketIntersector(const RayPacket& packet, const FlatScene& scene, HitRecord* hits, RayTraceStats& stats)
+    : packet(packet), scene(scene), hits(hits), stats(stats), found(0) {}
+
+  __m128 limits() const {
+    return packet_limits(hits);
+  }
+
+  bool operator()(int index, int mask) {
+    int hitMask = intersect_primitive(scene.kinds[index], scene.primitives[index],
+                                      packet.transform(scene.invtrans[index], mask), hits, stats);
+    for (int i = 0; i < PACKET_SIZE; i++) {
+      if (hitMask & (1 << i)) {
+        hits[i].material = scene.materialTable[scene.materials[index]];
+        hits[i].object = index;
+        hits[i].transform(scene.trans[index], scene.normaltrans[index]);
+      }
+    }
+    found |= hitMask;
+    return false;
+  }
+
+  const RayPacket& packet;
+  const FlatScene& scene;
+  HitRecord* hits;
+  RayTraceStats& stats;
+  int found;
+};
+
+// Packet version of InstanceOccluder: blocked lanes drop out, and traversal
+// stops once every lane is blocked.
+struct InstancePacketOccluder {
+  InstancePacketOccluder(const RayPacket& packet, const FlatScene& scene, double tMin, const double* tMax, RayTraceStats& stats)
+    : packet(packet), scene(scene), tMin(tMin), tMax(tMax), stats(stats), blocked(0), occluder(-1),
+      m_limits(packet_limits(tMax, packet.mask)) {}
+
+  __m128 limits() const {
+    return m_limits;
+  }
+
+  bool operator()(int index, int mask) {
+    mask &= ~blocked;
+    if (mask == 0) {
+      return false;
+    }
+    int blockedMask = occludes_primitive(scene.kinds[index], scene.primitives[index],
+                                         packet.transform(scene.invtrans[index], mask), tMin, tMax, stats);
+    if (blockedMask != 0) {
+      blocked |= blockedMask;
+      occluder = index;
+      m_limits = packet_limits(tMax, packet.mask & ~blocked);
+    }
+    return blocked == packet.mask;
+  }
+
+  const RayPacket& packet;
+  const FlatScene& scene;
+  double tMin;
+  const double* tMax;
+  RayTraceStats& stats;
+  int blocked;
+  // The last instance that blocked any lane.
+  int occluder;
+  __m128 m_limits;
+};
+
+}
+
+bool SceneBVH::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const {
+  InstanceIntersector intersector(ray, m_scene, hit, stats);
+  m_bvh.traverse(ray, hit.tMax, intersector, stats);
+  return intersector.found;
+}
+
+bool SceneBVH::occluded(const Ray& ray, double tMin, double tMax, RayTraceStats& stats, int* occluder) const {
+  InstanceOccluder visitor(ray, m_scene, tMin, tMax, stats);
+  m_bvh.traverse(ray, tMax, visitor, stats);
+  if (occluder != NULL) {
+    *occluder = visitor.occluder;
+  }
+  return visitor.found;
+}
+
+bool SceneBVH::occludedBy(int instance, const Ray& ray, double tMin, double tMax, RayTraceStats& stats) const {
+  return occludes_primitive(m_scene.kinds[instance], m_scene.primitives[instance],
+                            ray.transform(m_scene.invtrans[instance]), tMin, tMax, stats);
+}
+
+int SceneBVH::intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const {
+  InstancePacketIntersector intersector(packet, m_scene, hits, stats);
+  m_bvh.traverse(packet, intersector, stats);
+  return intersector.found;
+}
+
+int SceneBVH::occludedPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats,
+                             int* occluder) const {
+  InstancePacketOccluder visitor(packet, m_scene, tMin, tMax, stats);
+  m_bvh.traverse(packet, visitor, stats);
+  if (occluder != NULL) {
+    *occluder = visitor.occluder;
+  }
+  return visitor.blocked;
+}
+
+int SceneBVH::occludedByPacket(int instance, const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const {
+  return occludes_primitive(m_scene.kinds[instance], m_scene.primitives[instance],
+                            packet.transform(m_scene.invtrans[instance], packet.mask), tMin, tMax, stats);
+}
+
+namespace {
+
+// Brightness of a light, for weighing lights against each other.
+double light_power(const Light* light) {
+  return light->colour.R() + light->colour.G() + light->colour.B();
+}
+
+// What a light with these falloff coefficients is divided by at distance.
+double attenuation(double constant, double linear, double quadratic, double distance) {
+  return std::max(1e-9, constant + linear * distance + quadratic * distance * distance);
+}
+
+}
+
+LightBVH::LightBVH(const std::list<Light*>& lights)
+  : m_lights(lights.begin(), lights.end()) {
+  std::vector<BoundingBox> bounds(m_lights.size());
+  for (unsigned int i = 0; i < m_lights.size(); i++) {
+    bounds[i].expand(m_lights[i]->position);
+  }
+  m_bvh.build(bounds, 1);
+
+  // Children come after their parents, so going backwards sums them first.
+  const std::vector<BVH::Node>& nodes = m_bvh.nodes();
+  m_power.resize(nodes.size());
+  for (int c = 0; c < 3; c++) {
+    m_falloff[c].resize(nodes.size());
+  }
+  for (int i = (int) nodes.size() - 1; i >= 0; i--) {
+    const BVH::Node& node = nodes[i];
+    if (node.isLeaf()) {
+      m_power[i] = 0.0;
+      for (int c = 0; c < 3; c++) {
+        m_falloff[c][i] = std::numeric_limits<double>::max();
+      }
+      for (int j = node.offset; j < node.offset + node.count; j++) {
+        const Light* light = m_lights[m_bvh.indices()[j]];
+        m_power[i] += light_power(light);
+        for (int c = 0; c < 3; c++) {
+          m_falloff[c][i] = std::min(m_falloff[c][i], light->falloff[c]);
+        }
+      }
+    } else {
+      m_power[i] = m_power[i + 1] + m_power[node.offset];
+      for (int c = 0; c < 3; c++) {
+        m_falloff[c][i] = std::min(m_falloff[c][i + 1], m_falloff[c][node.offset]);
+      }
+    }
+  }
+}
+
+double LightBVH::nodeRating(int i, const Point3D& point) const {
+  const BoundingBox& box = m_bvh.nodes()[i].bounds;
+  double distanceSquared = 0.0;
+  for (int axis = X; axis <= Z; axis++) {
+    double outside = std::max<double>(0.0, std::max(box.min[axis] - point[axis], point[axis] - box.max[axis]));
+    distanceSquared += outside * outside;
+  }
+  return m_power[i] / attenuation(m_falloff[0][i], m_falloff[1][i], m_falloff[2][i], std::sqrt(distanceSquared));
+}
+
+double LightBVH::lightRating(int i, const Point3D& point) const {
+  const Light* light = m_lights[i];
+  return light_power(light) / attenuation(light->falloff[0], light->falloff[1], light->falloff[2],
+                                          (light->position - point).length());
+}
+
+int LightBVH::sample(const Point3D& point, double u, double& pdf) const {
+  const std::vector<BVH::Node>& nodes = m_bvh.nodes();
+  pdf = 1.0;
+  if (nodes.empty()) {
+    return -1;
+  }
+  // u is rescaled after each choice, so that it stays uniform for the next.
+  int i = 0;
+  while (!nodes[i].isLeaf()) {
+    const double left = nodeRating(i + 1, point), right = nodeRating(nodes[i].offset, point);
+    if (left + right <= 0.0) {
+      return -1;
+    }
+    const double pLeft = left / (left + right);
+    if (u < pLeft) {
+      u /= pLeft;
+      pdf *= pLeft;
+      i = i + 1;
+    } else {
+      u = std::min((u - pLeft) / (1.0 - pLeft), 1.0);
+      pdf *= 1.0 - pLeft;
+      i = nodes[i].offset;
+    }
+  }
+
+  // Leaves only hold more than one light where the tree got too deep.
+  const BVH::Node& leaf = nodes[i];
+  double total = 0.0;
+  for (int j = leaf.offset; j < leaf.offset + leaf.count; j++) {
+    total += lightRating(m_bvh.indices()[j], point);
+  }
+  int chosen = -1;
+  double chosenRating = 0.0, below = 0.0;
+  for (int j = leaf.offset; j < leaf.offset + leaf.count && (chosen < 0 || u * total >= below); j++) {
+    const double rating = lightRating(m_bvh.indices()[j], point);
+    if (rating > 0.0) {
+      chosen = m_bvh.indices()[j];
+      chosenRating = rating;
+      below += rating;
+    }
+  }
+  if (chosen >= 0) {
+    pdf *= chosenRating / total;
+  }
+  return chosen;
+}
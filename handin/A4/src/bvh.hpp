@@ -0,0 +1,355 @@
+#ifndef CS488_BVH_HPP
+#define CS488_BVH_HPP
+
+#include <vector>
+#include "algebra.hpp"
+#include "raytracer.hpp"
+#include "packet.hpp"
+#include "scene.hpp"
+
+#ifndef BVH_MAX_LEAF_SIZE
+#define BVH_MAX_LEAF_SIZE 4
+#endif
+
+// Nodes over at least this many items build their two subtrees on separate
+// threads, when build is given more than one.
+#ifndef BVH_PARALLEL_MIN_ITEMS
+#define BVH_PARALLEL_MIN_ITEMS 4096
+#endif
+
+// Bounding volume hierarchy over a list of boxes, split with the surface
+// area heuristic and flattened into a single array in depth-first order.
+// An interior node's left child directly follows it and its right child is
+// at `offset`; a leaf covers `count` entries of indices() starting at
+// `offset`. Small nodes are split by sweeping every candidate position;
+// larger ones (e.g. the triangles of a mesh) bin centroids along each axis.
+class BVH {
+public:
+  struct Node {
+    BoundingBox bounds;
+    int offset;
+    int count;
+
+    bool isLeaf() const {
+      return count > 0;
+    }
+  };
+
+  // Builds the tree using up to `threads` threads. The tree is the same
+  // whatever the number of threads.
+  void build(const std::vector<BoundingBox>& bounds, int maxLeafSize=BVH_MAX_LEAF_SIZE, int threads=1);
+  // Recomputes every node's box from new bounds for the same items,
+  // keeping the shape of the tree. Much cheaper than building again, though
+  // the tree gets slower to traverse the further items move.
+  void refit(const std::vector<BoundingBox>& bounds);
+  // Takes the nodes and indices of a tree built earlier, as saved from
+  // nodes() and indices().
+  void restore(const std::vector<Node>& nodes, const std::vector<int>& indices, int maxLeafSize);
+
+  const std::vector<Node>& nodes() const { return m_nodes; }
+  const std::vector<int>& indices() const { return m_indices; }
+
+  // Calls visitor(index) for every item in a leaf whose box the ray enters
+  // before tMax, visiting nearer boxes first. tMax is re-read as traversal
+  // goes, so a visitor that shrinks it (e.g. HitRecord::tMax) prunes
+  // everything behind the closest hit found so far. Traversal stops early
+  // as soon as the visitor returns true.
+  template<typename Visitor>
+  void traverse(const Ray& ray, const double& tMax, Visitor& visitor, RayTraceStats& stats) const;
+
+  // Packet version of the above: calls visitor(index, mask) for every item
+  // in a leaf that any lane of the packet reaches, with the mask of lanes
+  // that reached it. visitor.limits() gives each lane's current tMax.
+  template<typename Visitor>
+  void traverse(const RayPacket& packet, Visitor& visitor, RayTraceStats& stats) const;
+
+  struct CentroidComparator {
+    CentroidComparator(Axis axis, const std::vector<Point3D>& centroids): axis(axis), centroids(centroids) {}
+
+    bool operator()(int a, int b) const {
+      return centroids[a][axis] < centroids[b][axis];
+    }
+
+    Axis axis;
+    const std::vector<Point3D>& centroids;
+  };
+
+private:
+  // Appends the subtree over m_indices[start, end) to nodes, with offsets
+  // of interior nodes relative to the start of nodes.
+  void buildNode(const std::vector<BoundingBox>& bounds, const std::vector<Point3D>& centroids,
+                 int start, int end, int depth, int threads, std::vector<Node>& nodes);
+
+  // A subtree built on a thread of its own.
+  struct SubtreeBuild;
+  static void* build_subtree(void* arg);
+
+  // Each finds the cheapest split of m_indices[start, end), leaves the range
+  // partitioned around it and returns its cost; `split` is the index of the
+  // first item on the right.
+  double sweepSplit(const std::vector<BoundingBox>& bounds, const std::vector<Point3D>& centroids,
+                    int start, int end, double nodeArea, int& split);
+  double binnedSplit(const std::vector<BoundingBox>& bounds, const std::vector<Point3D>& centroids,
+                     int start, int end, double nodeArea, int& split);
+
+  int m_maxLeafSize;
+  std::vector<Node> m_nodes;
+  std::vector<PacketBox> m_packetBounds;
+  std::vector<int> m_indices;
+};
+
+// Deep enough for any tree the builder produces; see BVH_MAX_DEPTH in bvh.cpp.
+#define BVH_STACK_SIZE 64
+
+template<typename Visitor>
+void BVH::traverse(const Ray& ray, const double& tMax, Visitor& visitor, RayTraceStats& stats) const {
+  if (m_nodes.empty()) {
+    return;
+  }
+  const Vector3D invDir = reciprocal(ray.dir);
+  double tNear, tFar;
+  stats.bounding_box_checks++;
+  if (!m_nodes[0].bounds.intersect(ray, invDir, tNear, tFar) || tNear >= tMax) {
+    return;
+  }
+  stats.bounding_box_hits++;
+
+  struct Entry {
+    int node;
+    double tNear;
+  } stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  stack[stackSize].node = 0;
+  stack[stackSize++].tNear = tNear;
+
+  while (stackSize > 0) {
+    const Entry entry = stack[--stackSize];
+    if (entry.tNear >= tMax) {
+      continue;
+    }
+    const Node& node = m_nodes[entry.node];
+
+    if (node.isLeaf()) {
+      for (int i = node.offset; i < node.offset + node.count; i++) {
+        if (visitor(m_indices[i])) {
+          return;
+        }
+      }
+      continue;
+    }
+
+    const int left = entry.node + 1;
+    const int right = node.offset;
+    double tLeft, tRight;
+    stats.bounding_box_checks += 2;
+    bool hitLeft = m_nodes[left].bounds.intersect(ray, invDir, tLeft, tFar) && tLeft < tMax;
+    bool hitRight = m_nodes[right].bounds.intersect(ray, invDir, tRight, tFar) && tRight < tMax;
+    stats.bounding_box_hits += hitLeft + hitRight;
+
+    // Push the farther child first so the nearer one is visited first.
+    if (hitLeft && hitRight && tRight < tLeft) {
+      stack[stackSize].node = left;
+      stack[stackSize++].tNear = tLeft;
+      hitLeft = false;
+    }
+    if (hitRight) {
+      stack[stackSize].node = right;
+      stack[stackSize++].tNear = tRight;
+    }
+    if (hitLeft) {
+      stack[stackSize].node = left;
+      stack[stackSize++].tNear = tLeft;
+    }
+  }
+}
+
+template<typename Visitor>
+void BVH::traverse(const RayPacket& packet, Visitor& visitor, RayTraceStats& stats) const {
+  if (m_nodes.empty() || packet.mask == 0) {
+    return;
+  }
+  __m128 tNear;
+  stats.bounding_box_checks += lane_count(packet.mask);
+  int mask = intersect(m_packetBounds[0], packet, packet.mask, visitor.limits(), tNear);
+  if (mask == 0) {
+    return;
+  }
+  stats.bounding_box_hits += lane_count(mask);
+
+  struct Entry {
+    __m128 tNear;
+    int node;
+    int mask;
+  } stack[BVH_STACK_SIZE];
+  int stackSize = 0;
+  stack[stackSize].node = 0;
+  stack[stackSize].mask = mask;
+  stack[stackSize++].tNear = tNear;
+
+  while (stackSize > 0) {
+    const Entry entry = stack[--stackSize];
+    const int node = entry.node;
+    // Drop lanes that have since found something closer than this box.
+    mask = entry.mask & _mm_movemask_ps(_mm_cmplt_ps(entry.tNear, visitor.limits()));
+    if (mask == 0) {
+      continue;
+    }
+
+    if (m_nodes[node].isLeaf()) {
+      for (int i = m_nodes[node].offset; i < m_nodes[node].offset + m_nodes[node].count; i++) {
+        if (visitor(m_indices[i], mask)) {
+          return;
+        }
+      }
+      continue;
+    }
+
+    const int left = node + 1;
+    const int right = m_nodes[node].offset;
+    const __m128 tMax = visitor.limits();
+    __m128 tLeft, tRight;
+    stats.bounding_box_checks += 2 * lane_count(mask);
+    int leftMask = intersect(m_packetBounds[left], packet, mask, tMax, tLeft);
+    int rightMask = intersect(m_packetBounds[right], packet, mask, tMax, tRight);
+    stats.bounding_box_hits += lane_count(leftMask) + lane_count(rightMask);
+
+    // Push the farther child first, judged by the first lane that hits both.
+    bool leftFirst = true;
+    if (leftMask & rightMask) {
+      float lefts[PACKET_SIZE], rights[PACKET_SIZE];
+      _mm_storeu_ps(lefts, tLeft);
+      _mm_storeu_ps(rights, tRight);
+      const int lane = __builtin_ctz(leftMask & rightMask);
+      leftFirst = lefts[lane] <= rights[lane];
+    }
+    if (leftFirst && rightMask) {
+      stack[stackSize].node = right;
+      stack[stackSize].mask = rightMask;
+      stack[stackSize++].tNear = tRight;
+    }
+    if (leftMask) {
+      stack[stackSize].node = left;
+      stack[stackSize].mask = leftMask;
+      stack[stackSize++].tNear = tLeft;
+    }
+    if (!leftFirst && rightMask) {
+      stack[stackSize].node = right;
+      stack[stackSize].mask = rightMask;
+      stack[stackSize++].tNear = tRight;
+    }
+  }
+}
+
+// The concrete primitive classes, which the scene's instance loop calls
+// directly instead of through the vtable. Anything else is GENERIC.
+enum PrimitiveKind {
+  GENERIC_PRIMITIVE,
+  SPHERE_PRIMITIVE,
+  BOX_PRIMITIVE,
+  CYLINDER_PRIMITIVE,
+  CONE_PRIMITIVE,
+  DISC_PRIMITIVE,
+  TORUS_PRIMITIVE,
+  MESH_PRIMITIVE
+};
+
+PrimitiveKind primitive_kind(const Primitive* primitive);
+
+// A scene's instances lowered into parallel arrays. The first three are
+// read for every instance a ray reaches; the rest only once it hits.
+struct FlatScene {
+  std::vector<Matrix4x4> invtrans;
+  std::vector<unsigned char> kinds; // PrimitiveKind of each primitive.
+  std::vector<const Primitive*> primitives;
+  std::vector<int> materials; // Indices into materialTable.
+  std::vector<Material*> materialTable;
+  std::vector<Matrix4x4> trans;
+  std::vector<Matrix4x4> normaltrans;
+
+  void add(const Instance& instance);
+
+  int size() const {
+    return primitives.size();
+  }
+};
+
+// Top-level acceleration structure used for rendering. The scene graph is
+// compiled once into a FlatScene of world-space instances, and rays
+// traverse a BVH over them instead of walking every node's children.
+class SceneBVH {
+public:
+  // The BVH over the instances is built with up to `threads` threads.
+  SceneBVH(SceneNode* root, int threads=1);
+
+  // Moves each instance to where root's transforms now put it and refits
+  // the BVH around them. Returns false, changing nothing, if root no longer
+  // flattens into the same primitives and materials (e.g. a child was
+  // added), in which case the scene has to be built again.
+  bool refit(SceneNode* root);
+
+  // Closest-hit query in world space.
+  bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const;
+
+  // Any-hit query in world space: true as soon as anything is found
+  // strictly inside (tMin, tMax). If occluder is given, it is set to the
+  // instance found.
+  bool occluded(const Ray& ray, double tMin, double tMax, RayTraceStats& stats, int* occluder=NULL) const;
+  // The same, against instance alone.
+  bool occludedBy(int instance, const Ray& ray, double tMin, double tMax, RayTraceStats& stats) const;
+
+  // Packet versions of the above. Each lane of packet.mask is handled
+  // exactly as the single-ray query would (hits[i] and tMax[i] belong to
+  // lane i); the return value is the mask of lanes that hit or were
+  // blocked.
+  int intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const;
+  int occludedPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats,
+                     int* occluder=NULL) const;
+  int occludedByPacket(int instance, const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const;
+
+  // Object to world transform of instance i.
+  const Matrix4x4& transform(int i) const { return m_scene.trans[i]; }
+  const Primitive* primitive(int i) const { return m_scene.primitives[i]; }
+  PrimitiveKind kind(int i) const { return (PrimitiveKind) m_scene.kinds[i]; }
+  const Material* material(int i) const { return m_scene.materialTable[m_scene.materials[i]]; }
+  int numInstances() const { return m_scene.size(); }
+  int numNodes() const { return m_bvh.nodes().size(); }
+
+private:
+  FlatScene m_scene;
+  BVH m_bvh;
+};
+
+// The point lights of a scene in a BVH, with the total brightness of the
+// lights under each node, for picking a light at random in proportion to
+// an estimate of how brightly it lights a point. Each node is rated by its
+// brightness, attenuated by the least falloff among its lights at the
+// distance from the point to its box; the walk from the root takes each
+// child with probability in proportion to its rating. Nothing about the
+// surface is taken into account, since Phong highlights can come from
+// lights behind it.
+class LightBVH {
+public:
+  explicit LightBVH(const std::list<Light*>& lights);
+
+  // Picks a light for point, given u uniform in [0, 1). Returns its place
+  // in the list of lights, and the probability it was picked with through
+  // pdf, or -1 if none of the lights gives any light.
+  int sample(const Point3D& point, double u, double& pdf) const;
+
+  const Light* light(int index) const { return m_lights[index]; }
+
+private:
+  // Brightness of the lights under node i, or of light i, as seen from
+  // point.
+  double nodeRating(int i, const Point3D& point) const;
+  double lightRating(int i, const Point3D& point) const;
+
+  std::vector<Light*> m_lights;
+  BVH m_bvh;
+  // For each node: the total brightness of its lights, and the least of
+  // each falloff coefficient among them.
+  std::vector<double> m_power;
+  std::vector<double> m_falloff[3];
+};
+
+#endif
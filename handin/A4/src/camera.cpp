@@ -0,0 +1,21 @@
+#include "camera.hpp"
+#include <cmath>
+
+Camera::Camera(const ViewParams& view, int width, int height)
+  : m_eye(view.eye), m_width(width), m_height(height) {
+  // The image plane sits d in front of the eye.
+  double d = 50.0; // TODO - Is this derived from something?
+  double virtualH = 2.0 * d * tan(view.fov / 2.0);
+  double virtualW = ((double)width) / height * virtualH;
+
+  Vector3D w = view.view;
+  Vector3D u = w.cross(view.up);
+  u.normalize();
+  w.normalize();
+  Vector3D v = u.cross(w);
+
+  m_dx = (virtualW/width) * u;
+  m_dy = (-virtualH/height) * v;
+  // Pixel (width/2, height/2) is straight ahead.
+  m_corner = (-width/2) * m_dx + (-height/2) * m_dy + d * w;
+}
@@ -0,0 +1,32 @@
+#ifndef CS488_CAMERA_HPP
+#define CS488_CAMERA_HPP
+
+#include "algebra.hpp"
+#include "raytracer.hpp"
+
+// Pinhole camera for one render. The view basis and pixel spacing are
+// worked out once, so each ray direction is just a couple of multiply-adds
+// from the direction through pixel (0, 0).
+class Camera {
+public:
+  Camera(const ViewParams& view, int width, int height);
+
+  // Ray from the eye through pixel (x, y), with a normalized direction.
+  Ray ray(double x, double y) const {
+    Vector3D dir = m_corner + x*m_dx + y*m_dy;
+    dir.normalize();
+    return Ray(m_eye, dir);
+  }
+
+  int width() const { return m_width; }
+  int height() const { return m_height; }
+
+private:
+  Point3D m_eye;
+  Vector3D m_corner; // Eye to pixel (0, 0).
+  Vector3D m_dx;     // One pixel right.
+  Vector3D m_dy;     // One pixel down.
+  int m_width, m_height;
+};
+
+#endif
@@ -0,0 +1,136 @@
+#include "checkpoint.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "raytracer.hpp"
+
+#define CHECKPOINT_MAGIC "A4CKPT01"
+
+RenderBuffers::RenderBuffers(int width, int height, int y0)
+  : pass(PRIMARY_PASS), y0(y0), image(width, height, 3),
+    objects(width * height, -1), samples(width * height, 0), edges(width * height, 0) {
+  std::fill(image.data(), image.data() + width * height * 3, (Scalar) 0.0);
+}
+
+Checkpointer::Checkpointer(const std::string& imageFilename, unsigned long long key, RenderBuffers& buffers)
+  : m_imageFilename(imageFilename), m_checkpointFilename(imageFilename + ".checkpoint"),
+    m_key(key), m_buffers(buffers), m_nextSave(seconds_now() + CHECKPOINT_INTERVAL) {
+  // Prefer the saving thread, or tiles starting back to back could keep it
+  // waiting forever.
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&m_tileLock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  pthread_mutex_init(&m_saveMutex, NULL);
+}
+
+Checkpointer::~Checkpointer() {
+  pthread_rwlock_destroy(&m_tileLock);
+  pthread_mutex_destroy(&m_saveMutex);
+}
+
+namespace {
+
+struct CheckpointHeader {
+  char magic[8];
+  unsigned long long key;
+  int width;
+  int height;
+  int pass;
+};
+
+}
+
+bool Checkpointer::resume() {
+  std::ifstream in(m_checkpointFilename.c_str(), std::ios::binary);
+  if (!in) {
+    return false;
+  }
+
+  const int width = m_buffers.image.width(), height = m_buffers.image.height();
+  CheckpointHeader header;
+  in.read((char*) &header, sizeof(header));
+  if (!in || std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+    std::cerr << "Ignoring unreadable checkpoint " << m_checkpointFilename << std::endl;
+    return false;
+  }
+  if (header.key != m_key || header.width != width || header.height != height) {
+    std::cout << "Ignoring checkpoint " << m_checkpointFilename << " from a different render." << std::endl;
+    return false;
+  }
+
+  RenderBuffers loaded(width, height);
+  loaded.pass = (RenderPass) header.pass;
+  in.read((char*) loaded.image.data(), sizeof(Scalar) * width * height * 3);
+  in.read((char*) &loaded.objects[0], sizeof(int) * width * height);
+  in.read((char*) &loaded.samples[0], sizeof(int) * width * height);
+  in.read((char*) &loaded.edges[0], width * height);
+  if (!in) {
+    std::cerr << "Ignoring truncated checkpoint " << m_checkpointFilename << std::endl;
+    return false;
+  }
+
+  m_buffers = loaded;
+  std::cout << "Resuming from " << m_checkpointFilename << std::endl;
+  return true;
+}
+
+void Checkpointer::beginTile() {
+  pthread_rwlock_rdlock(&m_tileLock);
+}
+
+void Checkpointer::endTile() {
+  pthread_rwlock_unlock(&m_tileLock);
+}
+
+void Checkpointer::poll() {
+  if (seconds_now() < m_nextSave || pthread_mutex_trylock(&m_saveMutex) != 0) {
+    return;
+  }
+  if (seconds_now() >= m_nextSave) {
+    save();
+  }
+  pthread_mutex_unlock(&m_saveMutex);
+}
+
+void Checkpointer::save() {
+  // Copy under the lock so the render only stalls for a memcpy, not the
+  // disk.
+  pthread_rwlock_wrlock(&m_tileLock);
+  RenderBuffers snapshot = m_buffers;
+  pthread_rwlock_unlock(&m_tileLock);
+
+  const int width = snapshot.image.width(), height = snapshot.image.height();
+  snapshot.image.savePng(m_imageFilename);
+
+  // Write to a temporary file first, so being killed mid-save leaves the
+  // previous checkpoint intact.
+  const std::string tmpFilename = m_checkpointFilename + ".tmp";
+  std::ofstream out(tmpFilename.c_str(), std::ios::binary | std::ios::trunc);
+  CheckpointHeader header;
+  std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.key = m_key;
+  header.width = width;
+  header.height = height;
+  header.pass = snapshot.pass;
+  out.write((const char*) &header, sizeof(header));
+  out.write((const char*) snapshot.image.data(), sizeof(Scalar) * width * height * 3);
+  out.write((const char*) &snapshot.objects[0], sizeof(int) * width * height);
+  out.write((const char*) &snapshot.samples[0], sizeof(int) * width * height);
+  out.write((const char*) &snapshot.edges[0], width * height);
+  out.close();
+  if (!out || std::rename(tmpFilename.c_str(), m_checkpointFilename.c_str()) != 0) {
+    std::cerr << "Could not write checkpoint " << m_checkpointFilename << std::endl;
+  } else {
+    std::cout << "Saved preview and checkpoint." << std::endl;
+  }
+
+  m_nextSave = seconds_now() + CHECKPOINT_INTERVAL;
+}
+
+void Checkpointer::finish() {
+  std::remove(m_checkpointFilename.c_str());
+}
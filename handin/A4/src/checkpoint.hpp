@@ -0,0 +1,76 @@
+#ifndef CS488_CHECKPOINT_HPP
+#define CS488_CHECKPOINT_HPP
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "image.hpp"
+
+// Seconds between preview images and checkpoints.
+#ifndef CHECKPOINT_INTERVAL
+#define CHECKPOINT_INTERVAL 30
+#endif
+
+// Every pixel gets one sample in the primary pass; the refine pass then
+// supersamples the ones mark_edges picked out.
+enum RenderPass {
+  PRIMARY_PASS,
+  REFINE_PASS
+};
+
+// Everything a render has worked out so far, for rows [y0, y0 + height)
+// of the image. Row y of the image is row y - y0 of each buffer.
+struct RenderBuffers {
+  RenderBuffers(int width, int height, int y0=0);
+
+  RenderPass pass;           // Pass the render has reached.
+  int y0;                    // First image row held; all of them unless streaming.
+  Image image;
+  std::vector<int> objects;  // Instance seen by each pixel's primary sample, -1 for none.
+  std::vector<int> samples;  // Samples taken for each pixel; 0 until the primary pass gets to it.
+  std::vector<char> edges;   // Pixels marked for supersampling.
+};
+
+// Periodically saves a preview of a render in progress over its output
+// image, along with a checkpoint file beside it holding the render's
+// buffers. A render that is killed picks up from its last checkpoint the
+// next time it is run, as long as the scene, camera and image size are
+// the same (as summed up by key).
+//
+// Render threads hold the lock shared while they work on a tile, and a
+// save takes it exclusively, so a checkpoint never catches a tile half
+// done.
+class Checkpointer {
+public:
+  Checkpointer(const std::string& imageFilename, unsigned long long key, RenderBuffers& buffers);
+  ~Checkpointer();
+
+  // Loads the checkpoint left by an earlier run of this render, if any.
+  bool resume();
+
+  // Render threads bracket each tile with these.
+  void beginTile();
+  void endTile();
+
+  // Saves if CHECKPOINT_INTERVAL seconds have passed since the last save.
+  // Call between tiles; if another thread is already saving, returns
+  // straight away.
+  void poll();
+
+  // Saves the preview and checkpoint now.
+  void save();
+
+  // Removes the checkpoint once the finished image has been saved.
+  void finish();
+
+private:
+  std::string m_imageFilename;
+  std::string m_checkpointFilename;
+  unsigned long long m_key;
+  RenderBuffers& m_buffers;
+  volatile double m_nextSave;
+  pthread_rwlock_t m_tileLock;
+  pthread_mutex_t m_saveMutex;
+};
+
+#endif
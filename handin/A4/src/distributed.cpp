@@ -0,0 +1,509 @@
+#include "distributed.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define DISTRIBUTED_MAGIC "A4DIST01"
+
+// How long a worker keeps trying to reach its coordinator.
+#define CONNECT_SECONDS 30
+// How long the coordinator waits for the rest of a message once it has
+// started arriving.
+#define MESSAGE_TIMEOUT_SECONDS 10
+// Tiles each worker holds at once, so it has the next one as soon as it
+// sends one back.
+#define TILES_IN_FLIGHT 2
+
+namespace {
+
+// Messages are sent as raw structs, so every process has to be the same
+// build, much like checkpoints.
+
+// Sent by a worker as soon as it connects.
+struct HelloMessage {
+  char magic[8];
+  unsigned long long key;
+};
+
+// Sent in place of a tile index once there are no more tiles, or to a
+// worker rendering something else.
+enum {
+  NO_MORE_TILES = -1,
+  WRONG_RENDER = -2
+};
+
+// A tile for a worker to render.
+struct TileMessage {
+  int index;
+  Tile tile;
+};
+
+// A rendered tile. Followed by the tile's colours, a row at a time, and
+// then the number of samples in each of its pixels.
+struct ResultHeader {
+  int index;
+  Tile tile;
+  RayTraceStats stats;
+  double seconds; // Wall-clock seconds the worker spent on it.
+};
+
+bool send_all(int fd, const void* data, size_t size) {
+  const char* bytes = (const char*) data;
+  while (size > 0) {
+    ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    bytes += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+bool recv_all(int fd, void* data, size_t size) {
+  char* bytes = (char*) data;
+  while (size > 0) {
+    ssize_t received = recv(fd, bytes, size, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return false;
+    }
+    bytes += received;
+    size -= received;
+  }
+  return true;
+}
+
+// Opens a stream socket on address, listening on it if listening is set
+// and connected to it otherwise. Returns -1 on failure.
+int open_socket(const std::string& address, bool listening) {
+  if (address.compare(0, 5, "unix:") == 0) {
+    const std::string path = address.substr(5);
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+      return -1;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    if (listening) {
+      // Left behind by an earlier coordinator that didn't finish.
+      unlink(path.c_str());
+    }
+    int result = listening ? bind(fd, (sockaddr*) &addr, sizeof(addr)) : connect(fd, (sockaddr*) &addr, sizeof(addr));
+    if (result < 0 || (listening && listen(fd, 16) < 0)) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  const std::string::size_type colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    return -1;
+  }
+  const std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  addrinfo* addrs;
+  if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (addrinfo* it = addrs; it != NULL && fd < 0; it = it->ai_next) {
+    fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (listening) {
+      int yes = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    }
+    int result = listening ? bind(fd, it->ai_addr, it->ai_addrlen) : connect(fd, it->ai_addr, it->ai_addrlen);
+    if (result < 0 || (listening && listen(fd, 16) < 0)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+// Tile messages are tiny, so don't let TCP hold them back. Does nothing to
+// Unix sockets.
+void send_immediately(int fd) {
+  int yes = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
+bool send_stop(int fd, int reason) {
+  TileMessage stop;
+  std::memset(&stop, 0, sizeof(stop));
+  stop.index = reason;
+  return send_all(fd, &stop, sizeof(stop));
+}
+
+struct WorkerConnection {
+  int id;
+  int fd;
+  std::deque<int> tiles; // Handed out and not yet sent back, oldest first.
+  double lastHeard;      // When it last sent a tile back, or was last idle.
+  bool lost;
+
+  WorkerConnection(int id, int fd): id(id), fd(fd), lastHeard(seconds_now()), lost(false) {}
+};
+
+// Hands out tiles and collects the results into one set of buffers.
+class TileCoordinator {
+public:
+  TileCoordinator(const WorkBundle& bundle, int listener, unsigned long long key, RenderBuffers& buffers);
+
+  // Runs until every tile is back.
+  void run(RayTraceStats& stats);
+
+  // Tells every worker still connected that the render is done.
+  void finish();
+
+private:
+  void acceptWorker();
+  void handOutTiles(WorkerConnection& worker);
+  bool receiveResult(WorkerConnection& worker, RayTraceStats& stats);
+  // Closes the connections marked lost and queues their tiles up again.
+  void dropLostWorkers();
+
+  const WorkBundle& m_bundle;
+  int m_listener;
+  unsigned long long m_key;
+  RenderBuffers& m_buffers;
+
+  std::vector<Tile> m_tiles;
+  std::vector<char> m_finished;
+  int m_numFinished;
+  std::deque<int> m_pending;
+  std::vector<WorkerConnection> m_workers;
+  int m_numConnected;
+};
+
+TileCoordinator::TileCoordinator(const WorkBundle& bundle, int listener, unsigned long long key, RenderBuffers& buffers)
+  : m_bundle(bundle), m_listener(listener), m_key(key), m_buffers(buffers), m_numFinished(0), m_numConnected(0) {
+  const int width = bundle.camera->width(), height = bundle.camera->height();
+  for (int y = 0; y < height; y += DISTRIBUTED_TILE_SIZE) {
+    for (int x = 0; x < width; x += DISTRIBUTED_TILE_SIZE) {
+      Tile tile;
+      tile.x0 = x;
+      tile.y0 = y;
+      tile.x1 = std::min(width, x + DISTRIBUTED_TILE_SIZE);
+      tile.y1 = std::min(height, y + DISTRIBUTED_TILE_SIZE);
+      m_pending.push_back(m_tiles.size());
+      m_tiles.push_back(tile);
+    }
+  }
+  m_finished.resize(m_tiles.size(), 0);
+}
+
+void TileCoordinator::run(RayTraceStats& stats) {
+  int nextProgress = 1;
+  while (m_numFinished < (int) m_tiles.size()) {
+    for (size_t i = 0; i < m_workers.size(); i++) {
+      handOutTiles(m_workers[i]);
+    }
+    dropLostWorkers();
+
+    std::vector<pollfd> fds(m_workers.size() + 1);
+    for (size_t i = 0; i < m_workers.size(); i++) {
+      fds[i].fd = m_workers[i].fd;
+      fds[i].events = POLLIN;
+    }
+    fds.back().fd = m_listener;
+    fds.back().events = POLLIN;
+    if (poll(&fds[0], fds.size(), 1000) < 0 && errno != EINTR) {
+      std::cerr << "poll failed: " << std::strerror(errno) << std::endl;
+      exit(1);
+    }
+
+    const double now = seconds_now();
+    for (size_t i = 0; i < m_workers.size(); i++) {
+      WorkerConnection& worker = m_workers[i];
+      if (fds[i].revents != 0 && !receiveResult(worker, stats)) {
+        std::cout << "Lost worker " << worker.id << "." << std::endl;
+        worker.lost = true;
+      } else if (!worker.tiles.empty() && now - worker.lastHeard > DISTRIBUTED_TILE_TIMEOUT) {
+        std::cout << "Giving up on worker " << worker.id << " after " << DISTRIBUTED_TILE_TIMEOUT
+          << "s without a tile." << std::endl;
+        worker.lost = true;
+      }
+    }
+    dropLostWorkers();
+    if (fds.back().revents & POLLIN) {
+      acceptWorker();
+    }
+
+    while (m_numFinished * 10 >= nextProgress * (int) m_tiles.size() && nextProgress <= 10) {
+      std::cout << nextProgress * 10 << "% (" << m_numFinished << "/" << m_tiles.size() << " tiles)" << std::endl;
+      nextProgress++;
+    }
+  }
+}
+
+void TileCoordinator::finish() {
+  for (size_t i = 0; i < m_workers.size(); i++) {
+    send_stop(m_workers[i].fd, NO_MORE_TILES);
+    close(m_workers[i].fd);
+  }
+  m_workers.clear();
+}
+
+void TileCoordinator::acceptWorker() {
+  int fd = accept(m_listener, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+  timeval timeout;
+  timeout.tv_sec = MESSAGE_TIMEOUT_SECONDS;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  send_immediately(fd);
+
+  HelloMessage hello;
+  if (!recv_all(fd, &hello, sizeof(hello)) || std::memcmp(hello.magic, DISTRIBUTED_MAGIC, sizeof(hello.magic)) != 0) {
+    std::cerr << "Ignoring a connection that isn't an rt worker." << std::endl;
+    close(fd);
+    return;
+  }
+  if (hello.key != m_key) {
+    std::cerr << "Turning away a worker rendering a different scene." << std::endl;
+    send_stop(fd, WRONG_RENDER);
+    close(fd);
+    return;
+  }
+  m_workers.push_back(WorkerConnection(++m_numConnected, fd));
+  std::cout << "Worker " << m_numConnected << " connected; " << m_workers.size() << " working." << std::endl;
+}
+
+void TileCoordinator::handOutTiles(WorkerConnection& worker) {
+  while (!worker.lost && worker.tiles.size() < TILES_IN_FLIGHT && !m_pending.empty()) {
+    const int index = m_pending.front();
+    if (m_finished[index]) {
+      m_pending.pop_front();
+      continue;
+    }
+    TileMessage message;
+    message.index = index;
+    message.tile = m_tiles[index];
+    if (!send_all(worker.fd, &message, sizeof(message))) {
+      std::cout << "Lost worker " << worker.id << "." << std::endl;
+      worker.lost = true;
+      return;
+    }
+    if (worker.tiles.empty()) {
+      worker.lastHeard = seconds_now();
+    }
+    worker.tiles.push_back(index);
+    m_pending.pop_front();
+  }
+}
+
+bool TileCoordinator::receiveResult(WorkerConnection& worker, RayTraceStats& stats) {
+  ResultHeader header;
+  if (!recv_all(worker.fd, &header, sizeof(header))) {
+    return false;
+  }
+  std::deque<int>::iterator held = std::find(worker.tiles.begin(), worker.tiles.end(), header.index);
+  if (held == worker.tiles.end()) {
+    std::cerr << "Worker " << worker.id << " sent back a tile it wasn't given." << std::endl;
+    return false;
+  }
+
+  const Tile& tile = m_tiles[header.index];
+  const int tileWidth = tile.x1 - tile.x0, tileHeight = tile.y1 - tile.y0;
+  std::vector<Scalar> colours(tileWidth * tileHeight * 3);
+  std::vector<int> samples(tileWidth * tileHeight);
+  if (!recv_all(worker.fd, &colours[0], sizeof(Scalar) * colours.size()) ||
+      !recv_all(worker.fd, &samples[0], sizeof(int) * samples.size())) {
+    return false;
+  }
+  worker.tiles.erase(held);
+  worker.lastHeard = seconds_now();
+
+  // Only a tile handed out again after its first worker was given up on
+  // can come back twice.
+  if (m_finished[header.index]) {
+    return true;
+  }
+  const int width = m_buffers.image.width();
+  for (int y = 0; y < tileHeight; y++) {
+    for (int x = 0; x < tileWidth; x++) {
+      for (int c = 0; c < 3; c++) {
+        m_buffers.image(tile.x0 + x, tile.y0 + y, c) = colours[(y * tileWidth + x) * 3 + c];
+      }
+      m_buffers.samples[(tile.y0 + y) * width + tile.x0 + x] = samples[y * tileWidth + x];
+    }
+  }
+  m_finished[header.index] = 1;
+  m_numFinished++;
+
+  // The workers' time all goes down as the first thread's.
+  stats.merge(header.stats);
+  if (RENDER_PROFILE) {
+    m_bundle.profile->addTile(0, tile, header.seconds);
+  }
+  m_bundle.profile->thread(0).stats.merge(header.stats);
+  return true;
+}
+
+void TileCoordinator::dropLostWorkers() {
+  for (size_t i = 0; i < m_workers.size();) {
+    WorkerConnection& worker = m_workers[i];
+    if (!worker.lost) {
+      i++;
+      continue;
+    }
+    close(worker.fd);
+    // Next in line, in the order they were first handed out.
+    for (std::deque<int>::reverse_iterator it = worker.tiles.rbegin(); it != worker.tiles.rend(); it++) {
+      m_pending.push_front(*it);
+    }
+    if (!worker.tiles.empty()) {
+      std::cout << "Handing out worker " << worker.id << "'s " << worker.tiles.size() << " tiles again." << std::endl;
+    }
+    m_workers.erase(m_workers.begin() + i);
+  }
+}
+
+}
+
+long render_distributed(WorkBundle bundle, const std::string& filename, const std::string& address,
+                        unsigned long long key, RayTraceStats& stats) {
+  const int width = bundle.camera->width(), height = bundle.camera->height();
+  int listener = open_socket(address, true);
+  if (listener < 0) {
+    std::cerr << "Can't listen for workers on " << address << ": " << std::strerror(errno) << std::endl;
+    exit(1);
+  }
+
+  RenderBuffers buffers(width, height);
+  TileCoordinator coordinator(bundle, listener, key, buffers);
+  std::cout << "Waiting for workers on " << address << " to render " << width * height << " pixels in "
+    << DISTRIBUTED_TILE_SIZE << "x" << DISTRIBUTED_TILE_SIZE << " tiles." << std::endl;
+
+  double renderStart = seconds_now();
+  coordinator.run(stats);
+  coordinator.finish();
+  close(listener);
+  if (address.compare(0, 5, "unix:") == 0) {
+    unlink(address.substr(5).c_str());
+  }
+  double outputStart = seconds_now();
+  // Workers do both passes of a tile together, so it all counts as one.
+  bundle.profile->primary_pass_seconds += outputStart - renderStart;
+
+  long totalSamples = 0;
+  for (std::vector<int>::const_iterator it = buffers.samples.begin(); it != buffers.samples.end(); it++) {
+    totalSamples += *it;
+  }
+
+  std::cout << "Done in " << outputStart - renderStart << "s! Saving image..." << std::endl;
+  save_image(buffers.image, filename);
+  bundle.profile->output_seconds += seconds_now() - outputStart;
+  std::cout << "Saved" << std::endl;
+
+  save_sample_density(buffers.samples, width, height, filename);
+  return totalSamples;
+}
+
+void run_worker(WorkBundle bundle, const std::string& address, unsigned long long key) {
+  const int width = bundle.camera->width(), height = bundle.camera->height();
+
+  // The coordinator may still be loading the scene.
+  int fd = open_socket(address, false);
+  for (double start = seconds_now(); fd < 0 && seconds_now() - start < CONNECT_SECONDS;) {
+    usleep(250000);
+    fd = open_socket(address, false);
+  }
+  if (fd < 0) {
+    std::cerr << "Can't reach a coordinator on " << address << "." << std::endl;
+    return;
+  }
+  send_immediately(fd);
+
+  HelloMessage hello;
+  std::memcpy(hello.magic, DISTRIBUTED_MAGIC, sizeof(hello.magic));
+  hello.key = key;
+  if (!send_all(fd, &hello, sizeof(hello))) {
+    std::cerr << "Lost the coordinator on " << address << "." << std::endl;
+    close(fd);
+    return;
+  }
+  std::cout << "Rendering for the coordinator on " << address << " with " << render_threads() << " threads." << std::endl;
+
+  double renderStart = seconds_now();
+  RayTraceStats stats;
+  int rendered = 0;
+  TileMessage message;
+  message.index = 0;
+  while (recv_all(fd, &message, sizeof(message)) && message.index >= 0) {
+    const Tile& tile = message.tile;
+    const Tile halo = with_halo(tile, width, height);
+    RenderBuffers buffers(width, halo.y1 - halo.y0, halo.y0);
+
+    ResultHeader header;
+    header.index = message.index;
+    header.tile = tile;
+    double tileStart = seconds_now();
+    render_region(bundle, tile, buffers, header.stats);
+    header.seconds = seconds_now() - tileStart;
+
+    std::vector<Scalar> colours;
+    std::vector<int> samples;
+    for (int y = tile.y0 - halo.y0; y < tile.y1 - halo.y0; y++) {
+      for (int x = tile.x0; x < tile.x1; x++) {
+        for (int c = 0; c < 3; c++) {
+          colours.push_back(buffers.image(x, y, c));
+        }
+        samples.push_back(buffers.samples[y * width + x]);
+      }
+    }
+    if (!send_all(fd, &header, sizeof(header)) ||
+        !send_all(fd, &colours[0], sizeof(Scalar) * colours.size()) ||
+        !send_all(fd, &samples[0], sizeof(int) * samples.size())) {
+      break;
+    }
+    stats.merge(header.stats);
+    rendered++;
+  }
+  close(fd);
+
+  if (message.index == WRONG_RENDER) {
+    std::cerr << "The coordinator on " << address << " is rendering a different scene." << std::endl;
+  } else if (message.index != NO_MORE_TILES) {
+    std::cerr << "Lost the coordinator on " << address << "." << std::endl;
+  }
+  std::cout << "Rendered " << rendered << " tiles in " << seconds_now() - renderStart << "s." << std::endl;
+  std::cout << stats;
+}
@@ -0,0 +1,39 @@
+#ifndef CS488_DISTRIBUTED_HPP
+#define CS488_DISTRIBUTED_HPP
+
+#include <string>
+#include "a4.hpp"
+
+// Tiles handed out to worker processes are this many pixels square.
+#ifndef DISTRIBUTED_TILE_SIZE
+#define DISTRIBUTED_TILE_SIZE 64
+#endif
+
+// A worker that hasn't sent back a tile in this many seconds is given up
+// on, and the tiles it had go to the other workers.
+#ifndef DISTRIBUTED_TILE_TIMEOUT
+#define DISTRIBUTED_TILE_TIMEOUT 120
+#endif
+
+// Rendering across processes: a coordinator splits the image into tiles
+// and hands them out to any number of workers, each an rt running the same
+// scene script (on this machine or another with the same build). Workers
+// render a tile with all their threads and send back its pixels; tiles held
+// by a worker that drops out or stalls are handed out again.
+//
+// Addresses are "unix:<path>" for a Unix socket, or "<host>:<port>" for
+// TCP. A coordinator can leave the host out to listen on every interface.
+
+// Listens on address and renders the image from the tiles its workers send
+// back, then saves it. Waits for as long as it takes workers to connect;
+// distributed renders aren't checkpointed. Returns the number of samples
+// taken.
+long render_distributed(WorkBundle bundle, const std::string& filename, const std::string& address,
+                        unsigned long long key, RayTraceStats& stats);
+
+// Connects to the coordinator at address and renders the tiles it hands
+// out until it says the image is done. Workers for a different render
+// (by key) are turned away.
+void run_worker(WorkBundle bundle, const std::string& address, unsigned long long key);
+
+#endif
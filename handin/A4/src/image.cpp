@@ -11,15 +11,15 @@ Image::Image() : m_width(0), m_height(0), m_elements(0), m_data(0) {
 
 Image::Image(int width, int height, int elements)
   : m_width(width), m_height(height), m_elements(elements),
-    m_data(new double[m_width * m_height * m_elements]) {
+    m_data(new Scalar[m_width * m_height * m_elements]) {
 }
 
 Image::Image(const Image& other)
   : m_width(other.m_width), m_height(other.m_height), m_elements(other.m_elements),
-    m_data(other.m_data ? new double[m_width * m_height * m_elements] : 0) {
+    m_data(other.m_data ? new Scalar[m_width * m_height * m_elements] : 0) {
   if (m_data) {
     std::memcpy(m_data, other.m_data,
-                m_width * m_height * m_elements * sizeof(double));
+                m_width * m_height * m_elements * sizeof(Scalar));
   }
 }
 
@@ -33,12 +33,12 @@ Image& Image::operator=(const Image& other) {
   m_width = other.m_width;
   m_height = other.m_height;
   m_elements = other.m_elements;
-  m_data = (other.m_data ? new double[m_width * m_height * m_elements] : 0);
+  m_data = (other.m_data ? new Scalar[m_width * m_height * m_elements] : 0);
 
   if (m_data) {
     std::memcpy(m_data,
                 other.m_data,
-                m_width * m_height * m_elements * sizeof(double));
+                m_width * m_height * m_elements * sizeof(Scalar));
   }
 
   return *this;
@@ -56,11 +56,11 @@ int Image::elements() const {
   return m_elements;
 }
 
-double Image::operator()(int x, int y, int i) const {
+Scalar Image::operator()(int x, int y, int i) const {
   return m_data[m_elements * (m_width * y + x) + i];
 }
 
-double& Image::operator()(int x, int y, int i) {
+Scalar& Image::operator()(int x, int y, int i) {
   return m_data[m_elements * (m_width * y + x) + i];
 }
 
@@ -119,7 +119,7 @@ bool Image::savePng(const std::string& filename)
     for(int j=0;j<m_width;j++){
       for(int k = 0;k<m_elements;k++) {
         // Clamp the value
-        double value = std::min(1.0, std::max(0.0, (*this)(j, i, k)));
+        double value = std::min<double>(1.0, std::max<double>(0.0, (*this)(j, i, k)));
 
         // Write it out
         tempLine[m_elements*j+k] = static_cast<png_byte>(value*255.0); 
@@ -217,7 +217,7 @@ bool Image::loadPng(const std::string& filename) {
 
   png_bytep* row_pointers = png_get_rows(png_ptr, info_ptr);
 
-  m_data = new double[m_width * m_height * m_elements];
+  m_data = new Scalar[m_width * m_height * m_elements];
 
   for (int y = 0; y < m_height; y++) {
     for (int x = 0; x < m_width; x++) {
@@ -241,11 +241,97 @@ bool Image::loadPng(const std::string& filename) {
   return true;
 }
 
-const double* Image::data() const {
+const Scalar* Image::data() const {
   return m_data;
 }
 
-double* Image::data() {
+Scalar* Image::data() {
   return m_data;
 }
 
+ImageRowWriter::ImageRowWriter(const std::string& filename, int width, int height,
+                               const std::string& pfmFilename)
+  : m_width(width), m_height(height), m_rowsWritten(0),
+    m_pngFile(std::fopen(filename.c_str(), "wb")), m_png(0), m_info(0),
+    m_pngRow(width * 3), m_pfmFile(0), m_pfmHeaderSize(0) {
+  if (m_pngFile) {
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    png_init_io(png_ptr, m_pngFile);
+    png_set_filter(png_ptr, 0, PNG_FILTER_PAETH);
+    png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+    png_set_IHDR(png_ptr, info_ptr,
+                 m_width, m_height,
+                 8,
+                 PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+    m_png = png_ptr;
+    m_info = info_ptr;
+  }
+
+  if (!pfmFilename.empty()) {
+    m_pfmFile = std::fopen(pfmFilename.c_str(), "wb");
+    if (m_pfmFile) {
+      // Negative scale means little-endian.
+      m_pfmHeaderSize = std::fprintf(m_pfmFile, "PF\n%d %d\n-1.0\n", m_width, m_height);
+      m_pfmRow.resize(width * 3);
+    }
+  }
+}
+
+ImageRowWriter::~ImageRowWriter() {
+  close();
+}
+
+bool ImageRowWriter::ok() const {
+  return m_pngFile != 0 && (m_pfmHeaderSize == 0 || m_pfmFile != 0);
+}
+
+void ImageRowWriter::writeRows(const Image& band, int first, int count) {
+  for (int i = first; i < first + count; i++) {
+    if (m_png) {
+      for (int j = 0; j < m_width; j++) {
+        for (int k = 0; k < 3; k++) {
+          double value = std::min<double>(1.0, std::max<double>(0.0, band(j, i, k)));
+          m_pngRow[3*j+k] = static_cast<png_byte>(value*255.0);
+        }
+      }
+      png_write_row((png_structp) m_png, &m_pngRow[0]);
+    }
+
+    if (m_pfmFile) {
+      for (int j = 0; j < m_width; j++) {
+        for (int k = 0; k < 3; k++) {
+          m_pfmRow[3*j+k] = band(j, i, k);
+        }
+      }
+      // PFM rows run bottom to top.
+      std::fseek(m_pfmFile, m_pfmHeaderSize + (long) (m_height - 1 - m_rowsWritten) * m_width * 3 * sizeof(float), SEEK_SET);
+      std::fwrite(&m_pfmRow[0], sizeof(float), m_pfmRow.size(), m_pfmFile);
+    }
+
+    m_rowsWritten++;
+  }
+}
+
+void ImageRowWriter::close() {
+  if (m_png) {
+    png_structp png_ptr = (png_structp) m_png;
+    png_infop info_ptr = (png_infop) m_info;
+    png_write_end(png_ptr, info_ptr);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    m_png = 0;
+    m_info = 0;
+  }
+  if (m_pngFile) {
+    std::fclose(m_pngFile);
+    m_pngFile = 0;
+  }
+  if (m_pfmFile) {
+    std::fclose(m_pfmFile);
+    m_pfmFile = 0;
+  }
+}
@@ -1,7 +1,10 @@
 #ifndef CS488_IMAGE_HPP
 #define CS488_IMAGE_HPP
 
+#include <cstdio>
 #include <string>
+#include <vector>
+#include "algebra.hpp"
 
 /** An image, consisting of a rectangle of floating-point elements.
  * This class makes it easy to read PNG files and the like from
@@ -23,13 +26,13 @@ public:
 
   int width() const; ///< Determine the width of the image
   int height() const; ///< Determine the height of the image
-  int elements() const; ///< Determine the depth (doubles per pixel) of
+  int elements() const; ///< Determine the depth (Scalars per pixel) of
                         ///the image
 
-  double operator()(int x, int y, int i) const; ///< Retrieve a
+  Scalar operator()(int x, int y, int i) const; ///< Retrieve a
                                                ///particular component
                                                ///from the image.
-  double& operator()(int x, int y, int i);  ///< Retrieve a
+  Scalar& operator()(int x, int y, int i);  ///< Retrieve a
                                                ///particular component
                                                ///from the image.
 
@@ -40,13 +43,45 @@ public:
   bool savePng(const std::string& filename); ///< Save this image into
                                              ///  the given PNG file
 
-  const double* data() const;
-  double* data();
+  const Scalar* data() const;
+  Scalar* data();
 
 private:
   int m_width, m_height;
   int m_elements;
-  double* m_data;
+  Scalar* m_data;
+};
+
+/** Writes an RGB image out a band of rows at a time, top to bottom, so
+ * the whole image never has to be in memory. Writes a PNG, quantized the
+ * same way as Image::savePng, and optionally a PFM (32-bit float) image
+ * alongside it, unclamped.
+ */
+class ImageRowWriter {
+public:
+  ImageRowWriter(const std::string& filename, int width, int height,
+                 const std::string& pfmFilename="");
+  ~ImageRowWriter(); ///< Calls close()
+
+  bool ok() const; ///< False if a file couldn't be opened
+
+  /// Writes count rows of band, starting at its row first, as the next
+  /// rows of the image. band must be as wide as the image.
+  void writeRows(const Image& band, int first, int count);
+
+  /// Finishes the files. Every row must have been written.
+  void close();
+
+private:
+  int m_width, m_height;
+  int m_rowsWritten;
+  std::FILE* m_pngFile;
+  void* m_png;  ///< png_structp
+  void* m_info; ///< png_infop
+  std::vector<unsigned char> m_pngRow;
+  std::FILE* m_pfmFile;
+  long m_pfmHeaderSize;
+  std::vector<float> m_pfmRow;
 };
 
 #endif
@@ -1,5 +1,6 @@
 #include <iostream>
 #include "scene_lua.hpp"
+#include "scenecache.hpp"
 
 int main(int argc, char** argv)
 {
@@ -8,9 +9,19 @@ int main(int argc, char** argv)
     filename = argv[1];
   }
 
+  if (SCENE_CACHE && render_scene_cache(filename)) {
+    return 0;
+  }
+
+  if (SCENE_CACHE) {
+    begin_scene_cache(filename);
+  }
   if (!run_lua(filename)) {
     std::cerr << "Could not open " << filename << std::endl;
     return 1;
   }
+  if (SCENE_CACHE) {
+    save_scene_cache();
+  }
 }
 
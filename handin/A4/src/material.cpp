@@ -26,7 +26,7 @@ double PhongMaterial::reflectance() const {
 }
 
 Colour PhongMaterial::calculateLighting(const Vector3D& incident, const Vector3D& normal, const Vector3D& reflected, const Vector3D& viewer, const Colour& intensity) const {
-  double incidentDotNormal = std::max(0.0, incident.dot(normal));
+  double incidentDotNormal = std::max<double>(0.0, incident.dot(normal));
 
   Colour diffuse = m_kd * incidentDotNormal * intensity;
 
@@ -34,7 +34,7 @@ Colour PhongMaterial::calculateLighting(const Vector3D& incident, const Vector3D
   // Blinn-Phong.
   Vector3D h = viewer + incident;
   h.normalize();
-  Colour specular = m_ks * pow(std::max(0.0, h.dot(normal)), m_shininess) * intensity;
+  Colour specular = m_ks * pow(std::max<double>(0.0, h.dot(normal)), m_shininess) * intensity;
 #else
   // Phong.
   Colour specular = m_ks * pow(reflected.dot(viewer), m_shininess) * intensity;
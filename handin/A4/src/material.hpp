@@ -22,6 +22,10 @@ public:
   PhongMaterial(const Colour& kd, const Colour& ks, double shininess, double reflectance=0.0);
   virtual ~PhongMaterial();
 
+  const Colour& diffuse() const { return m_kd; }
+  const Colour& specular() const { return m_ks; }
+  double shininess() const { return m_shininess; }
+
   virtual void apply_gl() const;
 
   virtual double reflectance() const;
@@ -1,95 +1,260 @@
 #include "mesh.hpp"
 #include <iostream>
 #include <algorithm>
-#include <list>
+#include <pthread.h>
+#include "objfile.hpp"
 
-//#define MESH_TREE_OPTIMIZATION
-#define MESH_TREE_MAX_DEPTH 1
-#define MESH_MAX_FACES 20
+BVHBuildStats MeshGeometry::s_buildStats;
+std::vector<MeshGeometry*> MeshGeometry::s_pending;
+std::map<std::string, MeshGeometry*> Mesh::s_loaded;
 
+MeshGeometry::MeshGeometry(const std::vector<Point3D>& verts,
+                           const std::vector<Face>& faces)
+  : m_verts(verts), m_bound(NULL), m_refs(0) {
 
-Mesh::Mesh(const std::vector<Point3D>& verts,
-           const std::vector< std::vector<int> >& faces,
-           int depth)
-  : m_verts(verts), m_faces(faces), m_bound(NULL), m_descendents(NULL) {
-
-  std::cout << "Constructing Mesh with " << m_verts.size() << " verts and " << m_faces.size() << " faces." << std::endl;
+  std::cout << "Constructing Mesh with " << m_verts.size() << " verts and " << faces.size() << " faces." << std::endl;
 
-  if (m_verts.empty() || m_faces.size() < 6) {
+  if (m_verts.empty()) {
     return;
   }
 
-  bool clearData = false;
-
-#ifdef MESH_TREE_OPTIMIZATION
-  // Divide space.
-  if (depth < MESH_TREE_MAX_DEPTH && m_faces.size() > MESH_MAX_FACES) {
-    std::list<std::vector<Face> > faceChunks;
-    faceChunks.push_back(m_faces);
-
-    for (int axis = X; axis <= Z; axis++) {
-      const int size = faceChunks.size();
-      for (int chunk = 0; chunk < size; chunk++) {
-        FaceComparator faceCmp((Axis) axis, this);
-        std::vector<Face> faces = faceChunks.front();
-        faceChunks.pop_front();
-        std::sort(faces.begin(), faces.end(), faceCmp);
-        int half = faces.size() / 2;
-        faceChunks.push_back(std::vector<Face>(faces.begin(), faces.begin() + half));
-        faceChunks.push_back(std::vector<Face>(faces.begin() + half, faces.end()));
-      }
+  // Triangulate each face as a fan around its first vertex.
+  for (std::vector<Face>::const_iterator it = faces.begin(); it != faces.end(); it++) {
+    const Face& face = *it;
+    if (face.size() < 3) {
+      std::cout << "Warn: Face with less than 3 verts found." << std::endl;
+      continue;
+    }
+    for (unsigned int i = 1; i + 1 < face.size(); i++) {
+      Face triangle(3);
+      triangle[0] = face[0];
+      triangle[1] = face[i];
+      triangle[2] = face[i + 1];
+      m_faces.push_back(triangle);
     }
+  }
+
+  prepareBounds();
+  s_pending.push_back(this);
+}
+
+void MeshGeometry::build(int threads) {
+  prepareTriangles();
 
-    std::cout << "Dividing into " << faceChunks.size() << " descendents" << std::endl;
-    m_descendents = new SceneNode("mesh_internal");
-    for (std::list<std::vector<Face> >::iterator faceIt = faceChunks.begin(); faceIt != faceChunks.end(); faceIt++) {
-      m_descendents->add_child(new GeometryNode("mesh_internal_geom", new Mesh(m_verts, *faceIt, depth+1)));
+  std::vector<BoundingBox> faceBounds;
+  faceBounds.reserve(m_faces.size());
+  for (std::vector<Face>::const_iterator it = m_faces.begin(); it != m_faces.end(); it++) {
+    BoundingBox bounds;
+    for (Face::const_iterator v = it->begin(); v != it->end(); v++) {
+      bounds.expand(m_verts[*v]);
     }
-    clearData = true;
+    faceBounds.push_back(bounds);
   }
-#endif
+  m_bvh.build(faceBounds, MESH_BVH_LEAF_SIZE, threads);
+}
+
+MeshGeometry::MeshGeometry(const std::vector<Point3D>& verts,
+                           const std::vector<Face>& triangles,
+                           const std::vector<BVH::Node>& nodes,
+                           const std::vector<int>& indices)
+  : m_verts(verts), m_faces(triangles), m_bound(NULL), m_refs(0) {
+  prepareTriangles();
+  m_bvh.restore(nodes, indices, MESH_BVH_LEAF_SIZE);
 
-  Point3D min = m_verts[0];
-  Point3D max = m_verts[0];
+  // Counted as built, taking no time.
+  s_buildStats.structures++;
+  s_buildStats.primitives += m_faces.size();
+  s_buildStats.nodes += m_bvh.nodes().size();
+
+  prepareBounds();
+}
+
+void MeshGeometry::prepareBounds() {
   for (std::vector<Point3D>::const_iterator it = m_verts.begin(); it != m_verts.end(); it++) {
-    min[X] = std::min(min[X], (*it)[X]);
-    max[X] = std::max(max[X], (*it)[X]);
-    min[Y] = std::min(min[Y], (*it)[Y]);
-    max[Y] = std::max(max[Y], (*it)[Y]);
-    min[Z] = std::min(min[Z], (*it)[Z]);
-    max[Z] = std::max(max[Z], (*it)[Z]);
+    m_bounds.expand(*it);
+  }
+  if (DRAW_BOUNDING_BOXES && !m_verts.empty()) {
+    const BoundingBox& bounds = m_bounds;
+    m_bound = new GeometryNode("some_bounding_box", new Cube());
+    Vector3D size = bounds.max - bounds.min;
+    m_bound->translate(bounds.min - Point3D());
+    size[X] = std::max<Scalar>(0.001, size[X]);
+    size[Y] = std::max<Scalar>(0.001, size[Y]);
+    size[Z] = std::max<Scalar>(0.001, size[Z]);
+    m_bound->scale(size);
   }
-  m_bound = new GeometryNode("some_bounding_box", new Cube());
-  Vector3D size = max - min;
-  m_bound->translate(min - Point3D());
-  size[X] = std::max(0.001, size[X]);
-  size[Y] = std::max(0.001, size[Y]);
-  size[Z] = std::max(0.001, size[Z]);
-  m_bound->scale(size);
+}
 
-  if (clearData) {
-    m_verts.clear();
-    m_faces.clear();
+void MeshGeometry::prepareTriangles() {
+  const int count = m_faces.size();
+  for (int c = 0; c < 3; c++) {
+    m_triangles.v0[c].resize(count);
+    m_triangles.e1[c].resize(count);
+    m_triangles.e2[c].resize(count);
+    m_triangles.normal[c].resize(count);
+  }
+
+  for (int i = 0; i < count; i++) {
+    const Face& face = m_faces[i];
+    const Point3D& p0 = m_verts[face[0]];
+    const Vector3D e1 = m_verts[face[1]] - p0;
+    const Vector3D e2 = m_verts[face[2]] - p0;
+    // Same winding the angle-sum test used, so shading is unchanged.
+    Vector3D normal = e1.cross(e2);
+    normal.normalize();
+    for (int c = 0; c < 3; c++) {
+      m_triangles.v0[c][i] = p0[c];
+      m_triangles.e1[c][i] = e1[c];
+      m_triangles.e2[c][i] = e2[c];
+      m_triangles.normal[c][i] = normal[c];
+    }
   }
 }
 
-Mesh::~Mesh() {
+namespace {
+
+struct MoreTriangles {
+  bool operator()(const MeshGeometry* a, const MeshGeometry* b) const {
+    return a->triangles().size() > b->triangles().size();
+  }
+};
+
+}
+
+// The geometries to build, handed out in order to each thread that asks.
+struct MeshGeometry::PendingBuilds {
+  PendingBuilds(const std::vector<MeshGeometry*>& geometry, int threadsEach)
+    : geometry(geometry), threadsEach(threadsEach), next(0) {}
+
+  const std::vector<MeshGeometry*>& geometry;
+  int threadsEach;
+  int next;
+};
+
+void* MeshGeometry::build_pending(void* arg) {
+  PendingBuilds* builds = (PendingBuilds*) arg;
+  for (;;) {
+    const int i = __sync_fetch_and_add(&builds->next, 1);
+    if (i >= (int) builds->geometry.size()) {
+      return NULL;
+    }
+    builds->geometry[i]->build(builds->threadsEach);
+  }
+}
+
+void MeshGeometry::buildPending(int threads) {
+  if (s_pending.empty()) {
+    return;
+  }
+  double buildStart = seconds_now();
+
+  std::vector<MeshGeometry*> pending;
+  pending.swap(s_pending);
+  // Starting on the biggest first keeps one large mesh from being left to
+  // build alone at the end.
+  std::stable_sort(pending.begin(), pending.end(), MoreTriangles());
+
+  // Threads left over once every geometry has one go to splitting the
+  // subtrees of each BVH.
+  const int workers = std::max(1, std::min<int>(threads, pending.size()));
+  PendingBuilds builds(pending, std::max(1, threads / workers));
+  std::vector<pthread_t> extra(workers - 1);
+  int started = 0;
+  for (; started < (int) extra.size(); started++) {
+    if (pthread_create(&extra[started], NULL, build_pending, &builds) != 0) {
+      break;
+    }
+  }
+  build_pending(&builds);
+  for (int i = 0; i < started; i++) {
+    pthread_join(extra[i], NULL);
+  }
+
+  for (std::vector<MeshGeometry*>::const_iterator it = pending.begin(); it != pending.end(); it++) {
+    s_buildStats.structures++;
+    s_buildStats.primitives += (*it)->m_faces.size();
+    s_buildStats.nodes += (*it)->m_bvh.nodes().size();
+  }
+  s_buildStats.seconds += seconds_now() - buildStart;
+  std::cout << "Built " << pending.size() << " mesh BVHs with " << workers * builds.threadsEach
+    << " threads in " << seconds_now() - buildStart << "s." << std::endl;
+}
+
+MeshGeometry::~MeshGeometry() {
+  std::vector<MeshGeometry*>::iterator pending = std::find(s_pending.begin(), s_pending.end(), this);
+  if (pending != s_pending.end()) {
+    s_pending.erase(pending);
+  }
   if (m_bound != NULL) {
     delete m_bound;
     m_bound = NULL;
   }
 }
 
+void MeshGeometry::ref() {
+  m_refs++;
+}
+
+void MeshGeometry::unref() {
+  if (--m_refs == 0) {
+    delete this;
+  }
+}
+
+Mesh::Mesh(const std::vector<Point3D>& verts,
+           const std::vector< std::vector<int> >& faces)
+  : m_geometry(new MeshGeometry(verts, faces)) {
+  m_geometry->ref();
+}
+
+Mesh::Mesh(MeshGeometry* geometry)
+  : m_geometry(geometry) {
+  m_geometry->ref();
+}
+
+Mesh::Mesh(const Mesh& other)
+  : Primitive(other), m_geometry(other.m_geometry) {
+  m_geometry->ref();
+}
+
+Mesh::~Mesh() {
+  m_geometry->unref();
+}
+
+Mesh* Mesh::load(const std::string& filename, std::string& error) {
+  std::map<std::string, MeshGeometry*>::iterator loaded = s_loaded.find(filename);
+  if (loaded != s_loaded.end()) {
+    std::cout << "Sharing the geometry already read from " << filename << "." << std::endl;
+    return new Mesh(loaded->second);
+  }
+
+  std::vector<Point3D> verts;
+  std::vector<Face> faces;
+  double loadStart = seconds_now();
+  if (!read_obj(filename, verts, faces, error)) {
+    return NULL;
+  }
+  std::cout << "Read " << filename << " (" << verts.size() << " verts, " << faces.size()
+    << " faces) in " << seconds_now() - loadStart << "s." << std::endl;
+
+  Mesh* mesh = new Mesh(verts, faces);
+  // The table keeps its own reference, so later loads can share the
+  // geometry even if every mesh made from it so far is gone.
+  mesh->m_geometry->ref();
+  s_loaded[filename] = mesh->m_geometry;
+  return mesh;
+}
+
 std::ostream& operator<<(std::ostream& out, const Mesh& mesh) {
   std::cerr << "mesh({";
-  for (std::vector<Point3D>::const_iterator I = mesh.m_verts.begin(); I != mesh.m_verts.end(); ++I) {
-    if (I != mesh.m_verts.begin()) std::cerr << ",\n      ";
+  for (std::vector<Point3D>::const_iterator I = mesh.m_geometry->m_verts.begin(); I != mesh.m_geometry->m_verts.end(); ++I) {
+    if (I != mesh.m_geometry->m_verts.begin()) std::cerr << ",\n      ";
     std::cerr << *I;
   }
   std::cerr << "},\n\n     {";
 
-  for (std::vector<Mesh::Face>::const_iterator I = mesh.m_faces.begin(); I != mesh.m_faces.end(); ++I) {
-    if (I != mesh.m_faces.begin()) std::cerr << ",\n      ";
+  for (std::vector<Mesh::Face>::const_iterator I = mesh.m_geometry->m_faces.begin(); I != mesh.m_geometry->m_faces.end(); ++I) {
+    if (I != mesh.m_geometry->m_faces.begin()) std::cerr << ",\n      ";
     std::cerr << "[";
     for (Mesh::Face::const_iterator J = I->begin(); J != I->end(); ++J) {
       if (J != I->begin()) std::cerr << ", ";
@@ -102,73 +267,184 @@ std::ostream& operator<<(std::ostream& out, const Mesh& mesh) {
 }
 
 
-RayResult* Mesh::findIntersections(const Ray& ray) {
-  RayResult* result = new RayResult(std::vector<Intersection>(), m_faces.size());
-  if (m_bound != NULL) {
-    RayResult* boundResult = m_bound->findIntersections(ray);
+BoundingBox Mesh::getBounds() const {
+  return m_geometry->m_bounds;
+}
 
-    result->stats.bounding_box_checks++;
-    if (boundResult->isHit()) {
-      result->stats.bounding_box_hits++;
-    }
+// Tests each triangle in a BVH leaf the ray reaches.
+struct Mesh::FaceIntersector {
+  FaceIntersector(const Ray& ray, const Mesh& mesh, HitRecord& hit, RayTraceStats& stats)
+    : ray(ray), mesh(mesh), hit(hit), stats(stats), found(false) {}
 
-    if (!boundResult->isHit() || DRAW_BOUNDING_BOXES) {
-      result->merge(*boundResult);
-      delete boundResult;
-      return result;
+  bool operator()(int index) {
+    stats.intersection_checks++;
+    if (mesh.intersectTriangle(ray, index, hit)) {
+      found = true;
     }
+    return false;
+  }
+
+  const Ray& ray;
+  const Mesh& mesh;
+  HitRecord& hit;
+  RayTraceStats& stats;
+  bool found;
+};
 
-    result->stats.merge(boundResult->stats);
-    delete boundResult;
+bool Mesh::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const {
+  if (m_geometry->m_bound != NULL) {
+    return m_geometry->m_bound->intersect(ray, hit, stats);
   }
-  if (m_descendents != NULL) {
-    RayResult* descendentResult = m_descendents->findIntersections(ray);
-    result->merge(*descendentResult);
-    delete descendentResult;
-    return result;
+
+  FaceIntersector intersector(ray, *this, hit, stats);
+  m_geometry->m_bvh.traverse(ray, hit.tMax, intersector, stats);
+  return intersector.found;
+}
+
+// Stops at the first triangle found in the interval.
+struct Mesh::FaceOccluder {
+  FaceOccluder(const Ray& ray, const Mesh& mesh, double tMin, double tMax, RayTraceStats& stats)
+    : ray(ray), mesh(mesh), tMin(tMin), tMax(tMax), stats(stats), found(false) {}
+
+  bool operator()(int index) {
+    stats.intersection_checks++;
+    HitRecord hit(tMin, tMax);
+    found = mesh.intersectTriangle(ray, index, hit);
+    return found;
   }
 
-  // Reinier van Vliet and Remco Lam angle sums algorithm.
-  const double EPSILON = 0.0000001;
-  for (std::vector<Face>::const_iterator it = m_faces.begin(); it != m_faces.end(); it++) {
-    const Face& face = *it;
-    if (face.size() < 3) {
-      std::cout << "Warn: Face with less than 3 verts found." << std::endl;
-      continue;
-    }
+  const Ray& ray;
+  const Mesh& mesh;
+  double tMin;
+  double tMax;
+  RayTraceStats& stats;
+  bool found;
+};
 
-    Vector3D v1 = m_verts[face[1]] - m_verts[face[0]];
-    Vector3D v2 = m_verts[face[1]] - m_verts[face[2]];
-    //Vector3D normal = v1.cross(v2);
-    Vector3D normal = v2.cross(v1);
-    normal.normalize();
+bool Mesh::occludes(const Ray& ray, double tMin, double tMax, RayTraceStats& stats) const {
+  if (m_geometry->m_bound != NULL) {
+    return Primitive::occludes(ray, tMin, tMax, stats);
+  }
 
-    double t = -(ray.pos - m_verts[face[0]]).dot(normal) / ray.dir.dot(normal);
-    if (t < EPSILON) {
-      continue; // Pointing away from face.
-    }
-    Point3D q = ray.pos + t*ray.dir;
-
-    double anglesum = 0.0;
-    for (unsigned int i = 0; i < face.size(); i++) {
-      Vector3D p1 = m_verts[face[i]] - q;
-      Vector3D p2 = m_verts[face[(i+1)%face.size()]] - q;
-
-      double m1 = p1.length();
-      double m2 = p2.length();
-      if (m1*m2 <= EPSILON) {
-        anglesum = M_PI*2; // We are on a node, consider this inside.
-      } else {
-        anglesum += acos(p1.dot(p2) / (m1*m2));
+  FaceOccluder occluder(ray, *this, tMin, tMax, stats);
+  m_geometry->m_bvh.traverse(ray, tMax, occluder, stats);
+  return occluder.found;
+}
+
+// Packets share the walk down the triangle BVH; each triangle is still
+// tested one lane at a time.
+struct Mesh::FacePacketIntersector {
+  FacePacketIntersector(const RayPacket& packet, const Mesh& mesh, HitRecord* hits, RayTraceStats& stats)
+    : packet(packet), mesh(mesh), hits(hits), stats(stats), found(0) {}
+
+  __m128 limits() const {
+    return packet_limits(hits);
+  }
+
+  bool operator()(int index, int mask) {
+    for (int i = 0; i < PACKET_SIZE; i++) {
+      if (mask & (1 << i)) {
+        stats.intersection_checks++;
+        if (mesh.intersectTriangle(packet.rays[i], index, hits[i])) {
+          found |= 1 << i;
+        }
       }
-      if (anglesum >= M_PI*2 - EPSILON && anglesum <= M_PI*2 + EPSILON) {
-        result->intersections.push_back(Intersection(q, normal, NULL));
-        //std::cout << "INTERSECTION " << t << std::endl;
+    }
+    return false;
+  }
+
+  const RayPacket& packet;
+  const Mesh& mesh;
+  HitRecord* hits;
+  RayTraceStats& stats;
+  int found;
+};
+
+int Mesh::intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const {
+  if (m_geometry->m_bound != NULL) {
+    return Primitive::intersectPacket(packet, hits, stats);
+  }
+
+  FacePacketIntersector intersector(packet, *this, hits, stats);
+  m_geometry->m_bvh.traverse(packet, intersector, stats);
+  return intersector.found;
+}
+
+struct Mesh::FacePacketOccluder {
+  FacePacketOccluder(const RayPacket& packet, const Mesh& mesh, double tMin, const double* tMax, RayTraceStats& stats)
+    : packet(packet), mesh(mesh), tMin(tMin), tMax(tMax), stats(stats), blocked(0),
+      m_limits(packet_limits(tMax, packet.mask)) {}
+
+  __m128 limits() const {
+    return m_limits;
+  }
+
+  bool operator()(int index, int mask) {
+    mask &= ~blocked;
+    for (int i = 0; i < PACKET_SIZE; i++) {
+      if (mask & (1 << i)) {
+        stats.intersection_checks++;
+        HitRecord hit(tMin, tMax[i]);
+        if (mesh.intersectTriangle(packet.rays[i], index, hit)) {
+          blocked |= 1 << i;
+          m_limits = packet_limits(tMax, packet.mask & ~blocked);
+        }
       }
     }
-    //std::cout << "Exitted with anglesum=" << anglesum << std::endl;
+    return blocked == packet.mask;
   }
 
-  return result;
+  const RayPacket& packet;
+  const Mesh& mesh;
+  double tMin;
+  const double* tMax;
+  RayTraceStats& stats;
+  int blocked;
+  __m128 m_limits;
+};
+
+int Mesh::occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const {
+  if (m_geometry->m_bound != NULL) {
+    return Primitive::occludesPacket(packet, tMin, tMax, stats);
+  }
+
+  FacePacketOccluder occluder(packet, *this, tMin, tMax, stats);
+  m_geometry->m_bvh.traverse(packet, occluder, stats);
+  return occluder.blocked;
 }
 
+bool Mesh::intersectTriangle(const Ray& ray, int index, HitRecord& hit) const {
+  const MeshGeometry::Triangles& tris = m_geometry->m_triangles;
+
+  const double e1[3] = {tris.e1[0][index], tris.e1[1][index], tris.e1[2][index]};
+  const double e2[3] = {tris.e2[0][index], tris.e2[1][index], tris.e2[2][index]};
+  const double d[3] = {ray.dir[0], ray.dir[1], ray.dir[2]};
+
+  // p = d x e2; the determinant is zero when the ray runs along the plane.
+  const double p[3] = {d[1]*e2[2] - d[2]*e2[1], d[2]*e2[0] - d[0]*e2[2], d[0]*e2[1] - d[1]*e2[0]};
+  const double det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+  if (det == 0.0) {
+    return false;
+  }
+  const double invDet = 1.0 / det;
+
+  const double s[3] = {ray.pos[0] - tris.v0[0][index], ray.pos[1] - tris.v0[1][index], ray.pos[2] - tris.v0[2][index]};
+  const double u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) * invDet;
+  if (u < 0.0 || u > 1.0) {
+    return false;
+  }
+
+  const double q[3] = {s[1]*e1[2] - s[2]*e1[1], s[2]*e1[0] - s[0]*e1[2], s[0]*e1[1] - s[1]*e1[0]};
+  const double v = (d[0]*q[0] + d[1]*q[1] + d[2]*q[2]) * invDet;
+  if (v < 0.0 || u + v > 1.0) {
+    return false;
+  }
+
+  const double t = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) * invDet;
+  if (t < MESH_EPSILON || !hit.accepts(t)) {
+    return false; // Behind the ray, or not the closest.
+  }
+
+  hit.record(t, ray.pos + t*ray.dir, Vector3D(tris.normal[0][index], tris.normal[1][index], tris.normal[2][index]));
+  return true;
+}
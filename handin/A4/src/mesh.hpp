@@ -1,46 +1,142 @@
 #ifndef CS488_MESH_HPP
 #define CS488_MESH_HPP
 
+#include <map>
+#include <string>
 #include <vector>
 #include <iosfwd>
 #include "primitive.hpp"
 #include "algebra.hpp"
 #include "raytracer.hpp"
 #include "scene.hpp"
+#include "bvh.hpp"
 
 #ifndef DRAW_BOUNDING_BOXES
 #define DRAW_BOUNDING_BOXES false
 #endif
 
-// A polygonal mesh.
+#ifndef MESH_BVH_LEAF_SIZE
+#define MESH_BVH_LEAF_SIZE 4
+#endif
+
+class Mesh;
+
+// The triangles of a mesh and the BVH over them, shared by every Mesh made
+// from the same data. Reference counted: each Mesh holds one reference,
+// and the geometry is freed along with the last of them.
+class MeshGeometry {
+public:
+  typedef std::vector<int> Face;
+
+  // Faces are split into triangles here; the BVH is built later, by
+  // buildPending.
+  MeshGeometry(const std::vector<Point3D>& verts,
+               const std::vector<Face>& faces);
+  // Geometry already split into triangles, with the BVH built over them,
+  // as saved from verts(), triangles() and bvh().
+  MeshGeometry(const std::vector<Point3D>& verts,
+               const std::vector<Face>& triangles,
+               const std::vector<BVH::Node>& nodes,
+               const std::vector<int>& indices);
+
+  const std::vector<Point3D>& verts() const { return m_verts; }
+  const std::vector<Face>& triangles() const { return m_faces; }
+  const BVH& bvh() const { return m_bvh; }
+
+  void ref();
+  void unref();
+
+  // Builds the BVHs of every geometry made since the last call, biggest
+  // first, using up to `threads` threads across and within them. Must be
+  // called before any of them is rendered.
+  static void buildPending(int threads);
+
+private:
+  ~MeshGeometry();
+
+  // Precomputes m_triangles and builds m_bvh, with up to `threads` threads.
+  void build(int threads);
+  // Precomputes m_triangles from m_faces.
+  void prepareTriangles();
+  // Works out m_bounds, and makes m_bound if DRAW_BOUNDING_BOXES is set.
+  void prepareBounds();
+
+  struct PendingBuilds;
+  static void* build_pending(void* arg);
+
+  std::vector<Point3D> m_verts;
+  std::vector<Face> m_faces;
+  // What the intersection test needs for each triangle, worked out once:
+  // its first vertex, the edges from it to the other two, and its unit
+  // normal. One array per coordinate, indexed like m_faces.
+  struct Triangles {
+    std::vector<double> v0[3];
+    std::vector<double> e1[3];
+    std::vector<double> e2[3];
+    std::vector<double> normal[3];
+  } m_triangles;
+  BVH m_bvh;
+  BoundingBox m_bounds;
+  SceneNode* m_bound;
+  int m_refs;
+
+  static BVHBuildStats s_buildStats;
+  // Made but not yet built.
+  static std::vector<MeshGeometry*> s_pending;
+
+  friend class Mesh;
+  friend std::ostream& operator<<(std::ostream& out, const Mesh& mesh);
+};
+
+// A polygonal mesh. Rays find its triangles through the BVH in its
+// geometry, which placing the same model several times shares rather
+// than copies.
 class Mesh : public Primitive {
 public:
   Mesh(const std::vector<Point3D>& verts,
-       const std::vector< std::vector<int> >& faces,
-       int depth=0);
+       const std::vector< std::vector<int> >& faces);
+  // Another mesh using the same geometry.
+  Mesh(const Mesh& other);
+  explicit Mesh(MeshGeometry* geometry);
 
   virtual ~Mesh();
 
-  virtual RayResult* findIntersections(const Ray& ray);
+  // Reads an OBJ file, or shares the geometry already read from it. Returns
+  // NULL with a message in error if the file can't be read.
+  static Mesh* load(const std::string& filename, std::string& error);
 
-  typedef std::vector<int> Face;
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const;
+  virtual bool occludes(const Ray& ray, double tMin, double tMax, RayTraceStats& stats) const;
+  virtual int intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const;
+  virtual int occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const;
+  virtual BoundingBox getBounds() const;
 
-  struct FaceComparator {
-    FaceComparator(Axis axis, Mesh* mesh): axis(axis), mesh(mesh) {}
+  typedef MeshGeometry::Face Face;
 
-    bool operator()(const Face& a, const Face& b) {
-      return mesh->m_verts[a[0]][axis] < mesh->m_verts[b[0]][axis];
-    }
+  const MeshGeometry* geometry() const { return m_geometry; }
 
-    Axis axis;
-    Mesh* mesh;
-  };
+  // Totals over every mesh geometry built so far.
+  static const BVHBuildStats& buildStats() { return MeshGeometry::s_buildStats; }
 
 private:
-  std::vector<Point3D> m_verts;
-  std::vector<Face> m_faces;
-  SceneNode* m_bound;
-  SceneNode* m_descendents;
+  // Moller-Trumbore test against triangle index of the geometry.
+  bool intersectTriangle(const Ray& ray, int index, HitRecord& hit) const;
+
+  struct FaceIntersector;
+  friend struct FaceIntersector;
+  struct FaceOccluder;
+  friend struct FaceOccluder;
+  struct FacePacketIntersector;
+  friend struct FacePacketIntersector;
+  struct FacePacketOccluder;
+  friend struct FacePacketOccluder;
+
+  Mesh& operator=(const Mesh& other);
+
+  MeshGeometry* m_geometry;
+
+  // Geometry read by load, by filename.
+  static std::map<std::string, MeshGeometry*> s_loaded;
 
   friend std::ostream& operator<<(std::ostream& out, const Mesh& mesh);
 };
@@ -0,0 +1,183 @@
+#include "objfile.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Walks the mapped file a line at a time. The mapping isn't NUL
+// terminated, so nothing here may read past m_end.
+class ObjParser {
+public:
+  ObjParser(const char* begin, const char* end)
+    : m_pos(begin), m_end(end), m_line(1) {}
+
+  bool parse(std::vector<Point3D>& verts, std::vector< std::vector<int> >& faces, std::string& error) {
+    while (m_pos < m_end) {
+      skipSpace();
+      const char* command = m_pos;
+      while (m_pos < m_end && !isSpace(*m_pos) && *m_pos != '\n') {
+        m_pos++;
+      }
+      const size_t length = m_pos - command;
+
+      if (length == 1 && command[0] == 'v') {
+        double vertex[3];
+        for (int i = 0; i < 3; i++) {
+          if (!readDouble(vertex[i])) {
+            return fail("expected three vertex coordinates", error);
+          }
+        }
+        verts.push_back(Point3D(vertex[0], vertex[1], vertex[2]));
+      } else if (length == 1 && command[0] == 'f') {
+        faces.push_back(std::vector<int>());
+        std::vector<int>& face = faces.back();
+        long index;
+        while (readIndex(index)) {
+          // Negative indices count back from the last vertex so far.
+          if (index < 0) {
+            index += verts.size() + 1;
+          }
+          if (index < 1 || index > (long) verts.size()) {
+            return fail("face refers to a vertex that doesn't exist", error);
+          }
+          face.push_back(index - 1);
+        }
+        // A '#' starts a comment that runs to the end of the line.
+        skipSpace();
+        if (m_pos < m_end && *m_pos != '\n' && *m_pos != '#') {
+          return fail("malformed face index", error);
+        }
+        if (face.size() < 3) {
+          return fail("face has fewer than three vertices", error);
+        }
+      }
+
+      // Anything else (comments, normals, groups...) is ignored.
+      while (m_pos < m_end && *m_pos != '\n') {
+        m_pos++;
+      }
+      if (m_pos < m_end) {
+        m_pos++;
+        m_line++;
+      }
+    }
+    return true;
+  }
+
+private:
+  static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+  }
+
+  void skipSpace() {
+    while (m_pos < m_end && isSpace(*m_pos)) {
+      m_pos++;
+    }
+  }
+
+  // Copies the next whitespace-separated token on this line into buffer,
+  // or returns false if the line has none left. A '#' ends the token, as
+  // it starts a comment.
+  bool readToken(char* buffer, size_t size) {
+    skipSpace();
+    size_t length = 0;
+    while (m_pos < m_end && !isSpace(*m_pos) && *m_pos != '\n' && *m_pos != '#') {
+      if (length + 1 >= size) {
+        return false;
+      }
+      buffer[length++] = *m_pos++;
+    }
+    buffer[length] = '\0';
+    return length > 0;
+  }
+
+  // strtod on a copy of each token, so coordinates round exactly as they
+  // did through Lua's tonumber.
+  bool readDouble(double& value) {
+    char token[64];
+    if (!readToken(token, sizeof(token))) {
+      return false;
+    }
+    char* end;
+    value = strtod(token, &end);
+    return *end == '\0';
+  }
+
+  // Reads the vertex index from a "v", "v/vt", "v//vn" or "v/vt/vn" token.
+  // On failure the line is left at the start of the token, for the caller
+  // to report.
+  bool readIndex(long& index) {
+    skipSpace();
+    const char* start = m_pos;
+    char token[64];
+    if (!readToken(token, sizeof(token))) {
+      return false;
+    }
+    char* end;
+    index = strtol(token, &end, 10);
+    if (end == token || (*end != '\0' && *end != '/') || index == 0) {
+      m_pos = start;
+      return false;
+    }
+    return true;
+  }
+
+  bool fail(const char* message, std::string& error) const {
+    std::ostringstream out;
+    out << "line " << m_line << ": " << message;
+    error = out.str();
+    return false;
+  }
+
+  const char* m_pos;
+  const char* m_end;
+  int m_line;
+};
+
+}
+
+bool read_obj(const std::string& filename,
+              std::vector<Point3D>& verts,
+              std::vector< std::vector<int> >& faces,
+              std::string& error) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error = filename + ": " + strerror(errno);
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    error = filename + ": " + strerror(errno);
+    close(fd);
+    return false;
+  }
+
+  verts.clear();
+  faces.clear();
+  if (info.st_size == 0) {
+    close(fd);
+    return true;
+  }
+
+  void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    error = filename + ": " + strerror(errno);
+    return false;
+  }
+  madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+  const char* begin = (const char*) data;
+  bool ok = ObjParser(begin, begin + info.st_size).parse(verts, faces, error);
+  munmap(data, info.st_size);
+  if (!ok) {
+    error = filename + ", " + error;
+  }
+  return ok;
+}
@@ -0,0 +1,20 @@
+#ifndef CS488_OBJFILE_HPP
+#define CS488_OBJFILE_HPP
+
+#include <string>
+#include <vector>
+#include "algebra.hpp"
+
+// Reads the vertices and faces of an Alias/Wavefront OBJ file, in the form
+// the Mesh constructor takes them (0-based indices). Like readobj.lua, only
+// "v" and "f" lines are used; texture and normal indices in faces
+// ("1/2/3") are skipped, and negative (relative) indices are allowed.
+//
+// The file is memory-mapped and parsed in one pass. Returns false with a
+// message in error if the file can't be read or is malformed.
+bool read_obj(const std::string& filename,
+              std::vector<Point3D>& verts,
+              std::vector< std::vector<int> >& faces,
+              std::string& error);
+
+#endif
@@ -0,0 +1,33 @@
+#include "packet.hpp"
+#include <cmath>
+
+void RayPacket::update() {
+  for (int axis = X; axis <= Z; axis++) {
+    pos[axis] = _mm_setr_ps(rays[0].pos[axis], rays[1].pos[axis], rays[2].pos[axis], rays[3].pos[axis]);
+    dir[axis] = _mm_setr_ps(rays[0].dir[axis], rays[1].dir[axis], rays[2].dir[axis], rays[3].dir[axis]);
+    invDir[axis] = _mm_setr_ps(1.0/rays[0].dir[axis], 1.0/rays[1].dir[axis],
+                               1.0/rays[2].dir[axis], 1.0/rays[3].dir[axis]);
+  }
+}
+
+RayPacket RayPacket::transform(const Matrix4x4& mat, int mask) const {
+  RayPacket result;
+  result.mask = mask;
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    if (mask & (1 << i)) {
+      result.rays[i] = rays[i].transform(mat);
+    }
+  }
+  result.update();
+  return result;
+}
+
+PacketBox::PacketBox(const BoundingBox& box) {
+  for (int axis = X; axis <= Z; axis++) {
+    // Padding relative to the box's size and distance from the origin
+    // covers the rounding of both the box and the rays.
+    double pad = 1e-5 * (box.max[axis] - box.min[axis] + std::abs(box.min[axis]) + std::abs(box.max[axis])) + 1e-6;
+    min[axis] = box.min[axis] - pad;
+    max[axis] = box.max[axis] + pad;
+  }
+}
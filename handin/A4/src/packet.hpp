@@ -0,0 +1,101 @@
+#ifndef CS488_PACKET_HPP
+#define CS488_PACKET_HPP
+
+#include <xmmintrin.h>
+#include <cmath>
+#include <limits>
+#include "algebra.hpp"
+#include "raytracer.hpp"
+
+#ifndef PACKET_TRACING
+#define PACKET_TRACING true
+#endif
+
+#define PACKET_SIZE 4
+
+// Up to four coherent rays (e.g. the anti-aliasing samples of one pixel)
+// traced together. The rays are kept in double precision, and every hit
+// that counts is still found by the single-ray tests; the SSE copies below
+// (one register per coordinate, one lane per ray) are only used to decide
+// in a single pass which boxes and primitives any of the rays could hit.
+// Bit i of mask is set if lane i is in use.
+struct RayPacket {
+  Ray rays[PACKET_SIZE];
+  int mask;
+  __m128 pos[3];
+  __m128 dir[3];
+  __m128 invDir[3];
+
+  RayPacket(): mask(0) {}
+
+  // Refreshes the SSE copies; call after filling in rays.
+  void update();
+
+  // The lanes in mask, transformed by mat.
+  RayPacket transform(const Matrix4x4& mat, int mask) const;
+
+  bool active(int lane) const {
+    return mask & (1 << lane);
+  }
+};
+
+// Single-precision copy of a BoundingBox, rounded outwards so that float
+// error never makes a packet miss a box the double-precision test would
+// have hit.
+struct PacketBox {
+  float min[3];
+  float max[3];
+
+  PacketBox() {}
+  PacketBox(const BoundingBox& box);
+};
+
+inline int lane_count(int mask) {
+  return __builtin_popcount(mask);
+}
+
+// Rounds t up to a float, so culling against it is never stricter than the
+// double-precision test.
+inline float packet_limit(double t) {
+  if (t >= 1e30) {
+    return std::numeric_limits<float>::infinity();
+  }
+  return (float) (t + std::abs(t) * 1e-5);
+}
+
+// Each lane's current closest-hit distance.
+inline __m128 packet_limits(const HitRecord* hits) {
+  return _mm_setr_ps(packet_limit(hits[0].tMax), packet_limit(hits[1].tMax),
+                     packet_limit(hits[2].tMax), packet_limit(hits[3].tMax));
+}
+
+// tMax[i] for the lanes in mask, -inf (so nothing passes) for the rest.
+inline __m128 packet_limits(const double* tMax, int mask) {
+  float limits[PACKET_SIZE];
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    limits[i] = (mask & (1 << i)) ? packet_limit(tMax[i]) : -std::numeric_limits<float>::infinity();
+  }
+  return _mm_loadu_ps(limits);
+}
+
+// Slab test for all lanes at once. Returns the lanes of mask that reach the
+// box before their entry in tMax, and sets tNear to where each lane enters
+// it. Like BoundingBox::intersect, slabs that come out NaN (a ray lying in a
+// face with no motion along that axis) are ignored.
+inline int intersect(const PacketBox& box, const RayPacket& packet, int mask, __m128 tMax, __m128& tNear) {
+  __m128 near = _mm_set1_ps(-std::numeric_limits<float>::max());
+  __m128 far = _mm_set1_ps(std::numeric_limits<float>::max());
+  for (int axis = X; axis <= Z; axis++) {
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min[axis]), packet.pos[axis]), packet.invDir[axis]);
+    __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max[axis]), packet.pos[axis]), packet.invDir[axis]);
+    // SSE min/max return their second operand if either is NaN.
+    near = _mm_max_ps(_mm_min_ps(t1, t2), near);
+    far = _mm_min_ps(_mm_max_ps(t1, t2), far);
+  }
+  tNear = near;
+  __m128 hit = _mm_and_ps(_mm_cmple_ps(near, far),
+                          _mm_and_ps(_mm_cmpge_ps(far, _mm_setzero_ps()), _mm_cmplt_ps(near, tMax)));
+  return _mm_movemask_ps(hit) & mask;
+}
+
+#endif
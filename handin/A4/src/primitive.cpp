@@ -1,12 +1,61 @@
 #include "primitive.hpp"
 #include "polyroots.hpp"
+#include <algorithm>
 #include <limits>
-#include <vector>
 
 // TODO
 #include <iostream>
 
-RayResult* NonhierSphere::findIntersections(const Ray& ray) {
+// Runs P's single-ray query for the lanes in candidates. The call is
+// qualified, so it goes straight to P's method instead of through the
+// vtable once per lane.
+template<typename P>
+static int intersect_lanes(const P& primitive, const RayPacket& packet, int candidates, HitRecord* hits, RayTraceStats& stats) {
+  int found = 0;
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    if ((candidates & (1 << i)) && primitive.P::intersect(packet.rays[i], hits[i], stats)) {
+      found |= 1 << i;
+    }
+  }
+  return found;
+}
+
+// Any-hit version of the above, for primitives that answer it with their
+// closest-hit query (as Primitive::occludes does).
+template<typename P>
+static int occludes_lanes(const P& primitive, const RayPacket& packet, int candidates, double tMin, const double* tMax, RayTraceStats& stats) {
+  int found = 0;
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    HitRecord hit(tMin, tMax[i]);
+    if ((candidates & (1 << i)) && primitive.P::intersect(packet.rays[i], hit, stats)) {
+      found |= 1 << i;
+    }
+  }
+  return found;
+}
+
+int Primitive::intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const {
+  int found = 0;
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    if (packet.active(i) && intersect(packet.rays[i], hits[i], stats)) {
+      found |= 1 << i;
+    }
+  }
+  return found;
+}
+
+int Primitive::occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const {
+  int found = 0;
+  for (int i = 0; i < PACKET_SIZE; i++) {
+    if (packet.active(i) && occludes(packet.rays[i], tMin, tMax[i], stats)) {
+      found |= 1 << i;
+    }
+  }
+  return found;
+}
+
+bool NonhierSphere::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const {
+  stats.intersection_checks++;
 
   // Will use quadratic solver.
   double A = ray.dir.length2();
@@ -18,30 +67,70 @@ RayResult* NonhierSphere::findIntersections(const Ray& ray) {
   double roots[2];
   size_t num_roots = quadraticRoots(A, B, C, roots);
 
-  std::vector<Intersection> intersections;
-
   const double EPSILON = 0.01;
-  if (num_roots > 0) {
-    double t = roots[0];
-    if (num_roots == 2 && roots[1] > EPSILON && roots[1] < t) {
-      t = roots[1];
-    }
-    if (t > EPSILON) {
-      const Point3D p = ray.pos + t*ray.dir;
-      Vector3D normal = p - m_pos;
-      normal.normalize();
-      //std::cout << "INTERSECTION for ray " << ray << " with params " << t << ", " << p << std::endl;
-      intersections.push_back(Intersection(
-        p, normal, NULL
-      ));
+  bool found = false;
+  double t = 0.0;
+  for (size_t i = 0; i < num_roots; i++) {
+    if (roots[i] > EPSILON && hit.accepts(roots[i]) && (!found || roots[i] < t)) {
+      t = roots[i];
+      found = true;
     }
   }
+  if (!found) {
+    return false;
+  }
+
+  const Point3D p = ray.pos + t*ray.dir;
+  Vector3D normal = p - m_pos;
+  normal.normalize();
+  hit.record(t, p, normal);
+  return true;
+}
+
+int NonhierSphere::packetCandidates(const RayPacket& packet, RayTraceStats& stats) const {
+  // The discriminant of the same quadratic, in single precision. It is
+  // allowed to come out slightly negative, since rounding can cancel most of
+  // C when the ray starts near the surface.
+  __m128 oc[3];
+  for (int axis = X; axis <= Z; axis++) {
+    oc[axis] = _mm_sub_ps(packet.pos[axis], _mm_set1_ps(m_pos[axis]));
+  }
+  __m128 A = _mm_setzero_ps();
+  __m128 halfB = _mm_setzero_ps();
+  __m128 ocLength2 = _mm_setzero_ps();
+  for (int axis = X; axis <= Z; axis++) {
+    A = _mm_add_ps(A, _mm_mul_ps(packet.dir[axis], packet.dir[axis]));
+    halfB = _mm_add_ps(halfB, _mm_mul_ps(packet.dir[axis], oc[axis]));
+    ocLength2 = _mm_add_ps(ocLength2, _mm_mul_ps(oc[axis], oc[axis]));
+  }
+  const __m128 radius2 = _mm_set1_ps(m_radius * m_radius);
+  __m128 C = _mm_sub_ps(ocLength2, radius2);
+  __m128 disc = _mm_sub_ps(_mm_mul_ps(halfB, halfB), _mm_mul_ps(A, C));
+  __m128 tolerance = _mm_mul_ps(_mm_set1_ps(1e-4f),
+                                _mm_add_ps(_mm_mul_ps(halfB, halfB), _mm_mul_ps(A, _mm_add_ps(ocLength2, radius2))));
 
-  return new RayResult(intersections, 1);
+  int candidates = _mm_movemask_ps(_mm_cmpge_ps(_mm_add_ps(disc, tolerance), _mm_setzero_ps())) & packet.mask;
+  // Lanes rejected here count as the one check the single-ray test would
+  // have made; the rest are counted by it.
+  stats.intersection_checks += lane_count(packet.mask & ~candidates);
+  return candidates;
 }
 
-RayResult* NonhierBox::findIntersections(const Ray& ray) {
-  std::vector<Intersection> intersections;
+int NonhierSphere::intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const {
+  return intersect_lanes(*this, packet, packetCandidates(packet, stats), hits, stats);
+}
+
+int NonhierSphere::occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const {
+  return occludes_lanes(*this, packet, packetCandidates(packet, stats), tMin, tMax, stats);
+}
+
+BoundingBox NonhierSphere::getBounds() const {
+  Vector3D extent(m_radius, m_radius, m_radius);
+  return BoundingBox(m_pos - extent, m_pos + extent);
+}
+
+bool NonhierBox::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const {
+  stats.intersection_checks += 6;
   const double EPSILON = 0.01;
 
   // Derived from Kay and Kayjia's slab method for ray-box intersection.
@@ -58,7 +147,7 @@ RayResult* NonhierBox::findIntersections(const Ray& ray) {
     //std::cout << "nearAxisSign = " << nearAxisSign << " = " << ray.pos[axis] << " - " << m_pos[axis] << std::endl;
     if (ray.dir[axis] == 0.0) {
       if (ray.pos[axis] < low || ray.pos[axis] > high) {
-        return new RayResult(intersections, 6);
+        return false;
       }
     } else {
       double t1 = (low - ray.pos[axis]) / ray.dir[axis];
@@ -82,18 +171,199 @@ RayResult* NonhierBox::findIntersections(const Ray& ray) {
         tFar = t2;
       }
       if (tNear > tFar || tFar < 0) {
-        return new RayResult(intersections, 6);
+        return false;
       }
     }
   }
 
-  if (tNear > EPSILON) {
+  if (tNear > EPSILON && hit.accepts(tNear)) {
     //std::cout << "N!! " << nearNormal << std::endl;
-    intersections.push_back(Intersection(ray.pos + tNear*ray.dir, nearNormal, NULL));
+    hit.record(tNear, ray.pos + tNear*ray.dir, nearNormal);
+    return true;
+  }
+  if (tFar > EPSILON && hit.accepts(tFar)) {
+    hit.record(tFar, ray.pos + tFar*ray.dir, -nearNormal);
+    return true;
+  }
+  return false;
+}
+
+int NonhierBox::packetCandidates(const RayPacket& packet, RayTraceStats& stats) const {
+  __m128 tNear;
+  int candidates = ::intersect(m_packetBox, packet, packet.mask, _mm_set1_ps(std::numeric_limits<float>::infinity()), tNear);
+  stats.intersection_checks += 6 * lane_count(packet.mask & ~candidates);
+  return candidates;
+}
+
+int NonhierBox::intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const {
+  return intersect_lanes(*this, packet, packetCandidates(packet, stats), hits, stats);
+}
+
+int NonhierBox::occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const {
+  return occludes_lanes(*this, packet, packetCandidates(packet, stats), tMin, tMax, stats);
+}
+
+BoundingBox NonhierBox::getBounds() const {
+  return BoundingBox(m_pos, m_pos + Vector3D(m_size, m_size, m_size));
+}
+
+namespace {
+
+// The closest acceptable hit among several surfaces of one primitive.
+struct ClosestHit {
+  const HitRecord& hit;
+  bool found;
+  double t;
+  Vector3D normal;
+
+  explicit ClosestHit(const HitRecord& hit): hit(hit), found(false), t(0.0) {}
+
+  void consider(double candidate, const Vector3D& candidateNormal) {
+    // Same self-intersection margin as the sphere and box.
+    const double EPSILON = 0.01;
+    if (candidate > EPSILON && hit.accepts(candidate) && (!found || candidate < t)) {
+      found = true;
+      t = candidate;
+      normal = candidateNormal;
+    }
+  }
+
+  bool record(const Ray& ray, HitRecord& target) const {
+    if (found) {
+      target.record(t, ray.pos + t*ray.dir, normal);
+    }
+    return found;
+  }
+};
+
+// Hits on the cap of radius 1 in the plane y = height.
+void intersect_cap(const Ray& ray, double height, ClosestHit& closest) {
+  if (ray.dir[Y] == 0.0) {
+    return;
+  }
+  const double t = (height - ray.pos[Y]) / ray.dir[Y];
+  const double x = ray.pos[X] + t*ray.dir[X];
+  const double z = ray.pos[Z] + t*ray.dir[Z];
+  if (x*x + z*z <= 1.0) {
+    closest.consider(t, Vector3D(0.0, height < 0.0 ? -1.0 : 1.0, 0.0));
+  }
+}
+
+}
+
+template<typename Shape>
+int BoundedPrimitive<Shape>::packetCandidates(const RayPacket& packet, RayTraceStats& stats) const {
+  __m128 tNear;
+  int candidates = ::intersect(m_packetBox, packet, packet.mask, _mm_set1_ps(std::numeric_limits<float>::infinity()), tNear);
+  stats.intersection_checks += lane_count(packet.mask & ~candidates);
+  return candidates;
+}
+
+template<typename Shape>
+int BoundedPrimitive<Shape>::intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const {
+  return intersect_lanes(static_cast<const Shape&>(*this), packet, packetCandidates(packet, stats), hits, stats);
+}
+
+template<typename Shape>
+int BoundedPrimitive<Shape>::occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const {
+  return occludes_lanes(static_cast<const Shape&>(*this), packet, packetCandidates(packet, stats), tMin, tMax, stats);
+}
+
+template class BoundedPrimitive<Cylinder>;
+template class BoundedPrimitive<Cone>;
+template class BoundedPrimitive<Disc>;
+template class BoundedPrimitive<Torus>;
+
+bool Cylinder::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const {
+  stats.intersection_checks += 3;
+  ClosestHit closest(hit);
+
+  // The side, x^2 + z^2 = 1, between the caps.
+  const double A = ray.dir[X]*ray.dir[X] + ray.dir[Z]*ray.dir[Z];
+  const double B = 2 * (ray.pos[X]*ray.dir[X] + ray.pos[Z]*ray.dir[Z]);
+  const double C = ray.pos[X]*ray.pos[X] + ray.pos[Z]*ray.pos[Z] - 1.0;
+  double roots[2];
+  const size_t num_roots = A != 0.0 ? quadraticRoots(A, B, C, roots) : 0;
+  for (size_t i = 0; i < num_roots; i++) {
+    const Point3D p = ray.pos + roots[i]*ray.dir;
+    if (p[Y] >= -1.0 && p[Y] <= 1.0) {
+      closest.consider(roots[i], Vector3D(p[X], 0.0, p[Z]));
+    }
   }
-  if (tFar > EPSILON) {
-    intersections.push_back(Intersection(ray.pos + tFar*ray.dir, -nearNormal, NULL));
+
+  intersect_cap(ray, -1.0, closest);
+  intersect_cap(ray, 1.0, closest);
+  return closest.record(ray, hit);
+}
+
+bool Cone::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const {
+  stats.intersection_checks += 2;
+  ClosestHit closest(hit);
+
+  // The side, x^2 + z^2 = ((1 - y) / 2)^2, for y in [-1, 1].
+  const double h = 1.0 - ray.pos[Y];
+  const double A = ray.dir[X]*ray.dir[X] + ray.dir[Z]*ray.dir[Z] - 0.25*ray.dir[Y]*ray.dir[Y];
+  const double B = 2 * (ray.pos[X]*ray.dir[X] + ray.pos[Z]*ray.dir[Z]) + 0.5*h*ray.dir[Y];
+  const double C = ray.pos[X]*ray.pos[X] + ray.pos[Z]*ray.pos[Z] - 0.25*h*h;
+  double roots[2];
+  const size_t num_roots = quadraticRoots(A, B, C, roots);
+  for (size_t i = 0; i < num_roots; i++) {
+    const Point3D p = ray.pos + roots[i]*ray.dir;
+    if (p[Y] >= -1.0 && p[Y] <= 1.0) {
+      closest.consider(roots[i], Vector3D(p[X], 0.25 * (1.0 - p[Y]), p[Z]));
+    }
   }
-  return new RayResult(intersections, 6);
+
+  intersect_cap(ray, -1.0, closest);
+  return closest.record(ray, hit);
 }
 
+bool Disc::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const {
+  stats.intersection_checks++;
+  ClosestHit closest(hit);
+  intersect_cap(ray, 0.0, closest);
+  if (!closest.record(ray, hit)) {
+    return false;
+  }
+  // Face back toward the ray.
+  hit.normal = Vector3D(0.0, ray.dir[Y] > 0.0 ? -1.0 : 1.0, 0.0);
+  return true;
+}
+
+bool Torus::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const {
+  stats.intersection_checks++;
+
+  // The quartic is only solved where the ray is inside the bounds. Solving
+  // from where the ray enters them also keeps the coefficients small, which
+  // matters for rays from far away.
+  double tNear, tFar;
+  if (!m_bounds.intersect(ray, reciprocal(ray.dir), tNear, tFar)) {
+    return false;
+  }
+  const double tStart = std::max(tNear, 0.0);
+  if (tStart >= hit.tMax) {
+    return false;
+  }
+  const Point3D o = ray.pos + tStart*ray.dir;
+  const Vector3D& d = ray.dir;
+
+  // (|p|^2 + 1 - tube^2)^2 = 4(x^2 + z^2), with p = o + t d.
+  const double G = d.dot(d);
+  const double H = 2 * (o[X]*d[X] + o[Y]*d[Y] + o[Z]*d[Z]);
+  const double I = o[X]*o[X] + o[Y]*o[Y] + o[Z]*o[Z] + 1.0 - m_tube*m_tube;
+  const double a = 2*G*H;
+  const double b = H*H + 2*G*I - 4*(d[X]*d[X] + d[Z]*d[Z]);
+  const double c = 2*H*I - 8*(o[X]*d[X] + o[Z]*d[Z]);
+  const double e = I*I - 4*(o[X]*o[X] + o[Z]*o[Z]);
+  double roots[4];
+  const size_t num_roots = quarticRoots(a / (G*G), b / (G*G), c / (G*G), e / (G*G), roots);
+
+  ClosestHit closest(hit);
+  for (size_t i = 0; i < num_roots; i++) {
+    const double t = tStart + roots[i];
+    const Point3D p = ray.pos + t*ray.dir;
+    const double k = p[X]*p[X] + p[Y]*p[Y] + p[Z]*p[Z] + 1.0 - m_tube*m_tube;
+    closest.consider(t, Vector3D(p[X] * (k - 2.0), p[Y] * k, p[Z] * (k - 2.0)));
+  }
+  return closest.record(ray, hit);
+}
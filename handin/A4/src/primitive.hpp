@@ -4,12 +4,33 @@
 #include <vector>
 #include "algebra.hpp"
 #include "raytracer.hpp"
+#include "packet.hpp"
 
 class Primitive {
 public:
   virtual ~Primitive() {}
 
-  virtual RayResult* findIntersections(const Ray& ray) = 0;
+  // Closest-hit query: if the ray hits the primitive inside the record's
+  // interval, fills in the record (in the primitive's coordinate system,
+  // leaving the material alone) and returns true.
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const = 0;
+
+  // Any-hit query: true if the ray hits the primitive anywhere strictly
+  // inside (tMin, tMax). Shadow rays only need to know that something is in
+  // the way, not what is closest.
+  virtual bool occludes(const Ray& ray, double tMin, double tMax, RayTraceStats& stats) const {
+    HitRecord hit(tMin, tMax);
+    return intersect(ray, hit, stats);
+  }
+
+  // Packet versions of the above, for the lanes in packet.mask (hits[i] and
+  // tMax[i] belong to lane i). Both return the mask of lanes that hit. By
+  // default each lane runs the single-ray query.
+  virtual int intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const;
+  virtual int occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const;
+
+  // Bounds of the primitive in its own coordinate system.
+  virtual BoundingBox getBounds() const = 0;
 };
 
 class NonhierSphere : public Primitive {
@@ -19,9 +40,19 @@ public:
   }
   virtual ~NonhierSphere() {}
 
-  virtual RayResult* findIntersections(const Ray& ray);
+  const Point3D& position() const { return m_pos; }
+  double radius() const { return m_radius; }
+
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const;
+  virtual int intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const;
+  virtual int occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const;
+  virtual BoundingBox getBounds() const;
 
 private:
+  // Lanes of the packet whose line comes near enough to the sphere that the
+  // single-ray test could find a hit.
+  int packetCandidates(const RayPacket& packet, RayTraceStats& stats) const;
+
   Point3D m_pos;
   double m_radius;
 };
@@ -29,16 +60,98 @@ private:
 class NonhierBox : public Primitive {
 public:
   NonhierBox(const Point3D& pos, double size)
-    : m_pos(pos), m_size(size) {
+    : m_pos(pos), m_size(size), m_packetBox(BoundingBox(pos, pos + Vector3D(size, size, size))) {
   }
 
   virtual ~NonhierBox() {}
 
-  virtual RayResult* findIntersections(const Ray& ray);
+  const Point3D& position() const { return m_pos; }
+  double size() const { return m_size; }
+
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const;
+  virtual int intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const;
+  virtual int occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const;
+  virtual BoundingBox getBounds() const;
 
 private:
+  // Lanes of the packet that pass through the box at all.
+  int packetCandidates(const RayPacket& packet, RayTraceStats& stats) const;
+
   Point3D m_pos;
   double m_size;
+  PacketBox m_packetBox;
+};
+
+// Base for the analytic primitives below, which all sit in [-1, 1] on each
+// axis (give or take the torus tube). Packets are culled against the
+// primitive's bounding box before any lane runs Shape's exact test.
+template<typename Shape>
+class BoundedPrimitive : public Primitive {
+public:
+  virtual ~BoundedPrimitive() {}
+
+  virtual int intersectPacket(const RayPacket& packet, HitRecord* hits, RayTraceStats& stats) const;
+  virtual int occludesPacket(const RayPacket& packet, double tMin, const double* tMax, RayTraceStats& stats) const;
+  virtual BoundingBox getBounds() const {
+    return m_bounds;
+  }
+
+protected:
+  explicit BoundedPrimitive(const BoundingBox& bounds)
+    : m_bounds(bounds), m_packetBox(bounds) {}
+
+  BoundingBox m_bounds;
+
+private:
+  // Lanes of the packet that pass through the bounding box.
+  int packetCandidates(const RayPacket& packet, RayTraceStats& stats) const;
+
+  PacketBox m_packetBox;
+};
+
+// Radius 1 around the y axis, from y = -1 to 1, with both ends capped.
+class Cylinder : public BoundedPrimitive<Cylinder> {
+public:
+  Cylinder(): BoundedPrimitive<Cylinder>(BoundingBox(Point3D(-1, -1, -1), Point3D(1, 1, 1))) {}
+  virtual ~Cylinder() {}
+
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const;
+};
+
+// Around the y axis, narrowing from a capped base of radius 1 at y = -1 to
+// a point at y = 1.
+class Cone : public BoundedPrimitive<Cone> {
+public:
+  Cone(): BoundedPrimitive<Cone>(BoundingBox(Point3D(-1, -1, -1), Point3D(1, 1, 1))) {}
+  virtual ~Cone() {}
+
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const;
+};
+
+// Radius 1 in the y = 0 plane, facing whichever side the ray comes from.
+class Disc : public BoundedPrimitive<Disc> {
+public:
+  Disc(): BoundedPrimitive<Disc>(BoundingBox(Point3D(-1, 0, -1), Point3D(1, 0, 1))) {}
+  virtual ~Disc() {}
+
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const;
+};
+
+// A tube of radius tube swept around the circle of radius 1 about the y
+// axis in the y = 0 plane.
+class Torus : public BoundedPrimitive<Torus> {
+public:
+  explicit Torus(double tube)
+    : BoundedPrimitive<Torus>(BoundingBox(Point3D(-1 - tube, -tube, -1 - tube), Point3D(1 + tube, tube, 1 + tube))),
+      m_tube(tube) {}
+  virtual ~Torus() {}
+
+  double tube() const { return m_tube; }
+
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) const;
+
+private:
+  double m_tube;
 };
 
 class Sphere : public NonhierSphere {
@@ -0,0 +1,181 @@
+#include "profile.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sys/resource.h>
+#include "image.hpp"
+
+RenderProfile::RenderProfile(int width, int height, int threads)
+  : scene_load_seconds(0.0), scene_build_seconds(0.0),
+    primary_pass_seconds(0.0), refine_pass_seconds(0.0), output_seconds(0.0),
+    m_width(width), m_height(height),
+    m_columns((width + TILE_SIZE - 1) / TILE_SIZE), m_rows((height + TILE_SIZE - 1) / TILE_SIZE),
+    m_threads(threads), m_cellSeconds(m_columns * m_rows, 0.0) {
+  pthread_mutex_init(&m_cellMutex, NULL);
+}
+
+RenderProfile::~RenderProfile() {
+  pthread_mutex_destroy(&m_cellMutex);
+}
+
+void RenderProfile::addTile(int thread, const Tile& tile, double seconds) {
+  ThreadProfile& profile = m_threads[thread];
+  profile.tiles++;
+  profile.busy_seconds += seconds;
+
+  // Tiles line up with the cells unless the render is streamed in bands,
+  // so usually this is a single cell.
+  const double area = (double) (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+  pthread_mutex_lock(&m_cellMutex);
+  for (int row = tile.y0 / TILE_SIZE; row * TILE_SIZE < tile.y1; row++) {
+    const int overlapY = std::min(tile.y1, (row + 1) * TILE_SIZE) - std::max(tile.y0, row * TILE_SIZE);
+    for (int column = tile.x0 / TILE_SIZE; column * TILE_SIZE < tile.x1; column++) {
+      const int overlapX = std::min(tile.x1, (column + 1) * TILE_SIZE) - std::max(tile.x0, column * TILE_SIZE);
+      m_cellSeconds[row * m_columns + column] += seconds * overlapX * overlapY / area;
+    }
+  }
+  pthread_mutex_unlock(&m_cellMutex);
+}
+
+RayTraceStats RenderProfile::totals() const {
+  RayTraceStats stats;
+  for (std::vector<ThreadProfile>::const_iterator it = m_threads.begin(); it != m_threads.end(); it++) {
+    stats.merge(it->stats);
+  }
+  return stats;
+}
+
+double RenderProfile::raysPerSecond() const {
+  return renderSeconds() > 0.0 ? totals().rays() / renderSeconds() : 0.0;
+}
+
+bool RenderProfile::saveHeatmap(const std::string& filename) const {
+  const std::vector<double>& cells = m_cellSeconds;
+  double maxSeconds = 0.0;
+  for (size_t i = 0; i < cells.size(); i++) {
+    maxSeconds = std::max(maxSeconds, cells[i]);
+  }
+
+  // One row of cells at a time, so this is cheap even for streamed renders.
+  ImageRowWriter writer(filename, m_width, m_height);
+  if (!writer.ok()) {
+    return false;
+  }
+  Image band(m_width, TILE_SIZE, 3);
+  for (int row = 0; row < m_rows; row++) {
+    const int rows = std::min(TILE_SIZE, m_height - row * TILE_SIZE);
+    for (int x = 0; x < m_width; x++) {
+      const double heat = maxSeconds > 0.0 ? 3.0 * cells[row * m_columns + x / TILE_SIZE] / maxSeconds : 0.0;
+      const double channels[3] = {
+        std::min(1.0, heat),
+        std::min(1.0, std::max(0.0, heat - 1.0)),
+        std::min(1.0, std::max(0.0, heat - 2.0))
+      };
+      for (int y = 0; y < rows; y++) {
+        for (int c = 0; c < 3; c++) {
+          band(x, y, c) = channels[c];
+        }
+      }
+    }
+    writer.writeRows(band, 0, rows);
+  }
+  writer.close();
+  return true;
+}
+
+// Quotes s as a JSON string.
+static std::string json_string(const std::string& s) {
+  std::string quoted = "\"";
+  for (std::string::const_iterator it = s.begin(); it != s.end(); it++) {
+    if (*it == '"' || *it == '\\') {
+      quoted += '\\';
+    }
+    quoted += *it;
+  }
+  return quoted + "\"";
+}
+
+static void write_ray_stats(std::ostream& out, const RayTraceStats& stats, double busySeconds, const std::string& indent) {
+  out << indent << "\"rays\": {\"primary\": " << stats.primary_rays
+      << ", \"shadow\": " << stats.shadow_rays
+      << ", \"reflection\": " << stats.reflection_rays
+      << ", \"total\": " << stats.rays() << "}," << std::endl;
+  // Thread seconds; "shading" is whatever the tiles spent outside scene
+  // queries (shading, sampling, bookkeeping). Only the total is known
+  // without RAY_TIMERS.
+  out << indent << "\"thread_seconds\": {";
+  if (PhaseTimer::enabled()) {
+    out << "\"primary\": " << stats.primary_seconds
+        << ", \"shadow\": " << stats.shadow_seconds
+        << ", \"reflection\": " << stats.reflection_seconds
+        << ", \"shading\": " << std::max(0.0, busySeconds - stats.primary_seconds - stats.shadow_seconds - stats.reflection_seconds)
+        << ", ";
+  }
+  out << "\"total\": " << busySeconds << "}," << std::endl;
+  out << indent << "\"intersection_checks\": " << stats.intersection_checks << "," << std::endl;
+  out << indent << "\"bounding_box_checks\": " << stats.bounding_box_checks << "," << std::endl;
+  out << indent << "\"bounding_box_hits\": " << stats.bounding_box_hits << "," << std::endl;
+  out << indent << "\"shadow_cache\": {\"tests\": " << stats.shadow_cache_tests
+      << ", \"hits\": " << stats.shadow_cache_hits << "}";
+}
+
+bool RenderProfile::saveReport(const std::string& filename, const std::string& image, long samples,
+                               const BVHBuildStats& meshes) const {
+  std::ofstream out(filename.c_str());
+  if (!out) {
+    return false;
+  }
+  out.precision(9);
+
+  double busySeconds = 0.0;
+  for (std::vector<ThreadProfile>::const_iterator it = m_threads.begin(); it != m_threads.end(); it++) {
+    busySeconds += it->busy_seconds;
+  }
+
+  out << "{" << std::endl;
+  out << "  \"image\": " << json_string(image) << "," << std::endl;
+  out << "  \"width\": " << m_width << "," << std::endl;
+  out << "  \"height\": " << m_height << "," << std::endl;
+  out << "  \"samples\": " << samples << "," << std::endl;
+  out << "  \"samples_per_pixel\": " << (double) samples / ((double) m_width * m_height) << "," << std::endl;
+  out << "  \"seconds\": {\"scene_load\": " << scene_load_seconds
+      << ", \"scene_bvh_build\": " << scene_build_seconds
+      << ", \"mesh_bvh_build\": " << meshes.seconds
+      << ", \"primary_pass\": " << primary_pass_seconds
+      << ", \"refine_pass\": " << refine_pass_seconds
+      << ", \"output\": " << output_seconds << "}," << std::endl;
+  out << "  \"rays_per_second\": " << raysPerSecond() << "," << std::endl;
+  // Peak resident memory of the whole process so far.
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  out << "  \"max_rss_kb\": " << usage.ru_maxrss << "," << std::endl;
+  out << "  \"mesh_bvhs\": {\"structures\": " << meshes.structures
+      << ", \"primitives\": " << meshes.primitives
+      << ", \"nodes\": " << meshes.nodes << "}," << std::endl;
+  write_ray_stats(out, totals(), busySeconds, "  ");
+  out << "," << std::endl;
+
+  out << "  \"threads\": [" << std::endl;
+  for (size_t i = 0; i < m_threads.size(); i++) {
+    const ThreadProfile& thread = m_threads[i];
+    out << "    {" << std::endl;
+    out << "      \"tiles\": " << thread.tiles << "," << std::endl;
+    write_ray_stats(out, thread.stats, thread.busy_seconds, "      ");
+    out << std::endl << "    }" << (i + 1 < m_threads.size() ? "," : "") << std::endl;
+  }
+  out << "  ]," << std::endl;
+
+  // Row-major thread seconds per cell, the numbers behind the heatmap.
+  const std::vector<double>& cells = m_cellSeconds;
+  out << "  \"tiles\": {\"size\": " << TILE_SIZE << ", \"columns\": " << m_columns
+      << ", \"rows\": " << m_rows << ", \"seconds\": [" << std::endl;
+  for (int row = 0; row < m_rows; row++) {
+    out << "    [";
+    for (int column = 0; column < m_columns; column++) {
+      out << (column > 0 ? ", " : "") << cells[row * m_columns + column];
+    }
+    out << "]" << (row + 1 < m_rows ? "," : "") << std::endl;
+  }
+  out << "  ]}" << std::endl;
+  out << "}" << std::endl;
+  return out.good();
+}
@@ -0,0 +1,75 @@
+#ifndef CS488_PROFILE_HPP
+#define CS488_PROFILE_HPP
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "raytracer.hpp"
+#include "workmanager.hpp"
+
+// What one render thread did over every pass. Each thread only touches its
+// own, so none of it needs locking.
+struct ThreadProfile {
+  RayTraceStats stats;
+  long tiles;
+  double busy_seconds; // Time spent inside tiles.
+
+  ThreadProfile(): tiles(0), busy_seconds(0.0) {}
+};
+
+// Where a render's time went: wall-clock time for each phase, and thread
+// time per thread and per TILE_SIZE square of the image. Saved as a JSON
+// report and a heatmap beside the image. The per-square times are kept in
+// one grid shared by every thread, so they take the same memory however
+// many threads render.
+class RenderProfile {
+public:
+  RenderProfile(int width, int height, int threads);
+  ~RenderProfile();
+
+  ThreadProfile& thread(int i) {
+    return m_threads[i];
+  }
+
+  // Counts seconds spent on tile by the given thread, spread over the
+  // heatmap cells it covers. Safe to call from any thread.
+  void addTile(int thread, const Tile& tile, double seconds);
+
+  // Wall-clock seconds for each phase.
+  double scene_load_seconds; // Running the scene script, less mesh BVH builds.
+  double scene_build_seconds; // Building the scene BVH.
+  double primary_pass_seconds;
+  double refine_pass_seconds;
+  double output_seconds; // Writing the image out.
+
+  // Every thread's stats together.
+  RayTraceStats totals() const;
+
+  double renderSeconds() const {
+    return primary_pass_seconds + refine_pass_seconds;
+  }
+
+  // Rays of all kinds cast per second of primary and refine passes.
+  double raysPerSecond() const;
+
+  // An image the size of the render, each TILE_SIZE square coloured by its
+  // cost from black (cheapest) through red and yellow to white.
+  bool saveHeatmap(const std::string& filename) const;
+
+  // Everything above, the image's size and sample count, and the mesh BVH
+  // build totals, as JSON.
+  bool saveReport(const std::string& filename, const std::string& image, long samples,
+                  const BVHBuildStats& meshes) const;
+
+private:
+  int m_width, m_height;
+  int m_columns, m_rows;
+  std::vector<ThreadProfile> m_threads;
+  // Thread time in each cell, summed over threads. Streamed bands don't
+  // always line up with the cells, so two threads can share one; the mutex
+  // guards the additions.
+  std::vector<double> m_cellSeconds;
+  pthread_mutex_t m_cellMutex;
+};
+
+#endif
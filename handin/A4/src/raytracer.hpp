@@ -2,14 +2,39 @@
 #define RAYTRACER_H
 
 #include <iostream>
+#include <limits>
 #include <list>
 #include <vector>
+#include <sys/time.h>
+#include <time.h>
 #include "algebra.hpp"
 #include "material.hpp"
 #include "light.hpp"
 
 class Material;
 
+// Mesh hits closer than this to the ray origin are taken to be the surface
+// the ray just left. Hit points in single precision are far rougher, so
+// that build needs a wider margin.
+#ifdef SINGLE_PRECISION
+#define MESH_EPSILON 1e-3
+#else
+#define MESH_EPSILON 1e-7
+#endif
+
+// Time every phase and tile, and write a report of where the render went
+// beside the image.
+#ifndef RENDER_PROFILE
+#define RENDER_PROFILE true
+#endif
+
+// Also time each scene query by the kind of ray, to split the report's
+// thread time between tracing and shading. Off by default, since it reads
+// the clock twice around every ray or packet.
+#ifndef RAY_TIMERS
+#define RAY_TIMERS false
+#endif
+
 enum Axis {
   X = 0,
   Y = 1,
@@ -21,6 +46,7 @@ struct Ray {
   Point3D pos;
   Vector3D dir;
 
+  Ray() {}
   Ray(const Point3D& pos, const Vector3D& dir)
     : pos(pos), dir(dir) {}
 
@@ -34,27 +60,129 @@ inline std::ostream& operator <<(std::ostream& os, const Ray& ray) {
   return os << "ray<" << ray.pos << " + t* " << ray.dir << ">";
 }
 
+// Axis-aligned bounding box. A default-constructed box is empty and grows to
+// fit whatever is added to it.
+struct BoundingBox {
+  Point3D min;
+  Point3D max;
+
+  BoundingBox()
+    : min(std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max()),
+      max(-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max()) {}
+  BoundingBox(const Point3D& min, const Point3D& max)
+    : min(min), max(max) {}
+
+  bool isEmpty() const {
+    return min[X] > max[X] || min[Y] > max[Y] || min[Z] > max[Z];
+  }
+
+  void expand(const Point3D& p) {
+    for (int axis = X; axis <= Z; axis++) {
+      min[axis] = std::min(min[axis], p[axis]);
+      max[axis] = std::max(max[axis], p[axis]);
+    }
+  }
+
+  void expand(const BoundingBox& other) {
+    expand(other.min);
+    expand(other.max);
+  }
+
+  Point3D centroid() const {
+    return Point3D(0.5*(min[X] + max[X]), 0.5*(min[Y] + max[Y]), 0.5*(min[Z] + max[Z]));
+  }
+
+  double surfaceArea() const {
+    if (isEmpty()) {
+      return 0.0;
+    }
+    Vector3D d = max - min;
+    return 2.0 * (d[X]*d[Y] + d[Y]*d[Z] + d[Z]*d[X]);
+  }
+
+  // Bounds of the eight transformed corners.
+  BoundingBox transform(const Matrix4x4& mat) const {
+    BoundingBox result;
+    for (int corner = 0; corner < 8; corner++) {
+      result.expand(mat * Point3D(
+        (corner & 1) ? max[X] : min[X],
+        (corner & 2) ? max[Y] : min[Y],
+        (corner & 4) ? max[Z] : min[Z]
+      ));
+    }
+    return result;
+  }
+
+  // Kay and Kajiya slab test; invDir holds the reciprocal of each ray
+  // direction component. On a hit, [tNear, tFar] is the overlap with the box.
+  bool intersect(const Ray& ray, const Vector3D& invDir, double& tNear, double& tFar) const {
+    tNear = -std::numeric_limits<double>::max();
+    tFar = std::numeric_limits<double>::max();
+    for (int axis = X; axis <= Z; axis++) {
+      double t1 = (min[axis] - ray.pos[axis]) * invDir[axis];
+      double t2 = (max[axis] - ray.pos[axis]) * invDir[axis];
+      if (t1 > t2) {
+        std::swap(t1, t2);
+      }
+      tNear = std::max(tNear, t1);
+      tFar = std::min(tFar, t2);
+    }
+    return tNear <= tFar && tFar >= 0;
+  }
+};
+
+inline Vector3D reciprocal(const Vector3D& v) {
+  return Vector3D(1.0/v[X], 1.0/v[Y], 1.0/v[Z]);
+}
+
+
+class LightBVH;
 
 struct Lighting {
   Colour ambient;
   std::list<Light*> lights;
+  // Set when shading points sample a few lights from this rather than
+  // using every light.
+  const LightBVH* sampler;
 
   Lighting(const Colour& ambient, const std::list<Light*>& lights)
-    : ambient(ambient), lights(lights) {}
+    : ambient(ambient), lights(lights), sampler(NULL) {}
 };
 
+// Closest-hit query record, owned by the caller. Only hits with a ray
+// parameter strictly inside (tMin, tMax) are accepted, and each accepted hit
+// shrinks tMax so that anything farther away is rejected from then on. Ray
+// parameters are unchanged by Ray::transform, so one record can be passed
+// down through every level of the hierarchy.
 // Warning: Normal is not always normalized.
-struct Intersection {
+struct HitRecord {
+  double tMin;
+  double tMax;
+  bool hit;
   Point3D point;
   Vector3D normal;
   Material* material;
+  int object; // Index of the scene instance hit, -1 if unknown.
+
+  HitRecord(double tMin=0.0, double tMax=std::numeric_limits<double>::max())
+    : tMin(tMin), tMax(tMax), hit(false), material(NULL), object(-1) {}
 
-  Intersection(const Point3D& intersection, const Vector3D& normal, Material* material)
-    : point(intersection), normal(normal), material(material) {}
+  bool accepts(double t) const {
+    return t > tMin && t < tMax;
+  }
+
+  void record(double t, const Point3D& p, const Vector3D& n) {
+    tMax = t;
+    hit = true;
+    point = p;
+    normal = n;
+  }
 
-  void transform(const Matrix4x4& mat) {
+  // Move the hit point up by mat and the normal by its normal matrix (the
+  // transpose of its inverse).
+  void transform(const Matrix4x4& mat, const Matrix4x4& normalMat) {
     point = mat * point;
-    normal = mat.invert().transpose() * normal;
+    normal = normalMat * normal;
   }
 };
 
@@ -74,41 +202,122 @@ struct RayTraceStats {
   long bounding_box_checks;
   long bounding_box_hits;
 
-  RayTraceStats(): intersection_checks(0), bounding_box_checks(0), bounding_box_hits(0) {}
+  // Rays cast, by kind, and the thread time spent finding what they hit.
+  // Time is only counted if RENDER_PROFILE is set.
+  long primary_rays;
+  long shadow_rays;
+  long reflection_rays;
+  double primary_seconds;
+  double shadow_seconds;
+  double reflection_seconds;
+
+  // Shadow rays tried against the last thing to block their light first,
+  // and how many it blocked.
+  long shadow_cache_tests;
+  long shadow_cache_hits;
+
+  RayTraceStats(): intersection_checks(0), bounding_box_checks(0), bounding_box_hits(0),
+    primary_rays(0), shadow_rays(0), reflection_rays(0),
+    primary_seconds(0.0), shadow_seconds(0.0), reflection_seconds(0.0),
+    shadow_cache_tests(0), shadow_cache_hits(0) {}
+
+  long rays() const {
+    return primary_rays + shadow_rays + reflection_rays;
+  }
 
   void merge(const RayTraceStats& other) {
     intersection_checks += other.intersection_checks;
     bounding_box_checks += other.bounding_box_checks;
     bounding_box_hits += other.bounding_box_hits;
+    primary_rays += other.primary_rays;
+    shadow_rays += other.shadow_rays;
+    reflection_rays += other.reflection_rays;
+    primary_seconds += other.primary_seconds;
+    shadow_seconds += other.shadow_seconds;
+    reflection_seconds += other.reflection_seconds;
+    shadow_cache_tests += other.shadow_cache_tests;
+    shadow_cache_hits += other.shadow_cache_hits;
   }
 };
 
 inline std::ostream& operator <<(std::ostream& os, const RayTraceStats& stats) {
   return os << "Total Intersection Checks: " << stats.intersection_checks << std::endl
     << "Bounding Box Checks: " << stats.bounding_box_checks << std::endl
-    << "Bounding Box Hits: " << stats.bounding_box_hits << std::endl;
+    << "Bounding Box Hits: " << stats.bounding_box_hits << std::endl
+    << "Rays: " << stats.primary_rays << " primary, " << stats.shadow_rays << " shadow, "
+    << stats.reflection_rays << " reflection" << std::endl
+    << "Shadow Cache Hits: " << stats.shadow_cache_hits << " of " << stats.shadow_cache_tests << std::endl;
+}
+
+
+// Totals for acceleration structures built while constructing the scene.
+struct BVHBuildStats {
+  long structures;
+  long primitives;
+  long nodes;
+  double seconds;
+
+  BVHBuildStats(): structures(0), primitives(0), nodes(0), seconds(0.0) {}
+};
+
+inline std::ostream& operator <<(std::ostream& os, const BVHBuildStats& stats) {
+  return os << "BVHs Built: " << stats.structures << std::endl
+    << "BVH Primitives: " << stats.primitives << std::endl
+    << "BVH Nodes: " << stats.nodes << std::endl
+    << "BVH Build Time: " << stats.seconds << "s" << std::endl;
 }
 
+// FNV-1a over the raw bytes of each value.
+struct KeyHash {
+  unsigned long long value;
+
+  KeyHash(): value(14695981039346656037ULL) {}
+
+  template <typename T>
+  void add(const T& data) {
+    addBytes(&data, sizeof(T));
+  }
+
+  void addBytes(const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++) {
+      value = (value ^ bytes[i]) * 1099511628211ULL;
+    }
+  }
+};
 
-struct RayResult {
-  Colour colour;
-  std::vector<Intersection> intersections;
-  RayTraceStats stats;
+// Wall-clock time in seconds, for reporting how long phases take.
+inline double seconds_now() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
 
-  RayResult(): colour(0.0) {}
-  RayResult(const std::vector<Intersection> is, long n): colour(0.0), intersections(is) {
-    stats.intersection_checks = n;
+// Adds the time between its construction and destruction to total, if
+// RENDER_PROFILE and RAY_TIMERS are set. Uses the monotonic clock, which is
+// fine-grained enough to time a single packet.
+class PhaseTimer {
+public:
+  explicit PhaseTimer(double& total) : m_total(total), m_start(enabled() ? now() : 0.0) {}
+  ~PhaseTimer() {
+    if (enabled()) {
+      m_total += now() - m_start;
+    }
   }
 
-  void merge(const RayResult& other) {
-    intersections.insert(intersections.end(), other.intersections.begin(), other.intersections.end());
-    stats.merge(other.stats);
-    colour = other.colour;
+  static bool enabled() {
+    return RENDER_PROFILE && RAY_TIMERS;
   }
 
-  bool isHit() {
-    return !intersections.empty();
+  static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
   }
+
+private:
+  double& m_total;
+  double m_start;
 };
 
 #endif
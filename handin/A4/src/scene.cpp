@@ -11,41 +11,45 @@ SceneNode::SceneNode(const std::string& name)
 SceneNode::~SceneNode() {
 }
 
+// Each of these knows the inverse of the step it adds, so the inverse and
+// normal matrices are updated without inverting the whole transformation.
 void SceneNode::rotate(char axis, double angleDegrees) {
   double angle = angleDegrees * M_PI / 180.0;
-  m_trans = m_trans * rotation(axis, angle);
-  m_invtrans = m_trans.invert();
+  set_transform(m_trans * rotation(axis, angle), rotation(axis, -angle) * m_invtrans);
 }
 
 void SceneNode::scale(const Vector3D& amount) {
-  m_trans = m_trans * scaling(amount);
-  m_invtrans = m_trans.invert();
+  set_transform(m_trans * scaling(amount),
+                scaling(Vector3D(1.0/amount[X], 1.0/amount[Y], 1.0/amount[Z])) * m_invtrans);
 }
 
 void SceneNode::translate(const Vector3D& amount) {
-  m_trans = m_trans * translation(amount);
-  m_invtrans = m_trans.invert();
+  set_transform(m_trans * translation(amount), translation(-amount) * m_invtrans);
 }
 
 bool SceneNode::is_joint() const {
   return false;
 }
 
-RayResult* SceneNode::findIntersections(const Ray& ray) {
+bool SceneNode::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) {
   Ray transformedRay = ray.transform(get_inverse());
-  RayResult* result = new RayResult(std::vector<Intersection>(), 0);
+  bool found = false;
   for(std::list<SceneNode*>::const_iterator it = m_children.begin(); it != m_children.end(); it++) {
-    RayResult* childResult = (*it)->findIntersections(transformedRay);
-    result->merge(*childResult);
-    delete childResult;
+    if ((*it)->intersect(transformedRay, hit, stats)) {
+      found = true;
+    }
   }
-  transformIntersectionsUp(result->intersections);
-  return result;
+  if (found) {
+    hit.transform(get_transform(), get_normal_transform());
+  }
+  return found;
 }
 
-void SceneNode::transformIntersectionsUp(std::vector<Intersection>& intersections) {
-  for(std::vector<Intersection>::iterator it = intersections.begin(); it != intersections.end(); it++) {
-    it->transform(get_transform());
+void SceneNode::collectInstances(const Matrix4x4& parentTrans, const Matrix4x4& parentInv, std::vector<Instance>& instances) {
+  Matrix4x4 trans = parentTrans * get_transform();
+  Matrix4x4 inv = get_inverse() * parentInv;
+  for(std::list<SceneNode*>::const_iterator it = m_children.begin(); it != m_children.end(); it++) {
+    (*it)->collectInstances(trans, inv, instances);
   }
 }
 
@@ -79,18 +83,22 @@ GeometryNode::GeometryNode(const std::string& name, Primitive* primitive)
 GeometryNode::~GeometryNode() {
 }
 
-RayResult* GeometryNode::findIntersections(const Ray& ray) {
+bool GeometryNode::intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats) {
   Ray transformedRay = ray.transform(get_inverse());
-  RayResult* result = m_primitive->findIntersections(transformedRay);
-  for (std::vector<Intersection>::iterator it = result->intersections.begin(); it != result->intersections.end(); it++) {
-    it->material = m_material;
+  bool found = m_primitive->intersect(transformedRay, hit, stats);
+  if (found) {
+    hit.material = m_material;
+    hit.transform(get_transform(), get_normal_transform());
   }
-  transformIntersectionsUp(result->intersections);
 
-  RayResult* childResult = SceneNode::findIntersections(ray);
-  result->merge(*childResult);
-  delete childResult;
+  if (SceneNode::intersect(ray, hit, stats)) {
+    found = true;
+  }
+  return found;
+}
 
-  return result;
+void GeometryNode::collectInstances(const Matrix4x4& parentTrans, const Matrix4x4& parentInv, std::vector<Instance>& instances) {
+  instances.push_back(Instance(m_primitive, m_material, parentTrans * get_transform(), get_inverse() * parentInv));
+  SceneNode::collectInstances(parentTrans, parentInv, instances);
 }
 
@@ -8,6 +8,20 @@
 #include "material.hpp"
 #include "raytracer.hpp"
 
+// A primitive placed in the world, with every transformation on the path
+// from the root folded into a single matrix, so a hit only has to be moved
+// out to world space once.
+struct Instance {
+  Primitive* primitive;
+  Material* material;
+  Matrix4x4 trans;
+  Matrix4x4 invtrans;
+  Matrix4x4 normaltrans;
+
+  Instance(Primitive* primitive, Material* material, const Matrix4x4& trans, const Matrix4x4& invtrans)
+    : primitive(primitive), material(material), trans(trans), invtrans(invtrans), normaltrans(invtrans.transpose()) {}
+};
+
 class SceneNode {
 public:
   SceneNode(const std::string& name);
@@ -15,15 +29,17 @@ public:
 
   const Matrix4x4& get_transform() const { return m_trans; }
   const Matrix4x4& get_inverse() const { return m_invtrans; }
+  // Transpose of the inverse, for moving normals up.
+  const Matrix4x4& get_normal_transform() const { return m_normaltrans; }
 
   void set_transform(const Matrix4x4& m) {
-    m_trans = m;
-    m_invtrans = m.invert();
+    set_transform(m, m.invert());
   }
 
   void set_transform(const Matrix4x4& m, const Matrix4x4& i) {
     m_trans = m;
     m_invtrans = i;
+    m_normaltrans = i.transpose();
   }
 
   void add_child(SceneNode* child) {
@@ -43,8 +59,13 @@ public:
   // Returns true if and only if this node is a JointNode
   virtual bool is_joint() const;
 
-  virtual RayResult* findIntersections(const Ray& ray);
-  virtual void transformIntersectionsUp(std::vector<Intersection>& intersections);
+  // Closest-hit query against this subtree; ray and hit are in the
+  // coordinate system of this node's parent.
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats);
+
+  // Flatten this subtree into world-space instances, given the accumulated
+  // transformation of this node's parent and its inverse.
+  virtual void collectInstances(const Matrix4x4& parentTrans, const Matrix4x4& parentInv, std::vector<Instance>& instances);
 
 protected:
 
@@ -55,6 +76,7 @@ protected:
   // Transformations
   Matrix4x4 m_trans;
   Matrix4x4 m_invtrans;
+  Matrix4x4 m_normaltrans;
 
   // Hierarchy
   typedef std::list<SceneNode*> ChildList;
@@ -94,7 +116,8 @@ public:
     m_material = material;
   }
 
-  virtual RayResult* findIntersections(const Ray& ray);
+  virtual bool intersect(const Ray& ray, HitRecord& hit, RayTraceStats& stats);
+  virtual void collectInstances(const Matrix4x4& parentTrans, const Matrix4x4& parentInv, std::vector<Instance>& instances);
 
 protected:
   Material* m_material;
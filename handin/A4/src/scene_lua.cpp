@@ -45,6 +45,7 @@
 #include "light.hpp"
 #include "a4.hpp"
 #include "mesh.hpp"
+#include "scenecache.hpp"
 
 // Uncomment the following line to enable debugging messages
 // #define GRLUA_ENABLE_DEBUG
@@ -182,6 +183,80 @@ int gr_cube_cmd(lua_State* L)
   return 1;
 }
 
+// Create a cylinder node
+extern "C"
+int gr_cylinder_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+  
+  const char* name = luaL_checkstring(L, 1);
+  data->node = new GeometryNode(name, new Cylinder());
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// Create a cone node
+extern "C"
+int gr_cone_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+  
+  const char* name = luaL_checkstring(L, 1);
+  data->node = new GeometryNode(name, new Cone());
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// Create a disc node
+extern "C"
+int gr_disc_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+  
+  const char* name = luaL_checkstring(L, 1);
+  data->node = new GeometryNode(name, new Disc());
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// Create a torus node
+extern "C"
+int gr_torus_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+  
+  const char* name = luaL_checkstring(L, 1);
+  double tube = luaL_checknumber(L, 2);
+  luaL_argcheck(L, tube > 0.0, 2, "tube radius must be positive");
+  data->node = new GeometryNode(name, new Torus(tube));
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
 // Create a non-hierarchical sphere node
 extern "C"
 int gr_nh_sphere_cmd(lua_State* L)
@@ -290,6 +365,33 @@ int gr_mesh_cmd(lua_State* L)
   return 1;
 }
 
+// Make a mesh node from an OBJ file, read directly rather than through
+// readobj.lua
+extern "C"
+int gr_obj_mesh_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+
+  const char* name = luaL_checkstring(L, 1);
+  const char* filename = luaL_checkstring(L, 2);
+  scene_cache_dependency(filename);
+
+  // Every mesh read from the same file shares one copy of its geometry.
+  std::string error;
+  Mesh* mesh = Mesh::load(filename, error);
+  luaL_argcheck(L, mesh != NULL, 2, error.c_str());
+  GRLUA_DEBUG(*mesh);
+  data->node = new GeometryNode(name, mesh);
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
 // Make a point light
 extern "C"
 int gr_light_cmd(lua_State* L)
@@ -317,50 +419,173 @@ int gr_light_cmd(lua_State* L)
   return 1;
 }
 
-// Render a scene
-extern "C"
-int gr_render_cmd(lua_State* L)
+// The arguments gr.render and gr.animate both start with.
+struct RenderArgs {
+  SceneNode* root;
+  std::string filename;
+  int width;
+  int height;
+  Point3D eye;
+  Vector3D view;
+  Vector3D up;
+  double fov;
+  Colour ambient;
+  std::list<Light*> lights;
+
+  RenderArgs(): root(NULL), width(0), height(0), fov(0.0), ambient(0.0) {}
+};
+
+// Reads a RenderArgs from the first ten arguments.
+static void get_render_args(lua_State* L, RenderArgs& args)
 {
-  GRLUA_DEBUG_CALL;
-  
   gr_node_ud* root = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
   luaL_argcheck(L, root != 0, 1, "Root node expected");
+  args.root = root->node;
 
-  const char* filename = luaL_checkstring(L, 2);
+  args.filename = luaL_checkstring(L, 2);
 
-  int width = luaL_checknumber(L, 3);
-  int height = luaL_checknumber(L, 4);
+  args.width = luaL_checknumber(L, 3);
+  args.height = luaL_checknumber(L, 4);
 
-  Point3D eye;
-  Vector3D view, up;
-  
-  get_tuple(L, 5, &eye[0], 3);
-  get_tuple(L, 6, &view[0], 3);
-  get_tuple(L, 7, &up[0], 3);
+  get_tuple(L, 5, &args.eye[0], 3);
+  get_tuple(L, 6, &args.view[0], 3);
+  get_tuple(L, 7, &args.up[0], 3);
 
-  double fov = luaL_checknumber(L, 8);
+  args.fov = luaL_checknumber(L, 8);
 
   double ambient_data[3];
   get_tuple(L, 9, ambient_data, 3);
-  Colour ambient(ambient_data[0], ambient_data[1], ambient_data[2]);
+  args.ambient = Colour(ambient_data[0], ambient_data[1], ambient_data[2]);
 
   luaL_checktype(L, 10, LUA_TTABLE);
   int light_count = luaL_getn(L, 10);
   
   luaL_argcheck(L, light_count >= 1, 10, "Tuple of lights expected");
-  std::list<Light*> lights;
   for (int i = 1; i <= light_count; i++) {
     lua_rawgeti(L, 10, i);
     gr_light_ud* ldata = (gr_light_ud*)luaL_checkudata(L, -1, "gr.light");
     luaL_argcheck(L, ldata != 0, 10, "Light expected");
 
-    lights.push_back(ldata->light);
+    args.lights.push_back(ldata->light);
     lua_pop(L, 1);
   }
+}
+
+// Render a scene
+extern "C"
+int gr_render_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  RenderArgs args;
+  get_render_args(L, args);
 
-  a4_render(root->node, filename, width, height,
-            eye, view, up, fov,
-            ambient, lights);
+  scene_cache_render(args.root, args.filename, args.width, args.height,
+                     args.eye, args.view, args.up, args.fov,
+                     args.ambient, args.lights);
+  a4_render(args.root, args.filename, args.width, args.height,
+            args.eye, args.view, args.up, args.fov,
+            args.ambient, args.lights);
+
+  return 0;
+}
+
+// Like get_tuple, but for a value returned from Lua: nil leaves data as it
+// was, and anything but an n-tuple of numbers gives false rather than
+// raising an error.
+template<typename T>
+static bool get_optional_tuple(lua_State* L, int arg, T* data, int n)
+{
+  if (lua_isnil(L, arg)) {
+    return true;
+  }
+  if (!lua_istable(L, arg) || luaL_getn(L, arg) != n) {
+    return false;
+  }
+  for (int i = 1; i <= n; i++) {
+    lua_rawgeti(L, arg, i);
+    const bool number = lua_isnumber(L, -1);
+    if (number) {
+      data[i - 1] = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+    if (!number) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Calls the update function given to gr.animate before each frame. Errors
+// in it are caught here instead of being thrown through the renderer;
+// gr_animate_cmd raises them again once a4_animate has returned.
+struct LuaFrameUpdate : public FrameUpdate {
+  LuaFrameUpdate(lua_State* L, int function, const RenderArgs& args)
+    : L(L), function(function), args(args), failed(false) {}
+
+  virtual bool operator()(int frame, Point3D& eye, Vector3D& view, Vector3D& up, double& fov) {
+    const int top = lua_gettop(L);
+    lua_pushvalue(L, function);
+    lua_pushnumber(L, frame);
+    if (lua_pcall(L, 1, 4, 0) != 0) {
+      // Leaves the error message on the stack.
+      failed = true;
+      return false;
+    }
+
+    bool valid = get_optional_tuple(L, top + 1, &eye[0], 3)
+      && get_optional_tuple(L, top + 2, &view[0], 3)
+      && get_optional_tuple(L, top + 3, &up[0], 3);
+    if (valid && !lua_isnil(L, top + 4)) {
+      valid = lua_isnumber(L, top + 4);
+      fov = valid ? lua_tonumber(L, top + 4) : fov;
+    }
+    lua_settop(L, top);
+    if (!valid) {
+      lua_pushstring(L, "gr.animate update should return eye, view and up tuples and a field of view, or nil for any to keep");
+      failed = true;
+      return false;
+    }
+
+    scene_cache_render(args.root, args.filename, args.width, args.height,
+                       eye, view, up, fov,
+                       args.ambient, args.lights, frame);
+    return true;
+  }
+
+  lua_State* L;
+  int function;
+  const RenderArgs& args;
+  bool failed;
+};
+
+// Render an animation: the arguments to gr.render, then the number of
+// frames and a function called with each frame number (from 1) before it
+// is rendered. The function moves nodes as it likes and can return a new
+// eye, view, up and fov.
+extern "C"
+int gr_animate_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  int frames = luaL_checknumber(L, 11);
+  luaL_argcheck(L, frames >= 1, 11, "Frame count expected");
+  luaL_checktype(L, 12, LUA_TFUNCTION);
+
+  bool failed;
+  {
+    RenderArgs args;
+    get_render_args(L, args);
+
+    LuaFrameUpdate update(L, 12, args);
+    a4_animate(args.root, args.filename, frames, args.width, args.height,
+               args.eye, args.view, args.up, args.fov,
+               args.ambient, args.lights, update);
+    failed = update.failed;
+  }
+  if (failed) {
+    return lua_error(L);
+  }
 
   return 0;
 }
@@ -509,6 +734,21 @@ int gr_node_rotate_cmd(lua_State* L)
   return 0;
 }
 
+// Undo every transformation of a node, e.g. to pose it afresh in each
+// frame of an animation.
+extern "C"
+int gr_node_reset_transform_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+  
+  gr_node_ud* selfdata = (gr_node_ud*)luaL_checkudata(L, 1, "gr.node");
+  luaL_argcheck(L, selfdata != 0, 1, "Node expected");
+
+  selfdata->node->set_transform(Matrix4x4());
+
+  return 0;
+}
+
 // Garbage collection function for lua.
 extern "C"
 int gr_node_gc_cmd(lua_State* L)
@@ -540,11 +780,17 @@ static const luaL_reg grlib_functions[] = {
   {"material", gr_material_cmd},
   // New for assignment 4
   {"cube", gr_cube_cmd},
+  {"cylinder", gr_cylinder_cmd},
+  {"cone", gr_cone_cmd},
+  {"disc", gr_disc_cmd},
+  {"torus", gr_torus_cmd},
   {"nh_sphere", gr_nh_sphere_cmd},
   {"nh_box", gr_nh_box_cmd},
   {"mesh", gr_mesh_cmd},
+  {"obj_mesh", gr_obj_mesh_cmd},
   {"light", gr_light_cmd},
   {"render", gr_render_cmd},
+  {"animate", gr_animate_cmd},
   {0, 0}
 };
 
@@ -567,10 +813,48 @@ static const luaL_reg grlib_node_methods[] = {
   {"scale", gr_node_scale_cmd},
   {"rotate", gr_node_rotate_cmd},
   {"translate", gr_node_translate_cmd},
+  {"reset_transform", gr_node_reset_transform_cmd},
   {"render", gr_render_cmd},
+  {"animate", gr_animate_cmd},
   {0, 0}
 };
 
+// Records a file the script reads, for the scene cache.
+extern "C"
+int gr_dependency_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  scene_cache_dependency(luaL_checkstring(L, 1));
+
+  return 0;
+}
+
+// Run before the scene, with gr_dependency_cmd as its argument, so that
+// every file the script reads through Lua's own functions is recorded.
+// require is followed down package.path the way Lua searches it.
+static const char* dependency_tracking =
+  "local depend = ...\n"
+  "local open, do_file, load_file, require_module = io.open, dofile, loadfile, require\n"
+  "io.open = function(name, ...) depend(name) return open(name, ...) end\n"
+  "dofile = function(name) if name then depend(name) end return do_file(name) end\n"
+  "loadfile = function(name) if name then depend(name) end return load_file(name) end\n"
+  "require = function(name)\n"
+  "  if not package.loaded[name] then\n"
+  "    local base = string.gsub(name, '%.', '/')\n"
+  "    for template in string.gmatch(package.path, '[^;]+') do\n"
+  "      local path = string.gsub(template, '%?', base)\n"
+  "      local file = open(path, 'r')\n"
+  "      if file then\n"
+  "        file:close()\n"
+  "        depend(path)\n"
+  "        break\n"
+  "      end\n"
+  "    end\n"
+  "  end\n"
+  "  return require_module(name)\n"
+  "end\n";
+
 // This function calls the lua interpreter to define the scene and
 // raytrace it as appropriate.
 bool run_lua(const std::string& filename)
@@ -600,6 +884,13 @@ bool run_lua(const std::string& filename)
   // Load the gr functions
   luaL_openlib(L, "gr", grlib_functions, 0);
 
+  if (SCENE_CACHE) {
+    GRLUA_DEBUG("Tracking the files the scene reads");
+    luaL_loadstring(L, dependency_tracking);
+    lua_pushcfunction(L, gr_dependency_cmd);
+    lua_call(L, 1, 0);
+  }
+
   GRLUA_DEBUG("Parsing the scene");
   // Now parse the actual scene
   if (luaL_loadfile(L, filename.c_str()) || lua_pcall(L, 0, 0, 0)) {
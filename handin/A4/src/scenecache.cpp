@@ -0,0 +1,743 @@
+#include "scenecache.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "a4.hpp"
+#include "bvh.hpp"
+#include "mesh.hpp"
+
+#define SCENE_CACHE_MAGIC "A4SCENE"
+
+// Version of what the cache holds. Bump it whenever a change means a script
+// would record something different (e.g. meshes are split up or primitives
+// parameterised differently, or gr.* builds scenes differently) or the
+// records are laid out differently, so caches from older builds are
+// rewritten rather than rendered.
+#define SCENE_CACHE_FORMAT 4
+
+namespace {
+
+// Like checkpoints, caches hold raw structs and are only read back by the
+// same build, as told by build_id.
+struct CacheHeader {
+  char magic[8];
+  unsigned long long build;
+  int dependencies;
+};
+
+// After the header, each dependency's path, size (-1 if it didn't exist)
+// and hash, then records in the order the script made them, each tagged
+// with one of these. Materials, lights, meshes and primitives are numbered
+// in the order they first appear, and later records refer to them by
+// number.
+enum RecordType {
+  MATERIAL_RECORD,
+  LIGHT_RECORD,
+  MESH_RECORD,
+  PRIMITIVE_RECORD,
+  RENDER_RECORD
+};
+
+std::string cache_filename(const std::string& script) {
+  return script + ".cache";
+}
+
+// Size and FNV-1a hash of the file's contents; size is -1 if it can't be
+// read.
+void hash_file(const std::string& path, long long& size, unsigned long long& hash) {
+  KeyHash key;
+  size = -1;
+  std::ifstream in(path.c_str(), std::ios::binary);
+  if (in) {
+    size = 0;
+    char buffer[65536];
+    while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0) {
+      key.addBytes(buffer, in.gcount());
+      size += in.gcount();
+    }
+  }
+  hash = key.value;
+}
+
+class RecordWriter {
+public:
+  template<typename T>
+  void put(const T& value) {
+    m_bytes.append((const char*) &value, sizeof(T));
+  }
+
+  void putString(const std::string& s) {
+    put((int) s.size());
+    m_bytes.append(s);
+  }
+
+  template<typename T>
+  void putArray(const std::vector<T>& values) {
+    put((int) values.size());
+    if (!values.empty()) {
+      m_bytes.append((const char*) &values[0], sizeof(T) * values.size());
+    }
+  }
+
+  const std::string& bytes() const {
+    return m_bytes;
+  }
+
+private:
+  std::string m_bytes;
+};
+
+// Reads back what RecordWriter wrote, straight out of the mapped file.
+// Reads past the end fail, as does everything after them.
+class RecordReader {
+public:
+  RecordReader(const char* begin, const char* end): m_pos(begin), m_end(end), m_ok(true) {}
+
+  bool atEnd() const {
+    return m_pos == m_end;
+  }
+
+  template<typename T>
+  bool get(T& value) {
+    return getBytes(&value, sizeof(T));
+  }
+
+  bool getString(std::string& s) {
+    int size;
+    if (!get(size) || !has(size)) {
+      return false;
+    }
+    s.assign(m_pos, size);
+    m_pos += size;
+    return true;
+  }
+
+  template<typename T>
+  bool getArray(std::vector<T>& values) {
+    int size;
+    if (!get(size) || size < 0 || !has((size_t) size * sizeof(T))) {
+      return false;
+    }
+    values.resize(size);
+    return size == 0 || getBytes(&values[0], sizeof(T) * size);
+  }
+
+private:
+  bool has(size_t size) {
+    m_ok = m_ok && size <= (size_t) (m_end - m_pos);
+    return m_ok;
+  }
+
+  bool getBytes(void* data, size_t size) {
+    if (!has(size)) {
+      return false;
+    }
+    std::memcpy(data, m_pos, size);
+    m_pos += size;
+    return true;
+  }
+
+  const char* m_pos;
+  const char* m_end;
+  bool m_ok;
+};
+
+struct CachedInstance {
+  int primitive;
+  int material;
+  Matrix4x4 trans;
+  Matrix4x4 invtrans;
+};
+
+// Identifies what a build of rt writes to a cache: the format version, the
+// settings that change what is cached, and the size of every struct that is
+// saved raw. Caches with a different id are out of date.
+unsigned long long build_id() {
+  KeyHash key;
+  key.add((int) SCENE_CACHE_FORMAT);
+  key.add((int) sizeof(Scalar));
+  key.add((int) MESH_BVH_LEAF_SIZE);
+  key.add((int) sizeof(Point3D));
+  key.add((int) sizeof(Vector3D));
+  key.add((int) sizeof(Colour));
+  key.add((int) sizeof(Matrix4x4));
+  key.add((int) sizeof(BVH::Node));
+  key.add((int) sizeof(CachedInstance));
+  return key.value;
+}
+
+struct CachedRender {
+  std::string filename;
+  int frame; // Its number in a gr.animate call, whose filename this is, or 0.
+  int width, height;
+  Point3D eye;
+  Vector3D view, up;
+  double fov;
+  Colour ambient;
+  std::vector<int> lights;
+  std::vector<CachedInstance> instances;
+
+  CachedRender(): frame(0), ambient(0.0) {}
+};
+
+// Everything a cache file describes, made into the objects a4_render
+// takes.
+class CachedScene {
+public:
+  ~CachedScene();
+
+  // Reads the records that follow the dependencies.
+  bool read(RecordReader& in);
+
+  // Calls a4_render for each render in turn, and a4_animate for each
+  // animation.
+  void render();
+
+  // Hangs instances off root, one node each, which nodes keeps. If nodes
+  // already holds previous's instances and these are the same primitives
+  // and materials, the nodes are only moved, so the scene BVH can be refit.
+  void pose(SceneNode& root, std::vector<GeometryNode*>& nodes, const CachedRender& render,
+            const CachedRender* previous) const;
+
+  int numRenders() const {
+    return m_renders.size();
+  }
+
+private:
+  bool readMesh(RecordReader& in);
+  bool readPrimitive(RecordReader& in);
+  bool readRender(RecordReader& in);
+
+  std::vector<Material*> m_materials;
+  std::vector<Light*> m_lights;
+  std::vector<MeshGeometry*> m_meshes;
+  std::vector<Primitive*> m_primitives;
+  std::vector<CachedRender> m_renders;
+};
+
+CachedScene::~CachedScene() {
+  for (size_t i = 0; i < m_primitives.size(); i++) {
+    delete m_primitives[i];
+  }
+  for (size_t i = 0; i < m_meshes.size(); i++) {
+    m_meshes[i]->unref();
+  }
+  for (size_t i = 0; i < m_materials.size(); i++) {
+    delete m_materials[i];
+  }
+  for (size_t i = 0; i < m_lights.size(); i++) {
+    delete m_lights[i];
+  }
+}
+
+bool CachedScene::read(RecordReader& in) {
+  while (!in.atEnd()) {
+    int type;
+    if (!in.get(type)) {
+      return false;
+    }
+    bool ok = false;
+    if (type == MATERIAL_RECORD) {
+      Colour kd(0.0), ks(0.0);
+      double shininess, reflectance;
+      ok = in.get(kd) && in.get(ks) && in.get(shininess) && in.get(reflectance);
+      m_materials.push_back(new PhongMaterial(kd, ks, shininess, reflectance));
+    } else if (type == LIGHT_RECORD) {
+      Light* light = new Light();
+      ok = in.get(light->colour) && in.get(light->position) && in.get(light->falloff);
+      m_lights.push_back(light);
+    } else if (type == MESH_RECORD) {
+      ok = readMesh(in);
+    } else if (type == PRIMITIVE_RECORD) {
+      ok = readPrimitive(in);
+    } else if (type == RENDER_RECORD) {
+      ok = readRender(in);
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CachedScene::readMesh(RecordReader& in) {
+  std::vector<Point3D> verts;
+  std::vector<int> corners;
+  std::vector<BVH::Node> nodes;
+  std::vector<int> indices;
+  if (!in.getArray(verts) || !in.getArray(corners) || !in.getArray(nodes) || !in.getArray(indices) ||
+      corners.size() % 3 != 0) {
+    return false;
+  }
+  for (size_t i = 0; i < corners.size(); i++) {
+    if (corners[i] < 0 || corners[i] >= (int) verts.size()) {
+      return false;
+    }
+  }
+  std::vector<MeshGeometry::Face> triangles(corners.size() / 3);
+  for (size_t i = 0; i < triangles.size(); i++) {
+    triangles[i].assign(corners.begin() + 3 * i, corners.begin() + 3 * i + 3);
+  }
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const BVH::Node& node = nodes[i];
+    const bool valid = node.isLeaf() ? node.offset >= 0 && node.offset + node.count <= (int) indices.size()
+      : node.offset > (int) i + 1 && node.offset < (int) nodes.size();
+    if (!valid) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < indices.size(); i++) {
+    if (indices[i] < 0 || indices[i] >= (int) triangles.size()) {
+      return false;
+    }
+  }
+
+  MeshGeometry* geometry = new MeshGeometry(verts, triangles, nodes, indices);
+  geometry->ref();
+  m_meshes.push_back(geometry);
+  return true;
+}
+
+bool CachedScene::readPrimitive(RecordReader& in) {
+  int kind;
+  if (!in.get(kind)) {
+    return false;
+  }
+  Primitive* primitive = NULL;
+  if (kind == SPHERE_PRIMITIVE || kind == BOX_PRIMITIVE) {
+    Point3D pos;
+    double size;
+    if (!in.get(pos) || !in.get(size)) {
+      return false;
+    }
+    primitive = kind == SPHERE_PRIMITIVE ? (Primitive*) new NonhierSphere(pos, size) : new NonhierBox(pos, size);
+  } else if (kind == CYLINDER_PRIMITIVE) {
+    primitive = new Cylinder();
+  } else if (kind == CONE_PRIMITIVE) {
+    primitive = new Cone();
+  } else if (kind == DISC_PRIMITIVE) {
+    primitive = new Disc();
+  } else if (kind == TORUS_PRIMITIVE) {
+    double tube;
+    if (!in.get(tube)) {
+      return false;
+    }
+    primitive = new Torus(tube);
+  } else if (kind == MESH_PRIMITIVE) {
+    int mesh;
+    if (!in.get(mesh) || mesh < 0 || mesh >= (int) m_meshes.size()) {
+      return false;
+    }
+    primitive = new Mesh(m_meshes[mesh]);
+  } else {
+    return false;
+  }
+  m_primitives.push_back(primitive);
+  return true;
+}
+
+bool CachedScene::readRender(RecordReader& in) {
+  CachedRender render;
+  if (!in.getString(render.filename) || !in.get(render.frame) || !in.get(render.width) || !in.get(render.height) ||
+      !in.get(render.eye) || !in.get(render.view) || !in.get(render.up) || !in.get(render.fov) ||
+      !in.get(render.ambient) || !in.getArray(render.lights) || !in.getArray(render.instances)) {
+    return false;
+  }
+  for (size_t i = 0; i < render.lights.size(); i++) {
+    if (render.lights[i] < 0 || render.lights[i] >= (int) m_lights.size()) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < render.instances.size(); i++) {
+    const CachedInstance& instance = render.instances[i];
+    if (instance.primitive < 0 || instance.primitive >= (int) m_primitives.size() ||
+        instance.material < 0 || instance.material >= (int) m_materials.size()) {
+      return false;
+    }
+  }
+  // Frames follow each other from 1.
+  if (render.frame < 0 || (render.frame > 1 && (m_renders.empty() || m_renders.back().frame != render.frame - 1 ||
+                                                m_renders.back().filename != render.filename))) {
+    return false;
+  }
+  m_renders.push_back(render);
+  return true;
+}
+
+// Replays one gr.animate call's frames, render[0] to render[frames - 1].
+class CachedFrameUpdate : public FrameUpdate {
+public:
+  CachedFrameUpdate(const CachedScene& scene, const CachedRender* render, SceneNode& root)
+    : m_scene(scene), m_render(render), m_root(root) {}
+
+  virtual bool operator()(int frame, Point3D& eye, Vector3D& view, Vector3D& up, double& fov) {
+    const CachedRender& render = m_render[frame - 1];
+    m_scene.pose(m_root, m_nodes, render, frame > 1 ? &m_render[frame - 2] : NULL);
+    eye = render.eye;
+    view = render.view;
+    up = render.up;
+    fov = render.fov;
+    return true;
+  }
+
+  const std::vector<GeometryNode*>& nodes() const {
+    return m_nodes;
+  }
+
+private:
+  const CachedScene& m_scene;
+  const CachedRender* m_render;
+  SceneNode& m_root;
+  std::vector<GeometryNode*> m_nodes;
+};
+
+void CachedScene::pose(SceneNode& root, std::vector<GeometryNode*>& nodes, const CachedRender& render,
+                       const CachedRender* previous) const {
+  const std::vector<CachedInstance>& instances = render.instances;
+  bool same = previous != NULL && previous->instances.size() == instances.size() && nodes.size() == instances.size();
+  for (size_t i = 0; same && i < instances.size(); i++) {
+    same = previous->instances[i].primitive == instances[i].primitive &&
+      previous->instances[i].material == instances[i].material;
+  }
+  if (same) {
+    for (size_t i = 0; i < nodes.size(); i++) {
+      nodes[i]->set_transform(instances[i].trans, instances[i].invtrans);
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < nodes.size(); i++) {
+    root.remove_child(nodes[i]);
+    delete nodes[i];
+  }
+  nodes.clear();
+  // Every instance hangs straight off the root with its whole
+  // transformation, which SceneBVH flattens back to the same matrices.
+  for (std::vector<CachedInstance>::const_iterator it = instances.begin(); it != instances.end(); it++) {
+    GeometryNode* node = new GeometryNode("instance", m_primitives[it->primitive]);
+    node->set_material(m_materials[it->material]);
+    node->set_transform(it->trans, it->invtrans);
+    root.add_child(node);
+    nodes.push_back(node);
+  }
+}
+
+void CachedScene::render() {
+  for (size_t i = 0; i < m_renders.size(); ) {
+    const CachedRender& render = m_renders[i];
+    std::list<Light*> lights;
+    for (std::vector<int>::const_iterator it = render.lights.begin(); it != render.lights.end(); it++) {
+      lights.push_back(m_lights[*it]);
+    }
+    SceneNode root("root");
+
+    if (render.frame == 0) {
+      std::vector<GeometryNode*> nodes;
+      pose(root, nodes, render, NULL);
+      a4_render(&root, render.filename, render.width, render.height,
+                render.eye, render.view, render.up, render.fov,
+                render.ambient, lights);
+      for (size_t j = 0; j < nodes.size(); j++) {
+        delete nodes[j];
+      }
+      i++;
+      continue;
+    }
+
+    // An animation is replayed as one, so its scene BVH is refit from frame
+    // to frame as it was when the script ran.
+    size_t frames = 1;
+    while (i + frames < m_renders.size() && m_renders[i + frames].frame == (int) frames + 1) {
+      frames++;
+    }
+    CachedFrameUpdate update(*this, &m_renders[i], root);
+    a4_animate(&root, render.filename, frames, render.width, render.height,
+               render.eye, render.view, render.up, render.fov,
+               render.ambient, lights, update);
+    for (size_t j = 0; j < update.nodes().size(); j++) {
+      delete update.nodes()[j];
+    }
+    i += frames;
+  }
+}
+
+// What the script being cached has rendered and read so far. Objects are
+// numbered by address; the script's scene is never freed before it ends,
+// so an address can't come back as something else.
+struct SceneRecording {
+  bool active;
+  bool cacheable;
+  std::string script;
+  std::vector<std::string> dependencies;
+  std::set<std::string> seen;
+  std::map<const Material*, int> materials;
+  std::map<const Light*, int> lights;
+  std::map<const MeshGeometry*, int> meshes;
+  std::map<const Primitive*, int> primitives;
+  int renders;
+  RecordWriter records;
+
+  SceneRecording(): active(false), cacheable(false), renders(0) {}
+
+  int material(const Material* material);
+  int light(const Light* light);
+  int mesh(const MeshGeometry* mesh);
+  int primitive(const Primitive* primitive);
+};
+
+SceneRecording s_recording;
+
+int SceneRecording::material(const Material* material) {
+  std::map<const Material*, int>::iterator found = materials.find(material);
+  if (found != materials.end()) {
+    return found->second;
+  }
+  const PhongMaterial* phong = dynamic_cast<const PhongMaterial*>(material);
+  if (phong == NULL) {
+    cacheable = false;
+    return -1;
+  }
+  records.put((int) MATERIAL_RECORD);
+  records.put(phong->diffuse());
+  records.put(phong->specular());
+  records.put(phong->shininess());
+  records.put(phong->reflectance());
+  const int index = materials.size();
+  materials[material] = index;
+  return index;
+}
+
+int SceneRecording::light(const Light* light) {
+  std::map<const Light*, int>::iterator found = lights.find(light);
+  if (found != lights.end()) {
+    return found->second;
+  }
+  records.put((int) LIGHT_RECORD);
+  records.put(light->colour);
+  records.put(light->position);
+  records.put(light->falloff);
+  const int index = lights.size();
+  lights[light] = index;
+  return index;
+}
+
+int SceneRecording::mesh(const MeshGeometry* mesh) {
+  std::map<const MeshGeometry*, int>::iterator found = meshes.find(mesh);
+  if (found != meshes.end()) {
+    return found->second;
+  }
+  std::vector<int> corners;
+  corners.reserve(3 * mesh->triangles().size());
+  for (std::vector<MeshGeometry::Face>::const_iterator it = mesh->triangles().begin(); it != mesh->triangles().end(); it++) {
+    corners.insert(corners.end(), it->begin(), it->end());
+  }
+  records.put((int) MESH_RECORD);
+  records.putArray(mesh->verts());
+  records.putArray(corners);
+  records.putArray(mesh->bvh().nodes());
+  records.putArray(mesh->bvh().indices());
+  const int index = meshes.size();
+  meshes[mesh] = index;
+  return index;
+}
+
+int SceneRecording::primitive(const Primitive* primitive) {
+  std::map<const Primitive*, int>::iterator found = primitives.find(primitive);
+  if (found != primitives.end()) {
+    return found->second;
+  }
+  const PrimitiveKind kind = primitive_kind(primitive);
+  if (kind == GENERIC_PRIMITIVE) {
+    cacheable = false;
+    return -1;
+  }
+  // Meshes go first, so the primitive's record can refer to it.
+  const int geometry = kind == MESH_PRIMITIVE ? mesh(static_cast<const Mesh*>(primitive)->geometry()) : -1;
+
+  records.put((int) PRIMITIVE_RECORD);
+  records.put((int) kind);
+  if (kind == SPHERE_PRIMITIVE) {
+    const NonhierSphere* sphere = static_cast<const NonhierSphere*>(primitive);
+    records.put(sphere->position());
+    records.put(sphere->radius());
+  } else if (kind == BOX_PRIMITIVE) {
+    const NonhierBox* box = static_cast<const NonhierBox*>(primitive);
+    records.put(box->position());
+    records.put(box->size());
+  } else if (kind == TORUS_PRIMITIVE) {
+    records.put(static_cast<const Torus*>(primitive)->tube());
+  } else if (kind == MESH_PRIMITIVE) {
+    records.put(geometry);
+  }
+  const int index = primitives.size();
+  primitives[primitive] = index;
+  return index;
+}
+
+}
+
+bool render_scene_cache(const std::string& script) {
+  const std::string filename = cache_filename(script);
+  const double loadStart = seconds_now();
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  void* mapped = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+
+  const char* bytes = (const char*) mapped;
+  RecordReader in(bytes, bytes + info.st_size);
+  CacheHeader header;
+  bool current = in.get(header) && std::memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+    header.build == build_id();
+  for (int i = 0; current && i < header.dependencies; i++) {
+    std::string path;
+    long long size, currentSize;
+    unsigned long long hash, currentHash;
+    current = in.getString(path) && in.get(size) && in.get(hash);
+    if (current) {
+      hash_file(path, currentSize, currentHash);
+      current = size == currentSize && hash == currentHash;
+    }
+  }
+  if (!current) {
+    munmap(mapped, info.st_size);
+    std::cout << "Scene cache " << filename << " is out of date." << std::endl;
+    return false;
+  }
+
+  CachedScene scene;
+  const bool ok = scene.read(in);
+  munmap(mapped, info.st_size);
+  if (!ok) {
+    std::cerr << "Ignoring unreadable scene cache " << filename << std::endl;
+    return false;
+  }
+  std::cout << "Loaded " << scene.numRenders() << " render(s) from scene cache " << filename << " in "
+    << seconds_now() - loadStart << "s." << std::endl;
+  scene.render();
+  return true;
+}
+
+void begin_scene_cache(const std::string& script) {
+  s_recording = SceneRecording();
+  s_recording.active = true;
+  s_recording.cacheable = true;
+  s_recording.script = script;
+  scene_cache_dependency(script);
+}
+
+void scene_cache_dependency(const std::string& path) {
+  if (s_recording.active && s_recording.seen.insert(path).second) {
+    s_recording.dependencies.push_back(path);
+  }
+}
+
+void scene_cache_render(
+  SceneNode* root, const std::string& filename, int width, int height,
+  const Point3D& eye, const Vector3D& view, const Vector3D& up, double fov,
+  const Colour& ambient, const std::list<Light*>& lights, int frame) {
+  if (!s_recording.active || !s_recording.cacheable) {
+    return;
+  }
+
+  // Meshes are recorded with their BVHs.
+  MeshGeometry::buildPending(render_threads());
+
+  std::vector<Instance> instances;
+  root->collectInstances(Matrix4x4(), Matrix4x4(), instances);
+  std::vector<CachedInstance> cached(instances.size());
+  for (size_t i = 0; i < instances.size(); i++) {
+    cached[i].primitive = s_recording.primitive(instances[i].primitive);
+    cached[i].material = s_recording.material(instances[i].material);
+    cached[i].trans = instances[i].trans;
+    cached[i].invtrans = instances[i].invtrans;
+  }
+  std::vector<int> lightIndices;
+  for (std::list<Light*>::const_iterator it = lights.begin(); it != lights.end(); it++) {
+    lightIndices.push_back(s_recording.light(*it));
+  }
+
+  RecordWriter& records = s_recording.records;
+  records.put((int) RENDER_RECORD);
+  records.putString(filename);
+  records.put(frame);
+  records.put(width);
+  records.put(height);
+  records.put(eye);
+  records.put(view);
+  records.put(up);
+  records.put(fov);
+  records.put(ambient);
+  records.putArray(lightIndices);
+  records.putArray(cached);
+  s_recording.renders++;
+}
+
+bool save_scene_cache() {
+  SceneRecording& recording = s_recording;
+  recording.active = false;
+  const std::string filename = cache_filename(recording.script);
+  if (!recording.cacheable) {
+    std::cout << "Not caching " << recording.script << ": it uses a primitive or material the cache can't hold." << std::endl;
+    return false;
+  }
+  if (recording.renders == 0) {
+    return false;
+  }
+
+  // Written beside the real one and moved over it, so a render never sees
+  // half a cache.
+  const std::string temporary = filename + ".tmp";
+  {
+    std::ofstream out(temporary.c_str(), std::ios::binary);
+    CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+    header.build = build_id();
+    header.dependencies = recording.dependencies.size();
+    out.write((const char*) &header, sizeof(header));
+
+    RecordWriter dependencies;
+    for (std::vector<std::string>::const_iterator it = recording.dependencies.begin(); it != recording.dependencies.end(); it++) {
+      long long size;
+      unsigned long long hash;
+      hash_file(*it, size, hash);
+      dependencies.putString(*it);
+      dependencies.put(size);
+      dependencies.put(hash);
+    }
+    out.write(dependencies.bytes().data(), dependencies.bytes().size());
+    out.write(recording.records.bytes().data(), recording.records.bytes().size());
+    if (!out) {
+      std::cerr << "Couldn't write scene cache " << temporary << std::endl;
+      out.close();
+      std::remove(temporary.c_str());
+      return false;
+    }
+  }
+  if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  std::cout << "Saved scene cache " << filename << " (" << recording.renders << " render(s), "
+    << recording.dependencies.size() << " file(s) read)." << std::endl;
+  recording = SceneRecording();
+  return true;
+}
@@ -0,0 +1,49 @@
+#ifndef CS488_SCENECACHE_HPP
+#define CS488_SCENECACHE_HPP
+
+#include <list>
+#include <string>
+#include "algebra.hpp"
+#include "light.hpp"
+#include "scene.hpp"
+
+// Whether rt keeps a compiled copy of each scene script beside it (with
+// ".cache" added to its name) and renders from that instead of running
+// the script again.
+#ifndef SCENE_CACHE
+#define SCENE_CACHE true
+#endif
+
+// The cache holds what each gr.render call in the script was given, with
+// the scene flattened into instances the way SceneBVH sees it, and every
+// mesh already split into triangles with its BVH built. It is only used
+// while the script and every file it read (through gr.obj_mesh, require,
+// dofile, loadfile or io.open) are byte for byte the same as when it was
+// written, and by the same build of rt. Scripts that render something
+// different from run to run without reading a file, e.g. with
+// math.random or os.time, should be run with SCENE_CACHE off.
+
+// Renders everything the cache for script says to, if it is there and
+// still up to date. Returns false, having rendered nothing, otherwise.
+bool render_scene_cache(const std::string& script);
+
+// Starts recording what script renders and reads, for save_scene_cache.
+void begin_scene_cache(const std::string& script);
+
+// Called as the script reads path.
+void scene_cache_dependency(const std::string& path);
+
+// Called with the arguments to each gr.render, before it renders, and
+// before each frame of a gr.animate with the camera for that frame, the
+// filename given to gr.animate and the frame number (from 1). Replaying the
+// cache renders the frames with a4_animate again.
+void scene_cache_render(
+  SceneNode* root, const std::string& filename, int width, int height,
+  const Point3D& eye, const Vector3D& view, const Vector3D& up, double fov,
+  const Colour& ambient, const std::list<Light*>& lights, int frame=0);
+
+// Writes the cache for the script being recorded, once it has run without
+// errors. Returns false if the scene couldn't be cached.
+bool save_scene_cache();
+
+#endif
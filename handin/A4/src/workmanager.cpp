@@ -1,28 +1,99 @@
 #include "workmanager.hpp"
-#include <cmath>
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <unistd.h>
 
 #define WORK_MANAGER_LOG
 
-void WorkManager::getWork(bool& done, int& start, int& end) {
-  pthread_mutex_lock(&work_mutex);
-  if (on_batch >= num_batches) {
-    done = true;
-  } else {
-    done = false;
-    start = on_batch * batch_size;
-    if (on_batch == num_batches - 1) {
-      end = work_amount;
-    } else {
-      end = start + batch_size;
+WorkManager::WorkManager(const Tile& region, int num_threads, bool log, int tile_size)
+  : num_threads(num_threads), log_progress(log), deques(num_threads), tiles_done(0), progress_logged(0) {
+  pthread_mutex_init(&stats_mutex, NULL);
+
+  for (int y = region.y0; y < region.y1; y += tile_size) {
+    for (int x = region.x0; x < region.x1; x += tile_size) {
+      Tile tile;
+      tile.x0 = x;
+      tile.y0 = y;
+      tile.x1 = std::min(region.x1, x + tile_size);
+      tile.y1 = std::min(region.y1, y + tile_size);
+      tiles.push_back(tile);
+    }
+  }
+
+  const unsigned long long count = tiles.size();
+  for (int i = 0; i < num_threads; i++) {
+    unsigned long long head = count * i / num_threads;
+    unsigned long long tail = count * (i + 1) / num_threads;
+    deques[i].range = (head << 32) | tail;
+  }
+}
+
+int WorkManager::defaultThreadCount() {
+  const char* env = getenv("RT_THREADS");
+  if (env != NULL && atoi(env) > 0) {
+    return atoi(env);
+  }
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  return processors > 0 ? processors : 1;
+}
+
+bool WorkManager::popFront(TileDeque& deque, int& index) {
+  while (true) {
+    unsigned long long range = deque.range;
+    unsigned long long head = range >> 32;
+    unsigned long long tail = range & 0xffffffffULL;
+    if (head >= tail) {
+      return false;
+    }
+    if (__sync_bool_compare_and_swap(&deque.range, range, ((head + 1) << 32) | tail)) {
+      index = head;
+      return true;
+    }
+  }
+}
+
+bool WorkManager::popBack(TileDeque& deque, int& index) {
+  while (true) {
+    unsigned long long range = deque.range;
+    unsigned long long head = range >> 32;
+    unsigned long long tail = range & 0xffffffffULL;
+    if (head >= tail) {
+      return false;
     }
+    if (__sync_bool_compare_and_swap(&deque.range, range, (head << 32) | (tail - 1))) {
+      index = tail - 1;
+      return true;
+    }
+  }
+}
+
+bool WorkManager::getWork(int thread, Tile& tile) {
+  int index;
+  bool found = popFront(deques[thread], index);
+  for (int i = 1; !found && i < num_threads; i++) {
+    found = popBack(deques[(thread + i) % num_threads], index);
+  }
+  if (!found) {
+    return false;
+  }
+  tile = tiles[index];
+  return true;
+}
+
+void WorkManager::finishedTile() {
 #ifdef WORK_MANAGER_LOG
-    std::cout << "Done " << std::floor((double) on_batch / num_batches * 100.0) << "%  "
-      << "Taking work [" << start << "," << end << ")" << std::endl;
-#endif
-    on_batch++;
+  const int total = tiles.size();
+  const int done = __sync_add_and_fetch(&tiles_done, 1);
+  if (log_progress && done * 10 / total != (done - 1) * 10 / total) {
+    pthread_mutex_lock(&stats_mutex);
+    if (done * 10 / total > progress_logged) {
+      progress_logged = done * 10 / total;
+      std::cout << "Done " << progress_logged * 10 << "%" << std::endl;
+    }
+    pthread_mutex_unlock(&stats_mutex);
   }
-  pthread_mutex_unlock(&work_mutex);
+#endif
 }
 
 
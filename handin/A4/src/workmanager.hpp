@@ -1,24 +1,41 @@
-
 #ifndef WORKMANAGER_H
 #define WORKMANAGER_H
 
 #include <pthread.h>
+#include <vector>
 #include "raytracer.hpp"
 
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+
+// A rectangle of pixels, [x0, x1) x [y0, y1).
+struct Tile {
+  int x0, y0;
+  int x1, y1;
+};
+
+// Splits the image into square tiles and hands them out to render threads
+// without locking. Each thread starts with its own deque holding a
+// contiguous block of tiles, which it takes from the front; once its deque
+// is empty it steals from the back of the other threads' deques, so a
+// thread stuck on an expensive region doesn't hold up the rest.
 class WorkManager {
 public:
-  WorkManager(int work_amount, int num_batches): work_amount(work_amount), num_batches(num_batches), on_batch(0), batch_size(work_amount/num_batches)  {
-    pthread_mutex_init(&work_mutex, NULL);
-    pthread_mutex_init(&stats_mutex, NULL);
-  }
+  // Splits up the pixels in region. Progress is only printed if log is
+  // set.
+  WorkManager(const Tile& region, int num_threads, bool log, int tile_size=TILE_SIZE);
 
   ~WorkManager() {
-    pthread_mutex_destroy(&work_mutex);
     pthread_mutex_destroy(&stats_mutex);
   }
 
-  // Thread-safe method to get next batch of work.
-  void getWork(bool& done, int& start, int& end);
+  // Thread-safe method to get the next tile for the given thread. Returns
+  // false once every tile has been handed out.
+  bool getWork(int thread, Tile& tile);
+
+  // Thread-safe method to report that a tile from getWork is finished.
+  void finishedTile();
 
   // Thread-safe method to report stats.
   void reportStats(const RayTraceStats& stats);
@@ -27,16 +44,40 @@ public:
     return stats;
   }
 
+  int numThreads() const {
+    return num_threads;
+  }
+
+  int numTiles() const {
+    return tiles.size();
+  }
+
+  // Number of threads to render with: $RT_THREADS if set, otherwise the
+  // number of online processors.
+  static int defaultThreadCount();
+
 private:
-  int work_amount;
-  int num_batches;
-  int on_batch;
-  int batch_size;
+  // Tile indices [head, tail) packed into one word so both ends can be
+  // updated with a single compare-and-swap. Padded to its own cache line.
+  struct TileDeque {
+    volatile unsigned long long range;
+    char padding[64 - sizeof(unsigned long long)];
+  };
+
+  bool popFront(TileDeque& deque, int& index);
+  bool popBack(TileDeque& deque, int& index);
+
+  int num_threads;
+  bool log_progress;
+  std::vector<Tile> tiles;
+  std::vector<TileDeque> deques;
+  volatile int tiles_done;
+  // Last tenth of the tiles reported as done. Guarded by stats_mutex, so
+  // only one thread prints at a time and the lines come out in order.
+  int progress_logged;
   RayTraceStats stats;
-  pthread_mutex_t work_mutex;
   pthread_mutex_t stats_mutex;
 };
 
 
 #endif
-